@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Monoids
+{
+/*
+    Monoids like string concatenation allocate on every combine: each step builds a new
+    string out of two old ones, and the old ones are freed right after. In a parallel
+    reduction, every worker does that at once, and they all end up queueing on the
+    allocator's locks instead of combining.
+
+    None of those temporaries outlive the reduction, though. A ReductionArena gives every
+    thread that takes part its own monotonic buffer, which hands out memory by bumping a
+    pointer and never frees anything, so a combine costs no more than a copy. The buffers
+    go back to the system all at once when the arena is destroyed, at the end of the
+    reduction. The accumulators have to be std::pmr types built on arena.Resource():
+
+        ReductionArena arena{};
+        auto join = [&arena](const auto& lhs, const auto& rhs)
+        {
+            std::pmr::string joined{ lhs, arena.Resource() };
+            return joined += rhs;
+        };
+
+    Since nothing is freed until the end, an arena suits reductions whose temporaries add
+    up to a small multiple of the data, which is the case for a tree of combines. Anything
+    that has to outlive the arena must be copied out of it first.
+*/
+class ReductionArena
+{
+public:
+
+    /*
+        initialBytes is the size of every thread's first buffer. Later buffers grow
+        geometrically, and all of them come from upstream.
+    */
+    explicit ReductionArena(std::size_t initialBytes = 64 * 1024,
+        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : id(NextId()), initialBytes(std::max<std::size_t>(1, initialBytes)), upstream(upstream)
+    {
+    }
+
+    ReductionArena(const ReductionArena&) = delete;
+    ReductionArena& operator=(const ReductionArena&) = delete;
+
+    /*
+        The calling thread's arena, made the first time the thread asks. The lock is only
+        taken then; after that, the thread finds it in a thread local cache.
+
+        Memory from one thread's arena can be freed on another thread, since freeing from
+        a monotonic buffer does nothing.
+    */
+    std::pmr::memory_resource* Resource()
+    {
+        auto& cache = Cache();
+        if (cache.arena == id)
+            return cache.resource;
+
+        std::lock_guard<std::mutex> lock{ mutex };
+        const auto thread = std::this_thread::get_id();
+
+        auto found = std::find_if(std::begin(arenas), std::end(arenas), [thread](const auto& arena) { return arena->owner == thread; });
+        if (found == std::end(arenas))
+        {
+            arenas.push_back(std::make_unique<ThreadArena>(thread, initialBytes, upstream));
+            found = std::prev(std::end(arenas));
+        }
+
+        cache = { id, &(*found)->resource };
+        return cache.resource;
+    }
+
+    /*
+        How many threads have an arena
+    */
+    std::size_t Arenas() const
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        return arenas.size();
+    }
+
+private:
+
+    struct ThreadArena
+    {
+        ThreadArena(std::thread::id owner, std::size_t initialBytes, std::pmr::memory_resource* upstream)
+            : owner(owner), resource(initialBytes, upstream)
+        {
+        }
+
+        std::thread::id owner;
+        std::pmr::monotonic_buffer_resource resource;
+    };
+
+    /*
+        Arenas are told apart by an id rather than their address, since a new arena can be
+        made at the address of one that's gone, and a thread's cache would then point
+        into the old one
+    */
+    struct CachedArena
+    {
+        std::uint64_t arena;
+        std::pmr::memory_resource* resource;
+    };
+
+    static std::uint64_t NextId()
+    {
+        static std::atomic<std::uint64_t> next{ 1 };
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static CachedArena& Cache()
+    {
+        thread_local CachedArena cache{ 0, nullptr };
+        return cache;
+    }
+
+private:
+
+    std::uint64_t id{};
+    std::size_t initialBytes{};
+    std::pmr::memory_resource* upstream{};
+
+    mutable std::mutex mutex{};
+    std::vector<std::unique_ptr<ThreadArena>> arenas{};
+};
+
+}
@@ -0,0 +1,506 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <type_traits>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "fold_kernels.h"
+#include "fork_join.h"
+#include "streaming.h"
+#include "topology.h"
+
+namespace Monoids
+{
+/*
+    How fast a reduction runs depends on things that differ from machine to machine: how
+    many cores there are, how big a leaf has to be before the task overhead stops
+    mattering, which vector width is actually fastest (AVX-512 can lower the clock), and
+    how far ahead to prefetch. Instead of guessing them in a formula, the tuner measures
+    candidates on the current machine and writes the winners to a profile, which is
+    loaded the next time the program starts.
+
+    Configurations are kept per (combine, element type, size class), where the size
+    class is the power of two below the element count, since the best grain for a
+    thousand elements says nothing about the best one for a billion.
+*/
+namespace Tuning
+{
+    struct ReduceConfiguration
+    {
+        // The largest range folded sequentially
+        std::size_t grain{};
+
+        // How many threads the range is split across
+        unsigned threads{};
+
+        Kernels::KernelOptions kernel{};
+
+        // Which CPUs the threads are pinned to, if any. A pinned reduction runs on a pool
+        // of its own with that placement.
+        PlacementPolicy placement = PlacementPolicy::None;
+    };
+
+    /*
+        What Reduce did before there was a tuner: one leaf per hardware thread
+    */
+    inline ReduceConfiguration DefaultConfiguration(std::size_t count)
+    {
+        const auto threads = std::max(1u, std::thread::hardware_concurrency());
+        return { std::max<std::size_t>(1, count / threads), threads, {}, PlacementPolicy::None };
+    }
+
+    inline std::size_t SizeClass(std::size_t count)
+    {
+        std::size_t sizeClass = 0;
+        while (count >>= 1)
+            ++sizeClass;
+
+        return sizeClass;
+    }
+
+    /*
+        The key a configuration is stored under. Type names come from typeid, so a profile
+        is only meaningful to builds from the same compiler, which is fine for a file that
+        describes one machine anyway.
+    */
+    template<typename BinaryOp, typename Value>
+    std::string KeyFor(std::size_t count)
+    {
+        return std::string{ typeid(std::decay_t<BinaryOp>).name() } + "\t" +
+            typeid(std::decay_t<Value>).name() + "\t" + std::to_string(SizeClass(count));
+    }
+
+    /*
+        The winners, one per line:
+
+            combine <tab> element type <tab> size class <tab> grain threads isa prefetch non-temporal placement
+
+        The placement was added later, so it's optional and defaults to none.
+
+        Lines that don't parse are skipped, so an old or hand-edited profile can't break
+        anything; the affected reductions just go back to the defaults.
+    */
+    class Profile
+    {
+    public:
+
+        explicit Profile(std::filesystem::path path)
+            : path(std::move(path))
+        {
+            Load();
+        }
+
+        /*
+            The profile for this process, from FUNCTIONALCPP_PROFILE if that's set, or in
+            the user's cache directory otherwise, since it describes this machine. It's
+            never in the shared temporary directory, where anyone could plant one.
+        */
+        static Profile& Current()
+        {
+            static Profile profile{ DefaultPath() };
+            return profile;
+        }
+
+        /*
+            $XDG_CACHE_HOME or ~/.cache on POSIX, %LOCALAPPDATA% on Windows. Without any of
+            them, the path is empty and the profile only lives in memory.
+        */
+        static std::filesystem::path DefaultPath()
+        {
+            const auto path = Monoids::Detail::ReadEnvironment("FUNCTIONALCPP_PROFILE");
+            if (!path.empty())
+                return path;
+
+#if defined(_WIN32)
+            std::filesystem::path cache{ Monoids::Detail::ReadEnvironment("LOCALAPPDATA") };
+#else
+            std::filesystem::path cache{ Monoids::Detail::ReadEnvironment("XDG_CACHE_HOME") };
+            if (!cache.is_absolute())
+            {
+                const auto home = Monoids::Detail::ReadEnvironment("HOME");
+                cache = home.empty() ? std::filesystem::path{} : std::filesystem::path{ home } / ".cache";
+            }
+#endif
+
+            if (!cache.is_absolute())
+                return {};
+
+            return cache / "functionalcpp" / "profile";
+        }
+
+        std::optional<ReduceConfiguration> Find(const std::string& key) const
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+
+            const auto entry = entries.find(key);
+            if (entry == std::end(entries))
+                return std::nullopt;
+
+            return entry->second;
+        }
+
+        void Set(const std::string& key, const ReduceConfiguration& configuration)
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            entries[key] = configuration;
+            version.fetch_add(1, std::memory_order_release);
+        }
+
+        /*
+            Goes up every time an entry changes, so a configuration that was looked up
+            earlier can tell whether it's still current
+        */
+        std::uint64_t Version() const
+        {
+            return version.load(std::memory_order_acquire);
+        }
+
+        /*
+            Writes the whole profile to a new file next to its path and renames it into
+            place, so a reader never sees half of one. The file is created with a name
+            nobody else has used and fails if it exists, so it can't be a link somebody
+            left there.
+        */
+        void Save() const
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+
+            if (path.empty())
+                return;
+
+            std::ostringstream contents{};
+            for (const auto& [key, configuration] : entries)
+            {
+                contents << key << "\t" << configuration.grain << " " << configuration.threads << " "
+                    << ToString(configuration.kernel.isa) << " " << configuration.kernel.streaming.prefetchBytes << " "
+                    << configuration.kernel.streaming.nonTemporal << " " << ToString(configuration.placement) << "\n";
+            }
+
+            std::error_code error{};
+            if (path.has_parent_path())
+                std::filesystem::create_directories(path.parent_path(), error);
+
+            std::filesystem::path temporary{};
+            const auto file = CreateTemporary(temporary);
+            if (file == nullptr)
+                return;
+
+            const auto text = contents.str();
+            const auto written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+
+            if (std::fclose(file) != 0 || !written)
+            {
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+
+            std::filesystem::rename(temporary, path, error);
+            if (error)
+                std::filesystem::remove(temporary, error);
+        }
+
+        const std::filesystem::path& Path() const
+        {
+            return path;
+        }
+
+    private:
+
+        void Load()
+        {
+            std::ifstream file{ path };
+            std::string line{};
+
+            while (std::getline(file, line))
+            {
+                const auto split = line.rfind('\t');
+                if (split == std::string::npos)
+                    continue;
+
+                std::istringstream fields{ line.substr(split + 1) };
+                ReduceConfiguration configuration{};
+                std::string isa{};
+
+                fields >> configuration.grain >> configuration.threads >> isa
+                    >> configuration.kernel.streaming.prefetchBytes >> configuration.kernel.streaming.nonTemporal;
+
+                if (!fields || configuration.grain == 0 || configuration.threads == 0 ||
+                    configuration.threads > MaximumThreads() || !Monoids::Detail::ParseIsa(isa, configuration.kernel.isa))
+                    continue;
+
+                std::string placement{};
+                if (fields >> placement && !ParsePlacementPolicy(placement, configuration.placement))
+                    continue;
+
+                entries[line.substr(0, split)] = configuration;
+            }
+        }
+
+        /*
+            Creates a file that didn't exist before next to the profile, trying a few names
+            made from the time, a counter and random bits
+        */
+        std::FILE* CreateTemporary(std::filesystem::path& temporary) const
+        {
+            static std::atomic<unsigned> created{ 0 };
+            std::random_device random{};
+
+            for (auto attempt = 0; attempt < 16; ++attempt)
+            {
+                const auto ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+
+                temporary = path;
+                temporary += "." + std::to_string(ticks) + "-" + std::to_string(created++) + "-" + std::to_string(random()) + ".tmp";
+
+                std::FILE* file = nullptr;
+#if defined(_MSC_VER)
+                if (_wfopen_s(&file, temporary.c_str(), L"wx") != 0)
+                    file = nullptr;
+#else
+                file = std::fopen(temporary.c_str(), "wx");
+#endif
+                if (file != nullptr)
+                    return file;
+            }
+
+            return nullptr;
+        }
+
+        /*
+            More threads than this machine has CPUs can't have been measured here, so a
+            line asking for them is from somewhere else
+        */
+        static unsigned MaximumThreads()
+        {
+            return static_cast<unsigned>(std::max<std::size_t>({ 1, Topology::Current().Cpus().size(), std::thread::hardware_concurrency() }));
+        }
+
+    private:
+
+        std::filesystem::path path{};
+        std::map<std::string, ReduceConfiguration> entries{};
+        mutable std::mutex mutex{};
+        std::atomic<std::uint64_t> version{ 1 };
+    };
+
+    /*
+        The configuration to reduce count elements with: the profile's if it has one,
+        the default otherwise.
+
+        Reduce looks this up on every call, and building the key allocates, so every
+        thread remembers what the profile had for each size class until the profile
+        changes.
+    */
+    template<typename BinaryOp, typename Value>
+    ReduceConfiguration ConfigurationFor(std::size_t count)
+    {
+        struct Cached
+        {
+            std::uint64_t version{};
+            std::optional<ReduceConfiguration> configuration{};
+        };
+
+        thread_local std::array<Cached, 64> cache{};
+
+        const auto& profile = Profile::Current();
+        const auto version = profile.Version();
+
+        auto& cached = cache[SizeClass(count)];
+        if (cached.version != version)
+            cached = { version, profile.Find(KeyFor<BinaryOp, Value>(count)) };
+
+        return cached.configuration.value_or(DefaultConfiguration(count));
+    }
+
+    namespace Detail
+    {
+        /*
+            Reduce's divide and conquer on the fork-join pool, except that only threads
+            leaves ever run at once: each split gives half of its threads to either side,
+            and once a side is down to one, it recurses without forking anything.
+        */
+        template<typename Iterator, typename Value, typename BinaryOp>
+        Value ConfiguredReduce(ForkJoinPool& pool, Iterator begin, Iterator end, const Value& init, const BinaryOp& combine,
+            const ReduceConfiguration& configuration, unsigned threads)
+        {
+            const auto size = static_cast<std::size_t>(std::distance(begin, end));
+            if (size <= std::max<std::size_t>(1, configuration.grain))
+                return Kernels::Reduce(begin, end, init, combine, configuration.kernel);
+
+            const auto middle = std::next(begin, static_cast<std::ptrdiff_t>(size / 2));
+
+            if (threads <= 1)
+            {
+                auto lhs = ConfiguredReduce(pool, begin, middle, init, combine, configuration, 1);
+                return combine(std::move(lhs), ConfiguredReduce(pool, middle, end, init, combine, configuration, 1));
+            }
+
+            const auto lhsThreads = threads / 2;
+            auto results = pool.Fork(
+                [&] { return ConfiguredReduce(pool, begin, middle, init, combine, configuration, lhsThreads); },
+                [&] { return ConfiguredReduce(pool, middle, end, init, combine, configuration, threads - lhsThreads); });
+
+            return combine(std::move(results.first), std::move(results.second));
+        }
+
+        template<typename Fn>
+        double Fastest(Fn&& run, std::size_t repetitions)
+        {
+            using Clock = std::chrono::steady_clock;
+            auto fastest = std::numeric_limits<double>::infinity();
+
+            for (std::size_t i = 0; i < std::max<std::size_t>(1, repetitions); ++i)
+            {
+                const auto start = Clock::now();
+                run();
+                fastest = std::min(fastest, std::chrono::duration<double>(Clock::now() - start).count());
+            }
+
+            return fastest;
+        }
+    }
+
+    /*
+        Reduces [begin, end) with an explicit configuration. Like Reduce, init has to be
+        the identity, since every leaf starts from it. This is the engine Reduce runs, so
+        what the tuner measures with it is what Reduce gets.
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    Value Reduce(Iterator begin, Iterator end, const Value& init, const BinaryOp& combine, const ReduceConfiguration& configuration)
+    {
+        // Never more threads than CPUs, and only one thread per core is the point of that
+        // policy, so there can't be more than cores either
+        const auto& topology = Topology::Current();
+        const auto cpus = configuration.placement == PlacementPolicy::PhysicalCoresOnly ? topology.Cores() : topology.Cpus().size();
+
+        auto capped = configuration;
+        capped.threads = std::max(1u, std::min(configuration.threads, static_cast<unsigned>(std::max<std::size_t>(1, cpus))));
+
+        return Reduce(ForkJoinPool::Placed(configuration.placement), begin, end, init, combine, capped);
+    }
+
+    /*
+        The same, on a pool of the caller's instead of the one the placement picks. No
+        more leaves run at once than the pool has threads.
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    Value Reduce(ForkJoinPool& pool, Iterator begin, Iterator end, const Value& init, const BinaryOp& combine,
+        const ReduceConfiguration& configuration)
+    {
+        const auto threads = std::max(1u, std::min(configuration.threads, pool.Threads()));
+        return Detail::ConfiguredReduce(pool, begin, end, init, combine, configuration, threads);
+    }
+
+    /*
+        Reduces [begin, end) with whatever the profile says is fastest for it
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    Value Reduce(Iterator begin, Iterator end, const Value& init, const BinaryOp& combine)
+    {
+        const auto count = static_cast<std::size_t>(std::distance(begin, end));
+        return Reduce(begin, end, init, combine, ConfigurationFor<BinaryOp, Value>(count));
+    }
+
+    struct TuningResult
+    {
+        ReduceConfiguration configuration{};
+        double seconds{};
+    };
+
+    /*
+        Measures reductions of count copies of value with combine, keeps the fastest
+        configuration in the profile and saves it. The search is greedy, one dimension at a
+        time, starting from the defaults: threads, then grain, then the vector width, then
+        the prefetch distance and hint, then where the threads are pinned. The dimensions
+        mostly don't interact, and a full grid would take minutes.
+    */
+    template<typename Value, typename BinaryOp>
+    TuningResult TuneReduce(const BinaryOp& combine, const Value& identity, std::size_t count,
+        const Value& value, std::size_t repetitions = 3)
+    {
+        const std::vector<Value> data(std::max<std::size_t>(1, count), value);
+        const auto hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+
+        TuningResult best{ DefaultConfiguration(data.size()), std::numeric_limits<double>::infinity() };
+
+        auto measure = [&](const ReduceConfiguration& candidate)
+        {
+            const auto seconds = Detail::Fastest([&] { Reduce(std::begin(data), std::end(data), identity, combine, candidate); }, repetitions);
+
+            if (seconds < best.seconds)
+                best = { candidate, seconds };
+        };
+
+        measure(best.configuration);
+
+        // Threads, each with one leaf per thread
+        for (auto threads = 1u; threads <= hardwareThreads; threads *= 2)
+            measure({ std::max<std::size_t>(1, data.size() / threads), threads, best.configuration.kernel, best.configuration.placement });
+
+        // Grain, from one leaf per thread down to sixteen
+        for (const auto leavesPerThread : { 2u, 4u, 8u, 16u })
+        {
+            auto candidate = best.configuration;
+            candidate.grain = std::max<std::size_t>(1, data.size() / (candidate.threads * leavesPerThread));
+            measure(candidate);
+        }
+
+        // Vector width, up to what the machine has
+        for (const auto isa : { Isa::Scalar, Isa::Sse42, Isa::Avx2, Isa::Avx512 })
+        {
+            if (isa > DetectedIsa())
+                break;
+
+            auto candidate = best.configuration;
+            candidate.kernel.isa = isa;
+            measure(candidate);
+        }
+
+        // Prefetching
+        for (const auto nonTemporal : { false, true })
+        {
+            for (const auto distance : { 0, 256, 512, 1024, 2048 })
+            {
+                auto candidate = best.configuration;
+                candidate.kernel.streaming = { static_cast<std::size_t>(distance), nonTemporal };
+                measure(candidate);
+            }
+        }
+
+        // Placement
+        for (const auto placement : { PlacementPolicy::Compact, PlacementPolicy::Scatter, PlacementPolicy::PhysicalCoresOnly })
+        {
+            auto candidate = best.configuration;
+            candidate.placement = placement;
+            measure(candidate);
+        }
+
+        auto& profile = Profile::Current();
+        profile.Set(KeyFor<BinaryOp, Value>(data.size()), best.configuration);
+        profile.Save();
+
+        return best;
+    }
+}
+
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fold_kernels.h"
+#include "mpmc_queue.h"
+
+namespace Monoids
+{
+/*
+    Reduce splits its range in halves, which takes random access (or at least a second
+    pass) to find the middle. A stream read through input iterators (lines of a file,
+    records off a socket, a generator) can only be walked once, front to back, so it
+    can't be split at all.
+
+    It can be cut into batches as it's read, though. The calling thread reads K elements
+    at a time into a buffer and hands it to a worker, which folds it while the next batch
+    is read. The buffers come from a fixed pool and go back to it once their partial
+    result has been used, so however long the stream is, no more than buffers x K
+    elements are ever held. When the pool runs dry, reading waits for the workers.
+
+    This pays off when combining is expensive compared to reading. For a cheap combine,
+    reading is the bottleneck and one thread is as fast.
+*/
+struct BatchedReduceOptions
+{
+    // Elements per batch
+    std::size_t batchSize = 4096;
+
+    // The number of batch buffers. 0 means twice as many as there are workers.
+    std::size_t buffers = 0;
+
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+
+    // Let the partial results be combined in whatever order the batches finish in. Each
+    // worker then keeps its own running result, and nothing waits on a slow batch.
+    bool commutative = false;
+};
+
+namespace Detail
+{
+    template<typename Item, typename Value>
+    struct Batch
+    {
+        std::vector<Item> items{};
+        std::uint64_t sequence{};
+        std::optional<Value> partial{};
+    };
+}
+
+/*
+    Reduces [first, last) in parallel, reading it exactly once. init has to be the
+    identity of combine, like it is for Reduce, since every batch starts from it.
+
+    Unless options.commutative is set, the partial results are combined in the order
+    their batches were read, so combine only has to be associative. A batch that finishes
+    early waits (holding its buffer) for the ones before it.
+*/
+template<typename InputIterator, typename Value, typename BinaryOp>
+Value BatchedReduce(InputIterator first, InputIterator last, Value init, BinaryOp combine,
+    const BatchedReduceOptions& options = {})
+{
+    using Item = typename std::iterator_traits<InputIterator>::value_type;
+    using Batch = Detail::Batch<Item, Value>;
+
+    const auto workerCount = std::max(1u, options.workers);
+    const auto batchSize = std::max<std::size_t>(1, options.batchSize);
+    const auto bufferCount = options.buffers != 0 ? options.buffers : 2 * static_cast<std::size_t>(workerCount);
+
+    std::vector<Batch> batches(bufferCount);
+    MpmcQueue<Batch*> empty{ bufferCount };
+    MpmcQueue<Batch*> full{ bufferCount };
+
+    for (auto& batch : batches)
+    {
+        batch.items.reserve(batchSize);
+        empty.Push(&batch);
+    }
+
+    // In order, the batches that are done wait in the slot for their sequence number
+    // until every batch before them has been combined. At most bufferCount batches are
+    // in flight, so their slots never collide.
+    std::mutex orderMutex{};
+    std::vector<Batch*> finished(bufferCount, nullptr);
+    std::uint64_t next = 0;
+    auto ordered = init;
+
+    // Commutative, every worker has its own result
+    std::vector<Value> unordered(workerCount, init);
+
+    std::mutex errorMutex{};
+    std::exception_ptr error{};
+
+    auto fail = [&]
+    {
+        {
+            std::lock_guard<std::mutex> lock{ errorMutex };
+            if (!error)
+                error = std::current_exception();
+        }
+
+        empty.Close();
+        full.Close();
+    };
+
+    auto recycle = [&empty](Batch* batch)
+    {
+        batch->items.clear();
+        batch->partial.reset();
+        empty.Push(batch);
+    };
+
+    auto work = [&](unsigned worker)
+    {
+        auto op = combine;
+        Batch* batch = nullptr;
+
+        while (full.Pop(batch))
+        {
+            try
+            {
+                auto partial = Kernels::Reduce(std::begin(batch->items), std::end(batch->items), init, op);
+
+                if (options.commutative)
+                {
+                    unordered[worker] = op(unordered[worker], partial);
+                    recycle(batch);
+                    continue;
+                }
+
+                batch->partial = std::move(partial);
+
+                // Combining under the lock keeps the order, and it's one combine per batch
+                std::lock_guard<std::mutex> lock{ orderMutex };
+                finished[batch->sequence % bufferCount] = batch;
+
+                while (const auto ready = finished[next % bufferCount])
+                {
+                    ordered = op(ordered, *ready->partial);
+                    finished[next % bufferCount] = nullptr;
+                    ++next;
+                    recycle(ready);
+                }
+            }
+            catch (...)
+            {
+                fail();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers{};
+    for (auto i = 0u; i < workerCount; ++i)
+        workers.emplace_back(work, i);
+
+    try
+    {
+        std::uint64_t sequence = 0;
+        Batch* batch = nullptr;
+
+        while (first != last && empty.Pop(batch))
+        {
+            batch->sequence = sequence++;
+            for (; first != last && batch->items.size() < batchSize; ++first)
+                batch->items.push_back(*first);
+
+            if (!full.Push(batch))
+                break;
+        }
+    }
+    catch (...)
+    {
+        fail();
+    }
+
+    full.Close();
+    for (auto& worker : workers)
+        worker.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    if (!options.commutative)
+        return ordered;
+
+    auto result = init;
+    for (const auto& partial : unordered)
+        result = combine(result, partial);
+
+    return result;
+}
+
+}
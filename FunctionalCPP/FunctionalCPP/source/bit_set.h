@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    Word-at-a-time kernels for combining bit sets, one per instruction set like the fold
+    kernels, and the table that picks between them at run time. Each one combines source
+    into target in place.
+*/
+namespace Kernels
+{
+    enum class BitwiseKind
+    {
+        Or,
+        And,
+        AndNot,
+    };
+
+    using BitwiseKernel = void(*)(std::uint64_t*, const std::uint64_t*, std::size_t);
+
+    template<BitwiseKind Kind>
+    void ScalarBitwise(std::uint64_t* target, const std::uint64_t* source, std::size_t words)
+    {
+        for (std::size_t i = 0; i < words; ++i)
+        {
+            if constexpr (Kind == BitwiseKind::Or) target[i] |= source[i];
+            else if constexpr (Kind == BitwiseKind::And) target[i] &= source[i];
+            else target[i] &= ~source[i];
+        }
+    }
+
+#if defined(FUNCTIONALCPP_X86)
+
+    // The vector intrinsics' andnot negates its first operand, so the source goes first
+    template<BitwiseKind Kind>
+    FUNCTIONALCPP_TARGET("sse4.2") void Sse42Bitwise(std::uint64_t* target, const std::uint64_t* source, std::size_t words)
+    {
+        std::size_t i = 0;
+        for (; i + 2 <= words; i += 2)
+        {
+            const auto lhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target + i));
+            const auto rhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+
+            if constexpr (Kind == BitwiseKind::Or) _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_or_si128(lhs, rhs));
+            else if constexpr (Kind == BitwiseKind::And) _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_and_si128(lhs, rhs));
+            else _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_andnot_si128(rhs, lhs));
+        }
+
+        ScalarBitwise<Kind>(target + i, source + i, words - i);
+    }
+
+    template<BitwiseKind Kind>
+    FUNCTIONALCPP_TARGET("avx2") void Avx2Bitwise(std::uint64_t* target, const std::uint64_t* source, std::size_t words)
+    {
+        std::size_t i = 0;
+        for (; i + 4 <= words; i += 4)
+        {
+            const auto lhs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(target + i));
+            const auto rhs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+
+            if constexpr (Kind == BitwiseKind::Or) _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_or_si256(lhs, rhs));
+            else if constexpr (Kind == BitwiseKind::And) _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_and_si256(lhs, rhs));
+            else _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_andnot_si256(rhs, lhs));
+        }
+
+        ScalarBitwise<Kind>(target + i, source + i, words - i);
+    }
+
+    template<BitwiseKind Kind>
+    FUNCTIONALCPP_TARGET("avx512f") void Avx512Bitwise(std::uint64_t* target, const std::uint64_t* source, std::size_t words)
+    {
+        std::size_t i = 0;
+        for (; i + 8 <= words; i += 8)
+        {
+            const auto lhs = _mm512_loadu_si512(target + i);
+            const auto rhs = _mm512_loadu_si512(source + i);
+
+            if constexpr (Kind == BitwiseKind::Or) _mm512_storeu_si512(target + i, _mm512_or_si512(lhs, rhs));
+            else if constexpr (Kind == BitwiseKind::And) _mm512_storeu_si512(target + i, _mm512_and_si512(lhs, rhs));
+            else _mm512_storeu_si512(target + i, _mm512_andnot_si512(rhs, lhs));
+        }
+
+        ScalarBitwise<Kind>(target + i, source + i, words - i);
+    }
+
+#endif
+
+    template<BitwiseKind Kind>
+    BitwiseKernel SelectBitwiseKernel(Isa isa)
+    {
+#if defined(FUNCTIONALCPP_X86)
+        if (isa >= Isa::Avx512)
+            return &Avx512Bitwise<Kind>;
+
+        if (isa >= Isa::Avx2)
+            return &Avx2Bitwise<Kind>;
+
+        if (isa >= Isa::Sse42)
+            return &Sse42Bitwise<Kind>;
+#else
+        (void)isa;
+#endif
+        return &ScalarBitwise<Kind>;
+    }
+
+    /*
+        Combines words words of source into target with the best kernel for the selected
+        instruction set
+    */
+    template<BitwiseKind Kind>
+    void Bitwise(std::uint64_t* target, const std::uint64_t* source, std::size_t words)
+    {
+        static const BitwiseKernel kernel = SelectBitwiseKernel<Kind>(SelectedIsa());
+        kernel(target, source, words);
+    }
+
+    /*
+        The number of bits set in words. Four independent counts keep the population
+        count instructions from waiting on each other's additions.
+    */
+    inline std::size_t CountBits(const std::uint64_t* words, std::size_t count)
+    {
+        std::size_t counts[4]{};
+
+        std::size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            counts[0] += PopCount(words[i]);
+            counts[1] += PopCount(words[i + 1]);
+            counts[2] += PopCount(words[i + 2]);
+            counts[3] += PopCount(words[i + 3]);
+        }
+
+        for (; i < count; ++i)
+            counts[0] += PopCount(words[i]);
+
+        return counts[0] + counts[1] + counts[2] + counts[3];
+    }
+}
+
+/*
+    A set of small non-negative integers (ids, indices, enumerators), one bit each. When
+    the ids are dense, this is the smallest and fastest set there is: union, intersection
+    and difference combine 64 ids per word, and a few words per instruction with the
+    vector kernels. It grows to fit the largest id inserted, so ids should be dense from
+    zero; a set of sparse or huge ids wants a hash set instead.
+*/
+class DenseBitSet
+{
+public:
+
+    using value_type = std::size_t;
+
+    DenseBitSet() = default;
+
+    /*
+        Makes room for ids below universe up front
+    */
+    explicit DenseBitSet(std::size_t universe)
+        : words((universe + 63) / 64, 0)
+    {
+    }
+
+    void Insert(std::size_t id)
+    {
+        if (id / 64 >= words.size())
+            words.resize(id / 64 + 1, 0);
+
+        words[id / 64] |= std::uint64_t{ 1 } << (id % 64);
+    }
+
+    bool Contains(std::size_t id) const
+    {
+        return id / 64 < words.size() && ((words[id / 64] >> (id % 64)) & 1) != 0;
+    }
+
+    void Merge(const DenseBitSet& other)
+    {
+        if (other.words.size() > words.size())
+            words.resize(other.words.size(), 0);
+
+        Kernels::Bitwise<Kernels::BitwiseKind::Or>(words.data(), other.words.data(), other.words.size());
+    }
+
+    void IntersectWith(const DenseBitSet& other)
+    {
+        // Nothing past the end of other is in it
+        words.resize(std::min(words.size(), other.words.size()));
+        Kernels::Bitwise<Kernels::BitwiseKind::And>(words.data(), other.words.data(), words.size());
+    }
+
+    /*
+        Removes every id other has
+    */
+    void Subtract(const DenseBitSet& other)
+    {
+        Kernels::Bitwise<Kernels::BitwiseKind::AndNot>(words.data(), other.words.data(), std::min(words.size(), other.words.size()));
+    }
+
+    /*
+        The number of ids in the set. It's counted, not stored, so it takes a pass over
+        the words.
+    */
+    std::size_t Size() const
+    {
+        return Kernels::CountBits(words.data(), words.size());
+    }
+
+    /*
+        Calls fn with every id, in increasing order
+    */
+    template<typename Fn>
+    void ForEach(const Fn& fn) const
+    {
+        for (std::size_t word = 0; word < words.size(); ++word)
+        {
+            for (auto bits = words[word]; bits != 0; bits &= bits - 1)
+                fn(word * 64 + PopCount((bits & (~bits + 1)) - 1));
+        }
+    }
+
+private:
+
+    std::vector<std::uint64_t> words{};
+};
+
+template<>
+struct IsIdempotent<Union<DenseBitSet>> : std::true_type {};
+
+}
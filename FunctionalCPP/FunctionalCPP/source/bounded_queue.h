@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace Monoids
+{
+/*
+    A queue between threads that holds at most capacity items. Push blocks while it's
+    full, which is what keeps a fast producer from running arbitrarily far ahead of slow
+    consumers, and Pop blocks while it's empty.
+
+    Closing it wakes everyone up. After that, Push refuses new items and Pop hands out
+    whatever is left, then reports that there's nothing more coming.
+*/
+template<typename T>
+class BoundedQueue
+{
+public:
+
+    explicit BoundedQueue(std::size_t capacity)
+        : capacity(std::max<std::size_t>(1, capacity))
+    {
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /*
+        false if the queue was closed, in which case item wasn't added
+    */
+    bool Push(T item)
+    {
+        std::unique_lock<std::mutex> lock{ mutex };
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+
+        if (closed)
+            return false;
+
+        items.push_back(std::move(item));
+        lock.unlock();
+
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /*
+        false once the queue is closed and empty
+    */
+    bool Pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock{ mutex };
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+
+        if (items.empty())
+            return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+
+        notFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            closed = true;
+        }
+
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+
+    std::size_t capacity{};
+    std::deque<T> items{};
+    bool closed{};
+
+    std::mutex mutex{};
+    std::condition_variable notFull{};
+    std::condition_variable notEmpty{};
+};
+
+}
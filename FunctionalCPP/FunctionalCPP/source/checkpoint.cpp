@@ -0,0 +1,27 @@
+#include "checkpoint.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+namespace Monoids
+{
+namespace Detail
+{
+    bool FlushFileToDisk(const std::filesystem::path& path)
+    {
+        const auto handle = ::CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+
+        const auto synced = ::FlushFileBuffers(handle) != 0;
+        ::CloseHandle(handle);
+        return synced;
+    }
+}
+}
+
+#endif
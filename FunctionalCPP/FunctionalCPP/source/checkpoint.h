@@ -0,0 +1,316 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "serialization.h"
+
+namespace Monoids
+{
+/*
+    What a resumable reduction writes to disk: how far it got, the partial result up to
+    there, and enough about the input to notice if it's resumed against different data.
+    That's its size, a fingerprint of a sample of its elements, and whatever id the
+    caller gave it.
+*/
+template<typename Value>
+struct Checkpoint
+{
+    std::uint64_t count;
+    std::uint64_t chunkSize;
+    std::uint64_t fingerprint;
+    std::string inputId;
+    std::uint64_t nextChunk;
+    Value partial;
+};
+
+template<typename Value>
+struct Serializer<Checkpoint<Value>>
+{
+    static void Write(BinaryWriter& writer, const Checkpoint<Value>& checkpoint)
+    {
+        writer.WriteVarint(checkpoint.count);
+        writer.WriteVarint(checkpoint.chunkSize);
+        writer.WriteRaw(checkpoint.fingerprint);
+        Serializer<std::string>::Write(writer, checkpoint.inputId);
+        writer.WriteVarint(checkpoint.nextChunk);
+        Serializer<Value>::Write(writer, checkpoint.partial);
+    }
+
+    static Checkpoint<Value> Read(BinaryReader& reader)
+    {
+        const auto count = reader.ReadVarint();
+        const auto chunkSize = reader.ReadVarint();
+        const auto fingerprint = reader.ReadRaw<std::uint64_t>();
+        auto inputId = Serializer<std::string>::Read(reader);
+        const auto nextChunk = reader.ReadVarint();
+        return { count, chunkSize, fingerprint, std::move(inputId), nextChunk, Serializer<Value>::Read(reader) };
+    }
+};
+
+struct CheckpointOptions
+{
+    // Where the checkpoint lives. It's removed once the reduction finishes.
+    std::filesystem::path path;
+
+    // The unit of progress: a crash loses at most the chunks since the last checkpoint
+    std::size_t chunkSize = 1 << 20;
+
+    // The fraction of the running time that may be spent writing checkpoints
+    double maximumOverhead = 0.01;
+
+    // Bump this when the layout of the partial value changes, so old checkpoints are ignored
+    std::uint32_t stateVersion = 0;
+
+    // Names the input (a file name and its modification time, a query...), so that a
+    // checkpoint for other data of the same size isn't resumed. The fingerprint of
+    // sampled elements catches most of that on its own, but not every element type
+    // can be fingerprinted.
+    std::string inputId{};
+
+    // Called after every checkpoint with the number of chunks done and the total
+    std::function<void(std::size_t, std::size_t)> onCheckpoint{};
+};
+
+namespace Detail
+{
+#if defined(_WIN32)
+    // FlushFileBuffers, in checkpoint.cpp, so that windows.h and its macros stay out of
+    // every header that includes this one
+    bool FlushFileToDisk(const std::filesystem::path& path);
+#endif
+
+    /*
+        A fingerprint of the input from the bytes of up to 64 elements spread evenly
+        across it. Hashing all of it would cost as much as the reduction, and a sample is
+        enough to notice different data in most cases. It's only taken when the
+        elements' bytes are their value (numbers, and structs without padding) and the
+        iterators can jump to the samples; otherwise it's always the same, and only the
+        size and the input id are checked.
+    */
+    template<typename Iterator>
+    std::uint64_t SampleFingerprint(Iterator begin, std::uint64_t count)
+    {
+        using Element = typename std::iterator_traits<Iterator>::value_type;
+        using Category = typename std::iterator_traits<Iterator>::iterator_category;
+
+        // FNV-1a
+        std::uint64_t hash = 14695981039346656037ull;
+
+        if constexpr ((std::is_arithmetic_v<Element> || std::has_unique_object_representations_v<Element>) &&
+            std::is_base_of_v<std::random_access_iterator_tag, Category>)
+        {
+            const auto samples = std::min<std::uint64_t>(64, count);
+            for (std::uint64_t i = 0; i < samples; ++i)
+            {
+                const Element element = begin[static_cast<std::ptrdiff_t>(i * count / samples)];
+                const auto bytes = reinterpret_cast<const unsigned char*>(&element);
+
+                for (std::size_t byte = 0; byte < sizeof(Element); ++byte)
+                {
+                    hash ^= bytes[byte];
+                    hash *= 1099511628211ull;
+                }
+            }
+        }
+
+        return hash;
+    }
+
+    /*
+        Writes what's been written to path through to the disk, rather than leaving it in
+        the page cache, where a power cut would lose it. On POSIX, syncing the directory
+        is what makes a rename in it durable; Windows journals renames, and has no
+        handle to sync a directory with.
+    */
+    inline bool SyncToDisk(const std::filesystem::path& path, bool directory)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const auto descriptor = ::open(path.c_str(), directory ? O_RDONLY : O_WRONLY);
+        if (descriptor == -1)
+            return false;
+
+        const auto synced = ::fsync(descriptor) == 0;
+        ::close(descriptor);
+        return synced;
+#elif defined(_WIN32)
+        return directory || FlushFileToDisk(path);
+#else
+        (void)path;
+        (void)directory;
+        return true;
+#endif
+    }
+}
+
+/*
+    Loads the checkpoint at path if there is one and it was written for the same input.
+    A checkpoint that can't be read (torn, old version, other data) is just ignored,
+    since starting over is always correct.
+*/
+template<typename Value>
+std::optional<Checkpoint<Value>> LoadCheckpoint(const CheckpointOptions& options, std::uint64_t count, std::uint64_t fingerprint)
+{
+    std::error_code error{};
+    const auto size = std::filesystem::file_size(options.path, error);
+    if (error)
+        return std::nullopt;
+
+    std::vector<unsigned char> buffer(static_cast<std::size_t>(size));
+    std::ifstream file{ options.path, std::ios::in | std::ios::binary };
+    file.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+
+    if (!file)
+        return std::nullopt;
+
+    try
+    {
+        auto checkpoint = Decode<Checkpoint<Value>>(buffer, options.stateVersion);
+        if (checkpoint.count != count || checkpoint.chunkSize != options.chunkSize ||
+            checkpoint.fingerprint != fingerprint || checkpoint.inputId != options.inputId)
+            return std::nullopt;
+
+        return checkpoint;
+    }
+    catch (const SerializationError&)
+    {
+        return std::nullopt;
+    }
+}
+
+/*
+    Writes the checkpoint next to its final path and renames it into place. Renaming
+    replaces the old checkpoint atomically, so a crash in the middle of writing leaves
+    the previous checkpoint intact rather than a torn one. The new file is synced to
+    disk before the rename, and the directory after it, or after a power cut the rename
+    could be there without the data it points to.
+*/
+template<typename Value>
+void SaveCheckpoint(const CheckpointOptions& options, const Checkpoint<Value>& checkpoint)
+{
+    const auto encoded = Encode(checkpoint, options.stateVersion);
+
+    auto temporary = options.path;
+    temporary += ".tmp";
+
+    {
+        std::ofstream file{ temporary, std::ios::out | std::ios::binary | std::ios::trunc };
+        file.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+        file.flush();
+
+        if (!file)
+            throw std::runtime_error{ "Unable to write checkpoint " + temporary.string() };
+    }
+
+    if (!Detail::SyncToDisk(temporary, false))
+        throw std::runtime_error{ "Unable to write checkpoint " + temporary.string() };
+
+    std::filesystem::rename(temporary, options.path);
+
+    // Not every file system can sync a directory, and the checkpoint is written either way
+    const auto directory = options.path.parent_path();
+    Detail::SyncToDisk(directory.empty() ? std::filesystem::path{ "." } : directory, true);
+}
+
+/*
+    Reduces [begin, end) a chunk at a time, saving (next chunk, partial result) to disk
+    as it goes. If the process dies, running the same reduction again picks up from the
+    last checkpoint instead of from the beginning.
+
+    Each chunk is reduced on its own by reduceChunk(chunkBegin, chunkEnd), which can be a
+    parallel reduction, and then combined onto the partial result. That's only valid
+    because the combine is associative, which is the whole reason the partial result is
+    all that needs to be saved.
+
+    Checkpoints aren't written after a fixed number of chunks. Instead, every write is
+    timed and the next one waits until enough time has passed for that write to be
+    within maximumOverhead of the running time, so slow disks get fewer checkpoints
+    and fast ones get more.
+*/
+template<typename Iterator, typename Value, typename BinaryOp, typename ChunkReducer>
+Value ResumableReduce(Iterator begin, Iterator end, Value init, BinaryOp combine,
+    ChunkReducer reduceChunk, const CheckpointOptions& options)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const auto count = static_cast<std::uint64_t>(std::distance(begin, end));
+    const auto chunkSize = std::max<std::size_t>(1, options.chunkSize);
+    const auto chunks = static_cast<std::size_t>((count + chunkSize - 1) / chunkSize);
+
+    const auto fingerprint = Detail::SampleFingerprint(begin, count);
+
+    auto partial = init;
+    std::size_t chunk = 0;
+
+    if (const auto checkpoint = LoadCheckpoint<Value>(options, count, fingerprint))
+    {
+        partial = checkpoint->partial;
+        chunk = static_cast<std::size_t>(checkpoint->nextChunk);
+    }
+
+    auto lastCheckpoint = Clock::now();
+    auto interval = Clock::duration::zero();
+
+    for (; chunk < chunks; ++chunk)
+    {
+        const auto first = std::next(begin, static_cast<std::ptrdiff_t>(chunk * chunkSize));
+        const auto last = std::next(first, static_cast<std::ptrdiff_t>(std::min<std::uint64_t>(chunkSize, count - chunk * chunkSize)));
+        partial = combine(partial, reduceChunk(first, last));
+
+        const auto now = Clock::now();
+        if (chunk + 1 < chunks && now - lastCheckpoint >= interval)
+        {
+            SaveCheckpoint(options, Checkpoint<Value>{ count, chunkSize, fingerprint, options.inputId, chunk + 1, partial });
+
+            const auto finished = Clock::now();
+            const auto cost = std::chrono::duration<double>(finished - now).count();
+
+            interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(cost / std::max(options.maximumOverhead, 1e-6)));
+            lastCheckpoint = finished;
+
+            if (options.onCheckpoint)
+                options.onCheckpoint(chunk + 1, chunks);
+        }
+    }
+
+    std::error_code error{};
+    std::filesystem::remove(options.path, error);
+
+    return partial;
+}
+
+/*
+    The same, with each chunk folded sequentially starting from init.
+*/
+template<typename Iterator, typename Value, typename BinaryOp>
+Value ResumableReduce(Iterator begin, Iterator end, Value init, BinaryOp combine, const CheckpointOptions& options)
+{
+    auto reduceChunk = [&init, &combine](Iterator first, Iterator last)
+    {
+        return std::accumulate(first, last, init, combine);
+    };
+
+    return ResumableReduce(begin, end, init, combine, reduceChunk, options);
+}
+
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+#include "cpu_dispatch.h"
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+namespace Detail
+{
+    /*
+        A 16 byte compare and swap (cmpxchg16b). MSVC always exposes it on x64, and
+        GCC/Clang expose it when compiling with -mcx16 (or an -march that implies it).
+    */
+#if (defined(_MSC_VER) && defined(_M_X64)) || defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+    constexpr bool HasCompareExchange16 = true;
+#else
+    constexpr bool HasCompareExchange16 = false;
+#endif
+
+    struct alignas(16) DoubleWord
+    {
+        std::uint64_t low;
+        std::uint64_t high;
+    };
+
+    /*
+        On failure, expected is updated with the current value, like std::atomic.
+    */
+    inline bool CompareExchange16(DoubleWord* target, DoubleWord& expected, const DoubleWord& desired)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        return _InterlockedCompareExchange128(reinterpret_cast<volatile long long*>(target),
+            static_cast<long long>(desired.high), static_cast<long long>(desired.low),
+            reinterpret_cast<long long*>(&expected)) != 0;
+#elif defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+        using Wide = unsigned __int128;
+
+        const auto comparand = (static_cast<Wide>(expected.high) << 64) | expected.low;
+        const auto exchange = (static_cast<Wide>(desired.high) << 64) | desired.low;
+        const auto previous = __sync_val_compare_and_swap(reinterpret_cast<volatile Wide*>(target), comparand, exchange);
+
+        expected.low = static_cast<std::uint64_t>(previous);
+        expected.high = static_cast<std::uint64_t>(previous >> 64);
+        return previous == comparand;
+#else
+        (void)target; (void)expected; (void)desired;
+        return false;
+#endif
+    }
+
+    /*
+        A cell for values that std::atomic handles without a lock (up to 8 bytes on
+        the usual platforms). Combining is a CAS loop around the monoid.
+    */
+    template<typename T>
+    struct alignas(CacheLineSize) AtomicCell
+    {
+        std::atomic<T> value{};
+
+        template<typename MonoidType>
+        bool Combine(const MonoidType& monoid, const T& item)
+        {
+            auto expected = value.load(std::memory_order_relaxed);
+            if (value.compare_exchange_weak(expected, monoid(expected, item), std::memory_order_relaxed))
+                return true;
+
+            while (!value.compare_exchange_weak(expected, monoid(expected, item), std::memory_order_relaxed)) {}
+            return false;
+        }
+
+        T Load() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+
+        void Store(const T& item)
+        {
+            value.store(item, std::memory_order_relaxed);
+        }
+    };
+
+    /*
+        A cell for trivially copyable values of 9 to 16 bytes, which std::atomic
+        implements with a lock on MSVC and GCC. The value is kept as two words and
+        combined with a 16 byte CAS instead.
+    */
+    template<typename T>
+    struct alignas(CacheLineSize) DoubleWordCell
+    {
+        DoubleWord words{};
+
+        template<typename MonoidType>
+        bool Combine(const MonoidType& monoid, const T& item)
+        {
+            auto expected = LoadWords();
+            auto uncontended = true;
+
+            for (;;)
+            {
+                const auto desired = ToWords(monoid(FromWords(expected), item));
+                if (CompareExchange16(&words, expected, desired))
+                    return uncontended;
+
+                uncontended = false;
+            }
+        }
+
+        T Load() const
+        {
+            return FromWords(LoadWords());
+        }
+
+        void Store(const T& item)
+        {
+            auto expected = LoadWords();
+            while (!CompareExchange16(&words, expected, ToWords(item))) {}
+        }
+
+    private:
+
+        // There's no 16 byte atomic load, but a CAS that expects zero and
+        // writes zero either changes nothing or reports the current value.
+        DoubleWord LoadWords() const
+        {
+            DoubleWord expected{};
+            CompareExchange16(const_cast<DoubleWord*>(&words), expected, expected);
+            return expected;
+        }
+
+        static DoubleWord ToWords(const T& item)
+        {
+            DoubleWord result{};
+            std::memcpy(&result, &item, sizeof(T));
+            return result;
+        }
+
+        static T FromWords(const DoubleWord& source)
+        {
+            T result;
+            std::memcpy(&result, &source, sizeof(T));
+            return result;
+        }
+    };
+
+    /*
+        The fallback for everything else: a spin lock per cell. Sharding still keeps
+        the contention on each lock low.
+    */
+    template<typename T>
+    struct alignas(CacheLineSize) LockedCell
+    {
+        mutable std::atomic_flag locked = ATOMIC_FLAG_INIT;
+        T value{};
+
+        template<typename MonoidType>
+        bool Combine(const MonoidType& monoid, const T& item)
+        {
+            const auto uncontended = Lock();
+            value = monoid(value, item);
+            Unlock();
+
+            return uncontended;
+        }
+
+        T Load() const
+        {
+            Lock();
+            auto result = value;
+            Unlock();
+
+            return result;
+        }
+
+        void Store(const T& item)
+        {
+            Lock();
+            value = item;
+            Unlock();
+        }
+
+    private:
+
+        bool Lock() const
+        {
+            auto uncontended = true;
+            while (locked.test_and_set(std::memory_order_acquire))
+            {
+                uncontended = false;
+                std::this_thread::yield();
+            }
+
+            return uncontended;
+        }
+
+        void Unlock() const
+        {
+            locked.clear(std::memory_order_release);
+        }
+    };
+
+    // std::atomic<T> can't even be named for types that aren't trivially copyable
+    template<typename T, bool = std::is_trivially_copyable_v<T>>
+    struct IsAlwaysLockFree : std::false_type {};
+
+    template<typename T>
+    struct IsAlwaysLockFree<T, true> : std::bool_constant<std::atomic<T>::is_always_lock_free> {};
+
+    template<typename T>
+    constexpr bool UsesAtomicCell = IsAlwaysLockFree<T>::value;
+
+    template<typename T>
+    constexpr bool UsesDoubleWordCell = !UsesAtomicCell<T> && HasCompareExchange16
+        && std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T> && sizeof(T) <= 16;
+
+    template<typename T>
+    using CellFor = std::conditional_t<UsesAtomicCell<T>, AtomicCell<T>,
+        std::conditional_t<UsesDoubleWordCell<T>, DoubleWordCell<T>, LockedCell<T>>>;
+}
+
+/*
+    A monoid that many threads can add into at once, in the spirit of Java's LongAdder.
+
+    Funneling every update through one atomic makes all the writers queue up on the same
+    cache line. Instead, the accumulator has several cells, each on its own cache line,
+    and every thread adds into "its" cell. When a thread's CAS fails because someone else
+    is using the cell, it moves on to a different one, so the threads spread themselves
+    out over the cells under contention. Nothing is combined until Read() is called,
+    which folds the cells together.
+
+    Since updates from different threads land in different cells, the monoid has to be
+    commutative as well as associative for Read() to be meaningful (counts, sums, min,
+    max...). Values that are compared bitwise by the CAS (anything up to 16 bytes) should
+    have no padding, otherwise garbage in the padding can make a CAS fail forever.
+*/
+template<typename MonoidType>
+class ConcurrentAccumulator
+{
+public:
+
+    using ValueType = typename MonoidType::ValueType;
+
+    explicit ConcurrentAccumulator(MonoidType monoid = {}, std::size_t shards = DefaultShardCount())
+        : monoid(std::move(monoid)), cells(RoundUpToPowerOfTwo(shards))
+    {
+        Reset();
+    }
+
+    ConcurrentAccumulator(const ConcurrentAccumulator&) = delete;
+    ConcurrentAccumulator& operator=(const ConcurrentAccumulator&) = delete;
+
+    void Add(const ValueType& value)
+    {
+        auto& probe = Probe();
+
+        if (!cells[probe & (cells.size() - 1)].Combine(monoid, value))
+            probe = NextProbe(probe);
+    }
+
+    /*
+        Folds the cells together. This isn't a snapshot: adds that happen during the
+        read may or may not be included, like any read of a LongAdder.
+    */
+    ValueType Read() const
+    {
+        auto result = monoid.identity;
+        for (const auto& cell : cells)
+            result = monoid(result, cell.Load());
+
+        return result;
+    }
+
+    /*
+        Resets every cell to the identity. Not meant to race with Add().
+    */
+    void Reset()
+    {
+        for (auto& cell : cells)
+            cell.Store(monoid.identity);
+    }
+
+    /*
+        True when the cells are combined without any locks.
+    */
+    static constexpr bool IsLockFree()
+    {
+        return Detail::UsesAtomicCell<ValueType> || Detail::UsesDoubleWordCell<ValueType>;
+    }
+
+private:
+
+    static std::size_t DefaultShardCount()
+    {
+        return 2 * std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    static std::size_t RoundUpToPowerOfTwo(std::size_t value)
+    {
+        std::size_t result = 1;
+        while (result < value)
+            result *= 2;
+
+        return result;
+    }
+
+    /*
+        Each thread starts at a cell picked from its id, and keeps whatever
+        cell it moved to last time it hit contention.
+    */
+    static std::size_t& Probe()
+    {
+        thread_local std::size_t probe = std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+        return probe;
+    }
+
+    static std::size_t NextProbe(std::size_t probe)
+    {
+        // xorshift, as LongAdder does
+        probe ^= probe << 13;
+        probe ^= probe >> 7;
+        probe ^= probe << 17;
+        return probe;
+    }
+
+private:
+
+    MonoidType monoid{};
+    std::vector<Detail::CellFor<ValueType>> cells{};
+};
+
+}
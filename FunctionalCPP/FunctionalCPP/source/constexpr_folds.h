@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <utility>
+
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    Folds that can run during constant evaluation. std::accumulate isn't constexpr until
+    C++20, but a plain loop over a std::array is, and so are lambdas and the standard
+    monoids. Anything folded from values known at compile time (lookup tables, composed
+    transforms, configuration) can then be computed by the compiler and stored in the
+    binary, instead of being computed at startup or on the hot path.
+*/
+
+/*
+    Left folds a std::array. Usable in constant expressions whenever combine is.
+*/
+template<typename T, std::size_t N, typename Value, typename BinaryOp>
+constexpr Value ConstexprLeftFold(const std::array<T, N>& values, Value init, BinaryOp combine)
+{
+    for (std::size_t i = 0; i < N; ++i)
+        init = combine(init, values[i]);
+
+    return init;
+}
+
+/*
+    Left folds a std::array with a monoid, starting from its identity.
+*/
+template<typename MonoidType, typename T, std::size_t N>
+constexpr auto ConstexprFold(const std::array<T, N>& values, MonoidType monoid = {})
+{
+    return ConstexprLeftFold(values, monoid.identity, monoid);
+}
+
+/*
+    Left folds a parameter pack: combine(combine(combine(init, a), b), c)...
+    This is the comma operator fold expression, which works with any combine,
+    not just the built-in operators that (init + ... + values) is limited to.
+*/
+template<typename Value, typename BinaryOp, typename...Values>
+constexpr Value LeftFoldPack(Value init, BinaryOp combine, const Values&...values)
+{
+    ((init = combine(init, values)), ...);
+    return init;
+}
+
+/*
+    Composes functions left to right, the same way FunctionComposition folds them:
+    Compose(f, g, h)(x) == h(g(f(x))). The result is a constexpr callable whenever the
+    functions are, so a chain of transforms can be collapsed at compile time.
+*/
+template<typename Fn>
+constexpr auto Compose(Fn fn)
+{
+    return fn;
+}
+
+template<typename Fn, typename...Fns>
+constexpr auto Compose(Fn fn, Fns...fns)
+{
+    return [fn, rest = Compose(fns...)](auto&& value) constexpr
+    {
+        return rest(fn(std::forward<decltype(value)>(value)));
+    };
+}
+
+/*
+    Builds a std::array of generate(0), generate(1), ..., generate(N - 1).
+    Assign the result to a constexpr variable to get a lookup table in the binary.
+*/
+template<std::size_t N, typename Generator>
+constexpr auto MakeTable(Generator generate)
+{
+    std::array<decltype(generate(std::size_t{ 0 })), N> table{};
+
+    for (std::size_t i = 0; i < N; ++i)
+        table[i] = generate(i);
+
+    return table;
+}
+
+}
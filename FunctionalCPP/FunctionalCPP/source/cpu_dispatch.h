@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FUNCTIONALCPP_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+/*
+    Marks a function as compiled for a particular instruction set, so one binary can carry
+    AVX2 code next to plain SSE code and pick between them at run time. GCC and Clang
+    refuse to use an instruction set's intrinsics outside of such a function unless the
+    whole file is compiled for it. MSVC lets any function use any intrinsic, so there's
+    nothing to mark.
+*/
+#if defined(FUNCTIONALCPP_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FUNCTIONALCPP_TARGET(isa) __attribute__((target(isa)))
+#else
+#define FUNCTIONALCPP_TARGET(isa)
+#endif
+
+namespace Monoids
+{
+/*
+    The size that keeps two objects from sharing a cache line. Anything written by
+    different threads is padded out to this so that the cores don't fight over the line.
+*/
+constexpr std::size_t CacheLineSize = 64;
+
+/*
+    Asks for the cache line at address to be loaded ahead of the read that needs it.
+    It's only a hint, so it never faults, and it does nothing where it isn't available.
+*/
+inline void Prefetch(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address, 0, 3);
+#elif defined(FUNCTIONALCPP_X86)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+    (void)address;
+#endif
+}
+
+/*
+    The same, with the hint that the line will only be read once, so it shouldn't
+    displace anything in the outer cache levels.
+*/
+inline void PrefetchNonTemporal(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address, 0, 0);
+#elif defined(FUNCTIONALCPP_X86)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_NTA);
+#else
+    (void)address;
+#endif
+}
+
+/*
+    The number of bits set in word. GCC and Clang know the best instruction for the
+    target; MSVC only has one that faults on CPUs without it, so it counts them in
+    parallel within the word instead.
+*/
+inline unsigned PopCount(std::uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_popcountll(word));
+#else
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<unsigned>((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+    The instruction sets there are kernels for, from least to most capable. Each one
+    implies the ones before it.
+*/
+enum class Isa
+{
+    Scalar,
+    Sse42,
+    Avx2,
+    Avx512,
+};
+
+inline const char* ToString(Isa isa)
+{
+    switch (isa)
+    {
+    case Isa::Sse42: return "sse4.2";
+    case Isa::Avx2: return "avx2";
+    case Isa::Avx512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+namespace Detail
+{
+#if defined(FUNCTIONALCPP_X86)
+    struct CpuidRegisters
+    {
+        std::uint32_t eax, ebx, ecx, edx;
+    };
+
+    inline CpuidRegisters Cpuid(std::uint32_t leaf, std::uint32_t subleaf = 0)
+    {
+        CpuidRegisters registers{};
+#if defined(_MSC_VER)
+        int values[4]{};
+        __cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+        registers = { static_cast<std::uint32_t>(values[0]), static_cast<std::uint32_t>(values[1]),
+            static_cast<std::uint32_t>(values[2]), static_cast<std::uint32_t>(values[3]) };
+#else
+        if (!__get_cpuid_count(leaf, subleaf, &registers.eax, &registers.ebx, &registers.ecx, &registers.edx))
+            registers = {};
+#endif
+        return registers;
+    }
+
+    /*
+        Which register states the operating system saves on a context switch. A CPU can
+        support AVX while the OS doesn't, and then the instructions fault.
+    */
+    inline std::uint64_t EnabledStateComponents()
+    {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        std::uint32_t low{}, high{};
+        __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+        return (static_cast<std::uint64_t>(high) << 32) | low;
+#endif
+    }
+#endif
+
+    inline Isa DetectIsa()
+    {
+#if defined(FUNCTIONALCPP_X86)
+        const auto features = Cpuid(1);
+        const auto hasSse42 = (features.ecx >> 20) & 1;
+        const auto hasOsxsave = (features.ecx >> 27) & 1;
+
+        if (!hasSse42)
+            return Isa::Scalar;
+
+        if (!hasOsxsave || Cpuid(0).eax < 7)
+            return Isa::Sse42;
+
+        const auto state = EnabledStateComponents();
+        const auto extended = Cpuid(7, 0);
+
+        // XMM and YMM state, then opmask and the upper halves of ZMM0-15 and ZMM16-31
+        const auto avxEnabled = (state & 0x06) == 0x06;
+        const auto avx512Enabled = (state & 0xE6) == 0xE6;
+
+        if (avx512Enabled && ((extended.ebx >> 16) & 1))
+            return Isa::Avx512;
+
+        if (avxEnabled && ((extended.ebx >> 5) & 1))
+            return Isa::Avx2;
+
+        return Isa::Sse42;
+#else
+        return Isa::Scalar;
+#endif
+    }
+
+    inline std::string ReadEnvironment(const char* name)
+    {
+#if defined(_MSC_VER)
+        char* buffer = nullptr;
+        std::size_t size = 0;
+
+        if (_dupenv_s(&buffer, &size, name) != 0 || buffer == nullptr)
+            return {};
+
+        std::string value{ buffer };
+        std::free(buffer);
+        return value;
+#else
+        const auto value = std::getenv(name);
+        return value ? std::string{ value } : std::string{};
+#endif
+    }
+
+    /*
+        Parses an instruction set name as ToString writes it. Anything else means the
+        caller didn't ask for one.
+    */
+    inline bool ParseIsa(const std::string& name, Isa& isa)
+    {
+        for (const auto candidate : { Isa::Scalar, Isa::Sse42, Isa::Avx2, Isa::Avx512 })
+        {
+            if (name == ToString(candidate))
+            {
+                isa = candidate;
+                return true;
+            }
+        }
+
+        return false;
+    }
+}
+
+/*
+    The most capable instruction set this machine and OS support
+*/
+inline Isa DetectedIsa()
+{
+    static const auto detected = Detail::DetectIsa();
+    return detected;
+}
+
+/*
+    The instruction set the kernels use. That's the detected one, unless the
+    FUNCTIONALCPP_ISA environment variable names another (scalar, sse4.2, avx2 or avx512),
+    which makes it possible to test every kernel on one machine. A request for more than
+    the machine has is capped at what it has, since those instructions would fault.
+
+    It's decided once, the first time any kernel asks.
+*/
+inline Isa SelectedIsa()
+{
+    static const auto selected = []
+    {
+        auto requested = DetectedIsa();
+        Detail::ParseIsa(Detail::ReadEnvironment("FUNCTIONALCPP_ISA"), requested);
+
+        return requested < DetectedIsa() ? requested : DetectedIsa();
+    }();
+
+    return selected;
+}
+
+}
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "serialization.h"
+
+namespace Monoids
+{
+/*
+    A keyed aggregation (the reduce half of map->reduce, grouped by key) whose state is
+    allowed to outgrow memory.
+
+    The keys are split into partitions by hash. Every partition keeps its own hash table
+    of key -> monoid value, and when the total number of entries goes over the budget, the
+    least recently used partitions are spilled: their tables are encoded and appended to
+    that partition's file sequentially, and the memory is released. Nothing is combined
+    across spills at that point, so a key can end up in several runs.
+
+    Reading the results back goes one partition at a time: the partition's runs are
+    streamed back an entry at a time, in the order they were written, and folded into a
+    fresh table with the monoid's combine, followed by whatever is still in memory. Only one partition has to
+    fit in memory at a time, so the aggregation degrades into more disk traffic instead
+    of running out of memory. Values for a key are always combined in the order they
+    were added, so the monoid doesn't have to be commutative.
+
+    Keys and values are written with their Serializer. The spill files go into a directory
+    of the aggregator's own, made under the given one on the first spill and removed with
+    everything in it at the end, so nothing that was already there is ever written to.
+*/
+template<typename Key, typename Value, typename Combine, typename Hash = std::hash<Key>>
+class SpillingAggregator
+{
+public:
+
+    /*
+        budget is the number of entries allowed in memory across all partitions. directory
+        is where the aggregator's own spill directory is made.
+    */
+    SpillingAggregator(Combine combine, std::size_t budget, std::size_t partitionCount = 64,
+        std::filesystem::path directory = std::filesystem::temp_directory_path())
+        : combine(std::move(combine)), budget(std::max<std::size_t>(1, budget)),
+          partitions(std::max<std::size_t>(1, partitionCount)), directory(std::move(directory))
+    {
+    }
+
+    SpillingAggregator(const SpillingAggregator&) = delete;
+    SpillingAggregator& operator=(const SpillingAggregator&) = delete;
+
+    ~SpillingAggregator()
+    {
+        if (!spillDirectory.empty())
+        {
+            std::error_code error{};
+            std::filesystem::remove_all(spillDirectory, error);
+        }
+    }
+
+    void Add(const Key& key, Value value)
+    {
+        const auto hash = Hash{}(key);
+        auto& partition = partitions[PartitionOf(hash)];
+        partition.lastUsed = ++clock;
+
+        auto [entry, inserted] = partition.table.try_emplace(key, std::move(value));
+        if (!inserted)
+        {
+            entry->second = combine(std::move(entry->second), std::move(value));
+            return;
+        }
+
+        if (++entries > budget)
+            SpillColdPartitions();
+    }
+
+    /*
+        Calls fn(key, value) once for every distinct key, one partition at a time.
+        The aggregator is empty afterwards.
+    */
+    template<typename Fn>
+    void Drain(Fn&& fn)
+    {
+        for (std::size_t i = 0; i < partitions.size(); ++i)
+        {
+            auto& partition = partitions[i];
+            auto table = partition.spills > 0 ? LoadSpills(i) : Table{};
+
+            for (auto& [key, value] : partition.table)
+            {
+                auto [entry, inserted] = table.try_emplace(key, std::move(value));
+                if (!inserted)
+                    entry->second = combine(std::move(entry->second), std::move(value));
+            }
+
+            entries -= partition.table.size();
+            partition.table = Table{};
+
+            for (auto& [key, value] : table)
+                fn(key, value);
+        }
+    }
+
+    std::size_t EntriesInMemory() const
+    {
+        return entries;
+    }
+
+    std::size_t Spills() const
+    {
+        return std::accumulate(std::begin(partitions), std::end(partitions), std::size_t{ 0 },
+            [](std::size_t total, const Partition& partition) { return total + partition.spills; });
+    }
+
+private:
+
+    using Table = std::unordered_map<Key, Value, Hash>;
+
+    struct Partition
+    {
+        Table table{};
+        std::uint64_t lastUsed{};
+        std::size_t spills{};
+    };
+
+    /*
+        The hash table inside each partition uses the low bits of the same hash, so the
+        partition is picked from the high bits of a scrambled copy to keep them independent.
+    */
+    std::size_t PartitionOf(std::size_t hash) const
+    {
+        const auto mixed = static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+        return static_cast<std::size_t>((mixed >> 32) % partitions.size());
+    }
+
+    std::filesystem::path SpillPath(std::size_t partition) const
+    {
+        return spillDirectory / (std::to_string(partition) + ".bin");
+    }
+
+    /*
+        Makes the spill directory, under a name made from the time, a counter and random
+        bits. create_directory says whether it made the directory, so a name that's
+        already taken, by a directory, a file or a link, is never used; another one is
+        tried instead. Only the owner can get into it.
+    */
+    void CreateSpillDirectory()
+    {
+        static std::atomic<unsigned> instances{ 0 };
+        std::random_device random{};
+
+        for (auto attempt = 0; attempt < 16; ++attempt)
+        {
+            const auto ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+            const auto candidate = directory / ("functionalcpp-spill-" + std::to_string(ticks) + "-" +
+                std::to_string(instances++) + "-" + std::to_string(random()));
+
+            std::error_code error{};
+            if (!std::filesystem::create_directory(candidate, error) || error)
+                continue;
+
+            std::filesystem::permissions(candidate, std::filesystem::perms::owner_all, error);
+            spillDirectory = candidate;
+            return;
+        }
+
+        throw std::runtime_error{ "Unable to make a spill directory in " + directory.string() };
+    }
+
+    /*
+        Spills partitions, least recently used first, until memory is down to half the
+        budget, so that the next spill is a while away instead of on the very next add.
+    */
+    void SpillColdPartitions()
+    {
+        std::vector<std::size_t> order(partitions.size());
+        std::iota(std::begin(order), std::end(order), std::size_t{ 0 });
+        std::sort(std::begin(order), std::end(order),
+            [this](std::size_t lhs, std::size_t rhs) { return partitions[lhs].lastUsed < partitions[rhs].lastUsed; });
+
+        for (const auto i : order)
+        {
+            if (entries <= budget / 2)
+                break;
+
+            if (!partitions[i].table.empty())
+                Spill(i);
+        }
+    }
+
+    /*
+        Every entry is written as its length followed by the encoded key and value, so
+        that it can be read back on its own without reading the whole file first
+    */
+    void Spill(std::size_t i)
+    {
+        auto& partition = partitions[i];
+
+        if (spillDirectory.empty())
+            CreateSpillDirectory();
+
+        std::ofstream file{ SpillPath(i), std::ios::out | std::ios::binary | std::ios::app };
+        BinaryWriter writer{};
+
+        for (const auto& [key, value] : partition.table)
+        {
+            writer.Clear();
+            Serializer<Key>::Write(writer, key);
+            Serializer<Value>::Write(writer, value);
+
+            const auto length = static_cast<std::uint64_t>(writer.Size());
+            file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            file.write(reinterpret_cast<const char*>(writer.Buffer().data()), static_cast<std::streamsize>(writer.Size()));
+        }
+
+        file.flush();
+        if (!file)
+            throw std::runtime_error{ "Unable to spill to " + SpillPath(i).string() };
+
+        entries -= partition.table.size();
+        partition.table = Table{};
+        ++partition.spills;
+    }
+
+    /*
+        Folds the partition's spilled entries back into a table, reading one entry at a
+        time, so only the table and the largest entry have to fit in memory. The file is
+        only removed once all of it has been folded; if anything goes wrong, it's still
+        there, and the destructor removes it.
+    */
+    Table LoadSpills(std::size_t i)
+    {
+        const auto path = SpillPath(i);
+        std::ifstream file{ path, std::ios::in | std::ios::binary };
+        auto remaining = static_cast<std::uint64_t>(std::filesystem::file_size(path));
+
+        Table table{};
+        std::vector<unsigned char> buffer{};
+
+        while (remaining > 0)
+        {
+            std::uint64_t length = 0;
+            file.read(reinterpret_cast<char*>(&length), sizeof(length));
+
+            if (!file || length > remaining - sizeof(length))
+                throw std::runtime_error{ "Unable to read back " + path.string() };
+
+            // Every entry is decoded from the start of the buffer, which keeps the
+            // alignment it was written with
+            buffer.resize(static_cast<std::size_t>(length));
+            file.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+
+            if (!file)
+                throw std::runtime_error{ "Unable to read back " + path.string() };
+
+            remaining -= sizeof(length) + length;
+
+            BinaryReader reader{ buffer.data(), buffer.size() };
+            auto key = Serializer<Key>::Read(reader);
+            auto value = Serializer<Value>::Read(reader);
+
+            auto [entry, inserted] = table.try_emplace(std::move(key), std::move(value));
+            if (!inserted)
+                entry->second = combine(std::move(entry->second), std::move(value));
+        }
+
+        file.close();
+        std::filesystem::remove(path);
+        partitions[i].spills = 0;
+
+        return table;
+    }
+
+private:
+
+    Combine combine;
+    std::size_t budget{};
+    std::size_t entries{};
+    std::uint64_t clock{};
+    std::vector<Partition> partitions{};
+    std::filesystem::path directory{};
+    std::filesystem::path spillDirectory{};
+};
+
+template<typename Key, typename Value, typename Combine, typename Hash = std::hash<Key>>
+auto MakeSpillingAggregator(Combine&& combine, std::size_t budget, std::size_t partitionCount = 64,
+    std::filesystem::path directory = std::filesystem::temp_directory_path())
+{
+    return SpillingAggregator<Key, Value, std::decay_t<Combine>, Hash>{ std::forward<Combine>(combine), budget, partitionCount,
+        std::move(directory) };
+}
+
+}
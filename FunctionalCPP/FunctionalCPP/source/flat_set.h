@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    std::set and std::map keep every element in a node of its own, so a fold that builds
+    one allocates once per element and then chases pointers all over the heap for every
+    lookup. The flat versions keep their elements in one sorted vector instead: a lookup
+    is a binary search through contiguous memory, and two of them are unioned with a
+    single linear merge.
+
+    The vector is sorted after every change, so reading a set never changes it, and any
+    number of threads can read one at once (a sparse table of intersections does). An
+    element inserted on its own goes straight to its place, which moves everything after
+    it; a range of them is appended, sorted and merged in one go, so building a set from
+    many elements at once should insert them as a range.
+*/
+namespace Detail
+{
+    /*
+        Sorts the tail of entries after the first sorted, merges it into them, and then
+        collapses every run of equivalent entries into its first one, absorbing the
+        others into it in the order they were inserted. Both the sort and the merge are
+        stable, which is what keeps that order.
+    */
+    template<typename Entry, typename Less, typename Absorb>
+    void NormalizeFlat(std::vector<Entry>& entries, std::size_t sorted, const Less& less, const Absorb& absorb)
+    {
+        if (sorted == entries.size())
+            return;
+
+        const auto middle = std::next(std::begin(entries), sorted);
+
+        // A merged set's tail is another set, which is sorted already
+        if (!std::is_sorted(middle, std::end(entries), less))
+            std::stable_sort(middle, std::end(entries), less);
+
+        std::inplace_merge(std::begin(entries), middle, std::end(entries), less);
+
+        auto last = std::begin(entries);
+        for (auto entry = std::next(last); entry != std::end(entries); ++entry)
+        {
+            if (!less(*last, *entry))
+                absorb(*last, *entry);
+            else if (++last != entry)
+                *last = std::move(*entry);
+        }
+
+        entries.erase(std::next(last), std::end(entries));
+    }
+}
+
+/*
+    A set kept in one sorted vector
+*/
+template<typename T, typename Compare = std::less<>>
+class FlatSet
+{
+public:
+
+    using value_type = T;
+    using const_iterator = typename std::vector<T>::const_iterator;
+
+    explicit FlatSet(Compare compare = {})
+        : compare(std::move(compare))
+    {
+    }
+
+    void Insert(const T& element)
+    {
+        const auto position = std::lower_bound(std::begin(elements), std::end(elements), element, compare);
+        if (position == std::end(elements) || compare(element, *position))
+            elements.insert(position, element);
+    }
+
+    template<typename Iterator>
+    void Insert(Iterator first, Iterator last)
+    {
+        const auto sorted = elements.size();
+        elements.insert(std::end(elements), first, last);
+        Detail::NormalizeFlat(elements, sorted, compare, [](const T&, const T&) {});
+    }
+
+    /*
+        Adds every element of other. Both sets' elements are sorted already, so this is
+        a single merge.
+    */
+    void Merge(const FlatSet& other)
+    {
+        Insert(std::begin(other.elements), std::end(other.elements));
+    }
+
+    /*
+        Keeps only the elements other has too
+    */
+    void IntersectWith(const FlatSet& other)
+    {
+        std::vector<T> kept{};
+        kept.reserve(std::min(elements.size(), other.elements.size()));
+        std::set_intersection(std::begin(elements), std::end(elements), std::begin(other.elements), std::end(other.elements),
+            std::back_inserter(kept), compare);
+
+        elements = std::move(kept);
+    }
+
+    bool Contains(const T& element) const
+    {
+        return std::binary_search(std::begin(elements), std::end(elements), element, compare);
+    }
+
+    std::size_t Size() const
+    {
+        return elements.size();
+    }
+
+    const_iterator begin() const
+    {
+        return std::cbegin(elements);
+    }
+
+    const_iterator end() const
+    {
+        return std::cend(elements);
+    }
+
+private:
+
+    std::vector<T> elements{};
+    Compare compare{};
+};
+
+/*
+    A map kept in one sorted vector of key and value pairs. When a key is inserted again,
+    or two maps that share a key are merged, the values are combined with ValueMonoid,
+    older first. Counting is FlatMap<Key, Sum<int>>, with every key inserted with a 1.
+*/
+template<typename Key, typename ValueMonoid, typename Compare = std::less<>>
+class FlatMap
+{
+public:
+
+    using Mapped = typename ValueMonoid::ValueType;
+    using value_type = std::pair<Key, Mapped>;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+
+    explicit FlatMap(ValueMonoid monoid = {}, Compare compare = {})
+        : monoid(std::move(monoid)), compare(std::move(compare))
+    {
+    }
+
+    void Insert(const value_type& entry)
+    {
+        const auto position = LowerBound(entry.first);
+        if (position == std::end(entries) || compare(entry.first, position->first))
+            entries.insert(position, entry);
+        else
+            position->second = monoid(position->second, entry.second);
+    }
+
+    void Insert(const Key& key, const Mapped& value)
+    {
+        Insert(value_type{ key, value });
+    }
+
+    template<typename Iterator>
+    void Insert(Iterator first, Iterator last)
+    {
+        const auto sorted = entries.size();
+        entries.insert(std::end(entries), first, last);
+
+        Detail::NormalizeFlat(entries, sorted,
+            [this](const value_type& lhs, const value_type& rhs) { return compare(lhs.first, rhs.first); },
+            [this](value_type& kept, const value_type& absorbed) { kept.second = monoid(kept.second, absorbed.second); });
+    }
+
+    void Merge(const FlatMap& other)
+    {
+        Insert(std::begin(other.entries), std::end(other.entries));
+    }
+
+    /*
+        The value for key, or the monoid's identity when there isn't one
+    */
+    Mapped Find(const Key& key) const
+    {
+        const auto found = std::lower_bound(std::begin(entries), std::end(entries), key,
+            [this](const value_type& entry, const Key& wanted) { return compare(entry.first, wanted); });
+
+        if (found == std::end(entries) || compare(key, found->first))
+            return monoid.identity;
+
+        return found->second;
+    }
+
+    std::size_t Size() const
+    {
+        return entries.size();
+    }
+
+    const_iterator begin() const
+    {
+        return std::cbegin(entries);
+    }
+
+    const_iterator end() const
+    {
+        return std::cend(entries);
+    }
+
+private:
+
+    typename std::vector<value_type>::iterator LowerBound(const Key& key)
+    {
+        return std::lower_bound(std::begin(entries), std::end(entries), key,
+            [this](const value_type& entry, const Key& wanted) { return compare(entry.first, wanted); });
+    }
+
+private:
+
+    std::vector<value_type> entries{};
+    ValueMonoid monoid{};
+    Compare compare{};
+};
+
+template<typename T, typename Compare>
+struct IsIdempotent<Union<FlatSet<T, Compare>>> : std::true_type {};
+
+// Unioning a map with itself combines every value with itself
+template<typename Key, typename ValueMonoid, typename Compare>
+struct IsIdempotent<Union<FlatMap<Key, ValueMonoid, Compare>>> : IsIdempotent<ValueMonoid> {};
+
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "simd_kernels.h"
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    LeftFold and Reduce accept any combine, so the compiler only ever sees a call through
+    a generic functor, one element at a time, with every step depending on the one before
+    it. For the common cases (summing doubles with std::plus<>, multiplying ints, taking a
+    minimum) that dependency chain is the bottleneck: each add has to wait for the previous
+    one to finish, even though the hardware could be running several at once.
+
+    The kernels here recognize those cases at compile time and fold with several
+    independent accumulators instead, expanded by hand so there's no loop over them, while
+    prefetching ahead of the read pointer (see streaming.h). The accumulators are combined
+    at the end. When the CPU has vector instructions for the case, one of the kernels in
+    simd_kernels.h does the same with whole vectors. Everything else falls through to
+    std::accumulate, so call sites don't change.
+
+    A case is recognized when:
+
+        the iterators are contiguous (pointers, or vector and string iterators)
+        the elements are arithmetic, and the same type as the init value
+        the combine is a standard functor or one of the standard monoids
+*/
+namespace Kernels
+{
+    /*
+        Describes a combine the kernels know how to split across accumulators.
+        exact is whether regrouping it gives bit for bit the same result as a left fold,
+        which is true for everything except floating point addition and multiplication.
+    */
+    template<typename Op, typename T, typename = void>
+    struct Operation
+    {
+        static constexpr bool supported = false;
+        static constexpr bool exact = false;
+    };
+
+    template<typename T>
+    constexpr bool IsKernelElement = std::is_arithmetic_v<T> && !std::is_same_v<T, bool>;
+
+    namespace Detail
+    {
+        /*
+            Signed integer overflow is undefined, and regrouping a sum can overflow where
+            the original order didn't, so integers are added and multiplied as unsigned.
+            That wraps the same way regardless of the grouping. Types narrower than
+            unsigned int would be promoted back to a signed int first, where 65535 * 65535
+            overflows, so they're widened to unsigned int instead.
+        */
+        template<typename T>
+        struct UnsignedAtLeastInt
+        {
+            using type = std::common_type_t<unsigned, std::make_unsigned_t<T>>;
+        };
+
+        template<typename T>
+        using Wrapping = std::conditional_t<std::is_integral_v<T>, UnsignedAtLeastInt<T>, std::common_type<T>>;
+
+        template<typename T>
+        using WrappingT = typename Wrapping<T>::type;
+
+        template<typename T>
+        struct Add
+        {
+            static constexpr OperationKind kind = OperationKind::Add;
+            static constexpr bool supported = IsKernelElement<T>;
+            static constexpr bool exact = std::is_integral_v<T>;
+
+            static constexpr T Identity() { return T{}; }
+            static constexpr T Combine(T lhs, T rhs) { return static_cast<T>(static_cast<WrappingT<T>>(lhs) + static_cast<WrappingT<T>>(rhs)); }
+        };
+
+        template<typename T>
+        struct Multiply
+        {
+            static constexpr OperationKind kind = OperationKind::Multiply;
+            static constexpr bool supported = IsKernelElement<T>;
+            static constexpr bool exact = std::is_integral_v<T>;
+
+            static constexpr T Identity() { return T{ 1 }; }
+            static constexpr T Combine(T lhs, T rhs) { return static_cast<T>(static_cast<WrappingT<T>>(lhs) * static_cast<WrappingT<T>>(rhs)); }
+        };
+
+        template<typename T>
+        struct Minimum
+        {
+            static constexpr OperationKind kind = OperationKind::Minimum;
+            static constexpr bool supported = IsKernelElement<T>;
+            static constexpr bool exact = std::is_integral_v<T>;
+
+            static constexpr T Identity() { return Min<T>{}.identity; }
+            static constexpr T Combine(T lhs, T rhs) { return Min<T>{}(lhs, rhs); }
+        };
+
+        template<typename T>
+        struct Maximum
+        {
+            static constexpr OperationKind kind = OperationKind::Maximum;
+            static constexpr bool supported = IsKernelElement<T>;
+            static constexpr bool exact = std::is_integral_v<T>;
+
+            static constexpr T Identity() { return Max<T>{}.identity; }
+            static constexpr T Combine(T lhs, T rhs) { return Max<T>{}(lhs, rhs); }
+        };
+
+        template<typename T, typename BitOp, OperationKind Kind, T IdentityValue>
+        struct Bitwise
+        {
+            static constexpr OperationKind kind = Kind;
+            static constexpr bool supported = std::is_integral_v<T> && !std::is_same_v<T, bool>;
+            static constexpr bool exact = true;
+
+            static constexpr T Identity() { return IdentityValue; }
+            static constexpr T Combine(T lhs, T rhs) { return static_cast<T>(BitOp{}(lhs, rhs)); }
+        };
+
+        /*
+            std::plus<int> can be called on doubles, but it truncates every element to int
+            first, so the typed functors are only recognized for their own type.
+        */
+        template<typename Functor, typename T>
+        constexpr bool Accepts = std::is_same_v<Functor, T> || std::is_void_v<Functor>;
+    }
+
+    template<typename U, typename T>
+    struct Operation<std::plus<U>, T, std::enable_if_t<Detail::Accepts<U, T>>> : Detail::Add<T> {};
+
+    template<typename U, typename T>
+    struct Operation<std::multiplies<U>, T, std::enable_if_t<Detail::Accepts<U, T>>> : Detail::Multiply<T> {};
+
+    template<typename U, typename T>
+    struct Operation<std::bit_and<U>, T, std::enable_if_t<Detail::Accepts<U, T> && std::is_integral_v<T>>>
+        : Detail::Bitwise<T, std::bit_and<T>, OperationKind::And, static_cast<T>(~T{})> {};
+
+    template<typename U, typename T>
+    struct Operation<std::bit_or<U>, T, std::enable_if_t<Detail::Accepts<U, T> && std::is_integral_v<T>>>
+        : Detail::Bitwise<T, std::bit_or<T>, OperationKind::Or, T{}> {};
+
+    template<typename U, typename T>
+    struct Operation<std::bit_xor<U>, T, std::enable_if_t<Detail::Accepts<U, T> && std::is_integral_v<T>>>
+        : Detail::Bitwise<T, std::bit_xor<T>, OperationKind::Xor, T{}> {};
+
+    template<typename T>
+    struct Operation<Sum<T>, T> : Detail::Add<T> {};
+
+    template<typename T>
+    struct Operation<Product<T>, T> : Detail::Multiply<T> {};
+
+    template<typename T>
+    struct Operation<Min<T>, T> : Detail::Minimum<T> {};
+
+    template<typename T>
+    struct Operation<Max<T>, T> : Detail::Maximum<T> {};
+
+    /*
+        C++17 has no way to ask whether an iterator is contiguous, so this recognizes the
+        ones that are known to be: pointers, and vector and string iterators. Only element
+        types a kernel could use are looked at, which keeps it from naming containers of
+        things like void or strings of doubles.
+    */
+    namespace Detail
+    {
+        template<typename Iterator, typename T, typename = void>
+        struct IsVectorIterator : std::false_type {};
+
+        template<typename Iterator, typename T>
+        struct IsVectorIterator<Iterator, T, std::enable_if_t<IsKernelElement<T>>>
+            : std::bool_constant<
+                std::is_same_v<Iterator, typename std::vector<T>::iterator> ||
+                std::is_same_v<Iterator, typename std::vector<T>::const_iterator>> {};
+
+        template<typename T>
+        constexpr bool IsCharacter = std::is_same_v<T, char> || std::is_same_v<T, wchar_t> ||
+            std::is_same_v<T, char16_t> || std::is_same_v<T, char32_t>;
+
+        template<typename Iterator, typename T, typename = void>
+        struct IsStringIterator : std::false_type {};
+
+        template<typename Iterator, typename T>
+        struct IsStringIterator<Iterator, T, std::enable_if_t<IsCharacter<T>>>
+            : std::bool_constant<
+                std::is_same_v<Iterator, typename std::basic_string<T>::iterator> ||
+                std::is_same_v<Iterator, typename std::basic_string<T>::const_iterator>> {};
+    }
+
+    template<typename Iterator, typename = void>
+    struct IsContiguous : std::false_type {};
+
+    template<typename T>
+    struct IsContiguous<T*> : std::true_type {};
+
+    template<typename Iterator>
+    struct IsContiguous<Iterator, std::enable_if_t<!std::is_pointer_v<Iterator>>>
+        : std::bool_constant<
+            Detail::IsVectorIterator<Iterator, typename std::iterator_traits<Iterator>::value_type>::value ||
+            Detail::IsStringIterator<Iterator, typename std::iterator_traits<Iterator>::value_type>::value> {};
+
+    template<typename Iterator, typename Value, typename BinaryOp>
+    using OperationFor = Operation<std::decay_t<BinaryOp>, std::decay_t<Value>>;
+
+    /*
+        Whether [begin, end) folded from init with combine can use a kernel at all
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    constexpr bool IsAccelerated =
+        IsContiguous<Iterator>::value &&
+        std::is_same_v<std::remove_cv_t<typename std::iterator_traits<Iterator>::value_type>, std::decay_t<Value>> &&
+        OperationFor<Iterator, Value, BinaryOp>::supported;
+
+    /*
+        Whether it can also do so without changing the result of a left fold
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    constexpr bool IsExact = IsAccelerated<Iterator, Value, BinaryOp> && OperationFor<Iterator, Value, BinaryOp>::exact;
+
+    // The number of independent accumulators, which is also how far each step is unrolled
+    constexpr std::size_t Lanes = 8;
+
+    namespace Detail
+    {
+        template<typename Op, typename T, std::size_t...I>
+        void Step(T(&accumulators)[Lanes], const T* values, std::index_sequence<I...>)
+        {
+            ((accumulators[I] = Op::Combine(accumulators[I], values[I])), ...);
+        }
+
+        template<typename Op, typename T, std::size_t...I>
+        T CombineLanes(const T(&accumulators)[Lanes], std::index_sequence<I...>)
+        {
+            auto result = Op::Identity();
+            ((result = Op::Combine(result, accumulators[I])), ...);
+            return result;
+        }
+    }
+
+    /*
+        Folds [first, last) with Lanes accumulators. Element i goes into accumulator
+        i % Lanes, and the accumulators are combined in order at the end.
+    */
+    template<typename Op, typename T>
+    T UnrolledFold(const T* first, const T* last, const StreamingOptions& options)
+    {
+        constexpr auto Indices = std::make_index_sequence<Lanes>{};
+
+        T accumulators[Lanes];
+        for (auto& accumulator : accumulators)
+            accumulator = Op::Identity();
+
+        for (; static_cast<std::size_t>(last - first) >= Lanes; first += Lanes)
+        {
+            PrefetchBlock(first, Lanes * sizeof(T), options);
+            Detail::Step<Op>(accumulators, first, Indices);
+        }
+
+        for (std::size_t i = 0; first != last; ++first, ++i)
+            accumulators[i] = Op::Combine(accumulators[i], *first);
+
+        return Detail::CombineLanes<Op>(accumulators, Indices);
+    }
+
+    template<typename Iterator>
+    auto AddressOf(Iterator iterator)
+    {
+        if constexpr (std::is_pointer_v<Iterator>)
+            return iterator;
+        else
+            return std::addressof(*iterator);
+    }
+
+    /*
+        Folds [begin, end) onto init with Op, which the combine was recognized as
+    */
+    template<typename Op, typename Iterator, typename Value>
+    auto Fold(Iterator begin, Iterator end, Value&& init, const KernelOptions& options)
+    {
+        if (begin == end)
+            return std::decay_t<Value>{ std::forward<Value>(init) };
+
+        const auto first = AddressOf(begin);
+        const auto last = first + std::distance(begin, end);
+
+        // A vector kernel for the instruction set, if there is one
+        if (const auto kernel = VectorFoldKernel<Op, std::remove_cv_t<std::remove_pointer_t<decltype(first)>>>(options.isa))
+            return Op::Combine(init, kernel(first, last, options.streaming));
+
+        return Op::Combine(init, UnrolledFold<Op>(first, last, options.streaming));
+    }
+
+    /*
+        std::accumulate as C++20 has it: the running value is moved into every combine,
+        so a combine that takes it by value can add to it in place. Before C++20 it's
+        copied every step, which makes folding into a collection quadratic.
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    std::decay_t<Value> MovingAccumulate(Iterator begin, Iterator end, Value&& init, BinaryOp&& combine)
+    {
+        std::decay_t<Value> result{ std::forward<Value>(init) };
+
+        for (; begin != end; ++begin)
+            result = combine(std::move(result), *begin);
+
+        return result;
+    }
+
+    /*
+        A drop-in for std::accumulate. It only takes a kernel when doing so gives exactly
+        the same result, so floating point sums still add up left to right.
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    auto Accumulate(Iterator begin, Iterator end, Value&& init, BinaryOp&& combine, const KernelOptions& options = {})
+    {
+        if constexpr (IsExact<Iterator, Value, BinaryOp>)
+            return Fold<OperationFor<Iterator, Value, BinaryOp>>(begin, end, std::forward<Value>(init), options);
+        else
+            return MovingAccumulate(begin, end, std::forward<Value>(init), std::forward<BinaryOp>(combine));
+    }
+
+    /*
+        For callers that already treat combine as associative and don't promise an order,
+        like Reduce. Floating point sums are regrouped here too, which is what std::reduce
+        is allowed to do as well.
+    */
+    template<typename Iterator, typename Value, typename BinaryOp>
+    auto Reduce(Iterator begin, Iterator end, Value&& init, BinaryOp&& combine, const KernelOptions& options = {})
+    {
+        if constexpr (IsAccelerated<Iterator, Value, BinaryOp>)
+            return Fold<OperationFor<Iterator, Value, BinaryOp>>(begin, end, std::forward<Value>(init), options);
+        else
+            return MovingAccumulate(begin, end, std::forward<Value>(init), std::forward<BinaryOp>(combine));
+    }
+}
+
+}
@@ -0,0 +1,572 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "topology.h"
+
+namespace Monoids
+{
+namespace Detail
+{
+    /*
+        What a forked function that returns nothing hands back, since there has to be a
+        type for its result slot
+    */
+    struct Nothing
+    {
+    };
+
+    template<typename Fn>
+    auto CallReturning(Fn& fn)
+    {
+        if constexpr (std::is_void_v<std::invoke_result_t<Fn&>>)
+        {
+            fn();
+            return Nothing{};
+        }
+        else
+        {
+            return fn();
+        }
+    }
+
+    template<typename Fn>
+    using ForkResult = decltype(CallReturning(std::declval<Fn&>()));
+}
+
+/*
+    A fork-join pool for the divide and conquer algorithms.
+
+    Reduce used to start both halves of every split as new std::async tasks and then
+    block in get() until they were done, so every split had a thread sitting idle, and
+    there were about twice as many threads as leaves. Here, a split runs one half inline
+    on the current thread and makes the other half available for stealing. When the
+    inline half finishes, the thread takes the other half back if nobody stole it, which
+    is the common case and costs nothing but a push and a pop. If it was stolen, the
+    thread doesn't block; it helps by running other tasks until the stolen half is done.
+    The whole recursion runs on exactly the pool's threads.
+
+    Every worker has its own deque of tasks. The owner pushes and pops at the back, so it works on
+    the most recently forked (smallest, cache-hot) task, and thieves take from the front,
+    which is the oldest and so the biggest piece of work. Idle workers sleep until new
+    work is pushed.
+
+    Forked tasks live on the forking thread's stack, since it never leaves the frame
+    before the task is done, and the deques keep their storage once they've grown to the
+    deepest recursion. A reduction that's run in a loop stops allocating after the first
+    few calls.
+*/
+class ForkJoinPool
+{
+public:
+
+    /*
+        threads workers, pinned according to the placement policy
+    */
+    explicit ForkJoinPool(unsigned threads = std::thread::hardware_concurrency(),
+        PlacementPolicy placement = PlacementPolicy::None)
+        : workers(std::max(1u, threads))
+    {
+        plan = Topology::Current().Plan(placement, static_cast<unsigned>(workers.size()));
+
+        for (std::size_t i = 0; i < workers.size(); ++i)
+            workers[i].thread = std::thread{ [this, i] { WorkerLoop(i); } };
+    }
+
+    ForkJoinPool(const ForkJoinPool&) = delete;
+    ForkJoinPool& operator=(const ForkJoinPool&) = delete;
+
+    ~ForkJoinPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ sleepMutex };
+            stopping = true;
+            ++epoch;
+        }
+
+        sleepCondition.notify_all();
+
+        for (auto& worker : workers)
+            worker.thread.join();
+    }
+
+    /*
+        The pool shared by the algorithms, with one worker per hardware thread. The
+        FUNCTIONALCPP_PLACEMENT environment variable (compact, scatter, physical or none)
+        picks how they're pinned.
+    */
+    static ForkJoinPool& Default()
+    {
+        static ForkJoinPool pool{ std::thread::hardware_concurrency(), DefaultPlacement() };
+        return pool;
+    }
+
+    /*
+        The pool for a placement, with as many workers as the placement has CPUs, made the
+        first time it's asked for and kept for the rest of the process, so a tuned
+        reduction runs on the CPUs it was tuned on. A reduction that wants fewer threads
+        limits how many leaves it runs at once instead of getting a pool of its own.
+        Without a placement, that's the default pool.
+    */
+    static ForkJoinPool& Placed(PlacementPolicy placement)
+    {
+        if (placement == PlacementPolicy::None)
+            return Default();
+
+        static std::mutex mutex{};
+        static std::map<PlacementPolicy, std::unique_ptr<ForkJoinPool>> pools{};
+
+        std::lock_guard<std::mutex> lock{ mutex };
+
+        auto& pool = pools[placement];
+        if (!pool)
+        {
+            const auto& topology = Topology::Current();
+            const auto cpus = placement == PlacementPolicy::PhysicalCoresOnly ? topology.Cores() : topology.Cpus().size();
+            pool = std::make_unique<ForkJoinPool>(static_cast<unsigned>(std::max<std::size_t>(1, cpus)), placement);
+        }
+
+        return *pool;
+    }
+
+    unsigned Threads() const
+    {
+        return static_cast<unsigned>(workers.size());
+    }
+
+    /*
+        Runs fn on one of the workers and waits for its result. Called from a worker of
+        this pool, that's just a call.
+    */
+    template<typename Fn>
+    auto Invoke(Fn&& fn) -> Detail::ForkResult<Fn>
+    {
+        if (CurrentWorker() != nullptr)
+            return Detail::CallReturning(fn);
+
+        InvokedTask<std::decay_t<Fn>> task{ std::forward<Fn>(fn) };
+        {
+            std::lock_guard<std::mutex> lock{ injectedMutex };
+            injected.PushBack(&task);
+        }
+
+        Wake();
+        return task.Wait();
+    }
+
+    /*
+        Runs lhs and rhs, possibly in parallel, and returns both results. lhs runs on the
+        calling thread and rhs can be stolen while it does. A side that returns void
+        gives back Detail::Nothing.
+    */
+    template<typename Lhs, typename Rhs>
+    auto Fork(Lhs&& lhs, Rhs&& rhs) -> std::pair<Detail::ForkResult<Lhs>, Detail::ForkResult<Rhs>>
+    {
+        const auto worker = CurrentWorker();
+        if (worker == nullptr)
+            return Invoke([&] { return Fork(lhs, rhs); });
+
+        ForkedTask<std::remove_reference_t<Rhs>> forked{ rhs };
+        worker->Push(&forked);
+        Wake();
+
+        // If lhs throws, rhs still has to finish before its frame goes away
+        std::optional<Detail::ForkResult<Lhs>> lhsResult{};
+        std::exception_ptr error{};
+
+        try
+        {
+            lhsResult.emplace(Detail::CallReturning(lhs));
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        Join(*worker, forked);
+
+        if (error)
+            std::rethrow_exception(error);
+
+        return { std::move(*lhsResult), forked.Result() };
+    }
+
+private:
+
+    struct Task
+    {
+        virtual void Run() = 0;
+
+    protected:
+
+        ~Task() = default;
+    };
+
+    template<typename Fn>
+    class ForkedTask final : public Task
+    {
+    public:
+
+        explicit ForkedTask(Fn& fn)
+            : fn(fn)
+        {
+        }
+
+        void Run() override
+        {
+            try
+            {
+                result.emplace(Detail::CallReturning(fn));
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            // Last, since the forking thread may return (and destroy this) as soon as it sees it
+            done.store(true, std::memory_order_release);
+        }
+
+        bool Done() const
+        {
+            return done.load(std::memory_order_acquire);
+        }
+
+        Detail::ForkResult<Fn> Result()
+        {
+            if (error)
+                std::rethrow_exception(error);
+
+            return std::move(*result);
+        }
+
+    private:
+
+        Fn& fn;
+        std::optional<Detail::ForkResult<Fn>> result{};
+        std::exception_ptr error{};
+        std::atomic<bool> done{ false };
+    };
+
+    /*
+        A task started from outside the pool. The caller isn't a worker, so it can't help,
+        and sleeps until a worker has run it.
+    */
+    template<typename Fn>
+    class InvokedTask final : public Task
+    {
+    public:
+
+        explicit InvokedTask(Fn fn)
+            : fn(std::move(fn))
+        {
+        }
+
+        void Run() override
+        {
+            try
+            {
+                result.emplace(Detail::CallReturning(fn));
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock{ mutex };
+            done = true;
+            condition.notify_one();
+        }
+
+        Detail::ForkResult<Fn> Wait()
+        {
+            std::unique_lock<std::mutex> lock{ mutex };
+            condition.wait(lock, [this] { return done; });
+
+            if (error)
+                std::rethrow_exception(error);
+
+            return std::move(*result);
+        }
+
+    private:
+
+        Fn fn;
+        std::optional<Detail::ForkResult<Fn>> result{};
+        std::exception_ptr error{};
+        std::mutex mutex{};
+        std::condition_variable condition{};
+        bool done{};
+    };
+
+    /*
+        A double-ended queue of tasks in a ring that only ever grows. std::deque frees and
+        allocates a block every time its back crosses a block boundary, which the push and
+        pop of every fork does over and over again.
+    */
+    class TaskRing
+    {
+    public:
+
+        bool Empty() const
+        {
+            return count == 0;
+        }
+
+        Task* Front() const
+        {
+            return slots[first];
+        }
+
+        Task* Back() const
+        {
+            return slots[(first + count - 1) & (slots.size() - 1)];
+        }
+
+        void PushBack(Task* task)
+        {
+            if (count == slots.size())
+                Grow();
+
+            slots[(first + count) & (slots.size() - 1)] = task;
+            ++count;
+        }
+
+        Task* PopBack()
+        {
+            const auto task = Back();
+            --count;
+            return task;
+        }
+
+        Task* PopFront()
+        {
+            const auto task = Front();
+            first = (first + 1) & (slots.size() - 1);
+            --count;
+            return task;
+        }
+
+    private:
+
+        void Grow()
+        {
+            std::vector<Task*> grown(std::max<std::size_t>(64, 2 * slots.size()));
+            for (std::size_t i = 0; i < count; ++i)
+                grown[i] = slots[(first + i) & (slots.size() - 1)];
+
+            slots.swap(grown);
+            first = 0;
+        }
+
+    private:
+
+        // Always a power of two, so wrapping around is a mask
+        std::vector<Task*> slots{};
+        std::size_t first{};
+        std::size_t count{};
+    };
+
+    struct alignas(CacheLineSize) Worker
+    {
+        std::thread thread{};
+        std::mutex mutex{};
+        TaskRing tasks{};
+
+        void Push(Task* task)
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            tasks.PushBack(task);
+        }
+
+        Task* PopBack()
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            return tasks.Empty() ? nullptr : tasks.PopBack();
+        }
+
+        /*
+            Takes task back if it's still the newest one, which it is unless it was stolen
+        */
+        bool TakeBack(Task* task)
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            if (tasks.Empty() || tasks.Back() != task)
+                return false;
+
+            tasks.PopBack();
+            return true;
+        }
+
+        Task* Steal()
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            return tasks.Empty() ? nullptr : tasks.PopFront();
+        }
+    };
+
+    static PlacementPolicy DefaultPlacement()
+    {
+        auto placement = PlacementPolicy::None;
+        ParsePlacementPolicy(Detail::ReadEnvironment("FUNCTIONALCPP_PLACEMENT"), placement);
+        return placement;
+    }
+
+    static Worker*& CurrentWorkerSlot()
+    {
+        thread_local Worker* worker = nullptr;
+        return worker;
+    }
+
+    /*
+        The calling thread's worker if it's one of this pool's
+    */
+    Worker* CurrentWorker() const
+    {
+        const auto worker = CurrentWorkerSlot();
+        return worker != nullptr && worker >= workers.data() && worker < workers.data() + workers.size() ? worker : nullptr;
+    }
+
+    /*
+        Own deque first, newest first, then the oldest task of another worker, then
+        anything started from outside the pool.
+    */
+    Task* FindTask(Worker& self, std::uint32_t& random)
+    {
+        if (const auto task = self.PopBack())
+            return task;
+
+        const auto count = workers.size();
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto& victim = workers[(random + i) % count];
+            if (&victim == &self)
+                continue;
+
+            if (const auto task = victim.Steal())
+                return task;
+        }
+
+        std::lock_guard<std::mutex> lock{ injectedMutex };
+        return injected.Empty() ? nullptr : injected.PopFront();
+    }
+
+    template<typename Fn>
+    void Join(Worker& self, ForkedTask<Fn>& forked)
+    {
+        if (self.TakeBack(&forked))
+        {
+            forked.Run();
+            return;
+        }
+
+        // Stolen, so help with whatever else there is until the thief is done
+        std::uint32_t random = static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(&forked)) | 1;
+
+        while (!forked.Done())
+        {
+            if (const auto task = FindTask(self, random))
+                task->Run();
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    /*
+        Wakes sleeping workers after work was pushed. The fence pairs with the one in
+        WorkerLoop: either the sleeper sees the new work when it looks again, or this sees
+        the sleeper and wakes it.
+    */
+    void Wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) == 0)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock{ sleepMutex };
+            ++epoch;
+        }
+
+        sleepCondition.notify_all();
+    }
+
+    void WorkerLoop(std::size_t index)
+    {
+        auto& self = workers[index];
+        CurrentWorkerSlot() = &self;
+
+        const ScopedPin pin{ plan.empty() ? ~0u : plan[index] };
+        std::uint32_t random = static_cast<std::uint32_t>(index * 2654435761u) | 1;
+
+        while (true)
+        {
+            if (const auto task = FindTask(self, random))
+            {
+                task->Run();
+                continue;
+            }
+
+            std::uint64_t seen{};
+            {
+                std::lock_guard<std::mutex> lock{ sleepMutex };
+                if (stopping)
+                    return;
+
+                seen = epoch;
+            }
+
+            sleepers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // Work pushed before the sleeper count went up wasn't followed by a wake up
+            if (const auto task = FindTask(self, random))
+            {
+                sleepers.fetch_sub(1);
+                task->Run();
+                continue;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock{ sleepMutex };
+                sleepCondition.wait(lock, [this, seen] { return stopping || epoch != seen; });
+            }
+
+            sleepers.fetch_sub(1);
+        }
+    }
+
+private:
+
+    std::vector<Worker> workers{};
+    std::vector<unsigned> plan{};
+
+    std::mutex injectedMutex{};
+    TaskRing injected{};
+
+    std::atomic<unsigned> sleepers{ 0 };
+    std::mutex sleepMutex{};
+    std::condition_variable sleepCondition{};
+    std::uint64_t epoch{};
+    bool stopping{};
+};
+
+}
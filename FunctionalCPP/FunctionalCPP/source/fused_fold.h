@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "fork_join.h"
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    Several aggregates over the same data (a count, a sum, a maximum...) are normally
+    several folds, which means several passes over the data. But a tuple of monoids is a
+    monoid too: the identity is the tuple of identities and the combine works element by
+    element. Folding with that product monoid computes every aggregate in a single pass.
+
+        auto [count, total, oldest] = Fused::Fold(people,
+            Fused::Count(), Fused::Sum(&Person::age), Fused::Max(&Person::age));
+
+    Each term describes one aggregate, and is bound to the element type when the fold
+    starts. The accumulators live in a local tuple that the compiler can keep in
+    registers, and the per-element work for every term is expanded inline into one loop,
+    so there's no per-term indirection left at run time.
+
+    A bound term has to provide:
+
+        StateType Initial()                     the identity
+        void Accumulate(StateType&, item)       fold one element in
+        StateType Combine(lhs, rhs)             combine two partial states (parallel folds)
+        auto Result(const StateType&)           what the caller gets back
+*/
+namespace Fused
+{
+    /*
+        The projection used when a term should aggregate the elements themselves.
+    */
+    struct Itself
+    {
+        template<typename T>
+        constexpr const T& operator()(const T& item) const
+        {
+            return item;
+        }
+    };
+
+    /*
+        Folds a projection of every element with a monoid.
+    */
+    template<typename Projection, typename MonoidType>
+    class MonoidTerm
+    {
+    public:
+
+        using StateType = typename MonoidType::ValueType;
+
+        MonoidTerm(Projection projection, MonoidType monoid)
+            : projection(std::move(projection)), monoid(std::move(monoid))
+        {
+        }
+
+        StateType Initial() const
+        {
+            return monoid.identity;
+        }
+
+        template<typename Item>
+        void Accumulate(StateType& state, const Item& item) const
+        {
+            state = monoid(state, static_cast<StateType>(std::invoke(projection, item)));
+        }
+
+        StateType Combine(const StateType& lhs, const StateType& rhs) const
+        {
+            return monoid(lhs, rhs);
+        }
+
+        const StateType& Result(const StateType& state) const
+        {
+            return state;
+        }
+
+    private:
+
+        Projection projection;
+        MonoidType monoid;
+    };
+
+    /*
+        An unbound MonoidTerm for one of the standard monoid templates (Sum, Min, Max...),
+        where the value type is only known once the element type is.
+    */
+    template<template<typename> class MonoidTemplate, typename Projection>
+    class StandardTerm
+    {
+    public:
+
+        explicit StandardTerm(Projection projection)
+            : projection(std::move(projection))
+        {
+        }
+
+        template<typename Item>
+        auto Bind() const
+        {
+            using Value = std::decay_t<std::invoke_result_t<const Projection&, const Item&>>;
+            return MonoidTerm<Projection, MonoidTemplate<Value>>{ projection, MonoidTemplate<Value>{} };
+        }
+
+    private:
+
+        Projection projection;
+    };
+
+    /*
+        An unbound MonoidTerm for a user-supplied monoid.
+    */
+    template<typename Projection, typename MonoidType>
+    class CustomTerm
+    {
+    public:
+
+        CustomTerm(MonoidType monoid, Projection projection)
+            : projection(std::move(projection)), monoid(std::move(monoid))
+        {
+        }
+
+        template<typename Item>
+        auto Bind() const
+        {
+            return MonoidTerm<Projection, MonoidType>{ projection, monoid };
+        }
+
+    private:
+
+        Projection projection;
+        MonoidType monoid;
+    };
+
+    /*
+        Counts the elements that satisfy a predicate.
+    */
+    template<typename Predicate>
+    class CountTerm
+    {
+    public:
+
+        using StateType = std::size_t;
+
+        explicit CountTerm(Predicate predicate)
+            : predicate(std::move(predicate))
+        {
+        }
+
+        template<typename Item>
+        const CountTerm& Bind() const
+        {
+            return *this;
+        }
+
+        StateType Initial() const
+        {
+            return 0;
+        }
+
+        template<typename Item>
+        void Accumulate(StateType& state, const Item& item) const
+        {
+            state += std::invoke(predicate, item) ? 1 : 0;
+        }
+
+        StateType Combine(StateType lhs, StateType rhs) const
+        {
+            return lhs + rhs;
+        }
+
+        StateType Result(StateType state) const
+        {
+            return state;
+        }
+
+    private:
+
+        Predicate predicate;
+    };
+
+    struct Always
+    {
+        template<typename T>
+        constexpr bool operator()(const T&) const
+        {
+            return true;
+        }
+    };
+
+    inline auto Count()
+    {
+        return CountTerm<Always>{ Always{} };
+    }
+
+    template<typename Predicate>
+    auto CountIf(Predicate predicate)
+    {
+        return CountTerm<Predicate>{ std::move(predicate) };
+    }
+
+    template<typename Projection = Itself>
+    auto Sum(Projection projection = {})
+    {
+        return StandardTerm<Monoids::Sum, Projection>{ std::move(projection) };
+    }
+
+    template<typename Projection = Itself>
+    auto Min(Projection projection = {})
+    {
+        return StandardTerm<Monoids::Min, Projection>{ std::move(projection) };
+    }
+
+    template<typename Projection = Itself>
+    auto Max(Projection projection = {})
+    {
+        return StandardTerm<Monoids::Max, Projection>{ std::move(projection) };
+    }
+
+    template<typename MonoidType, typename Projection = Itself>
+    auto Aggregate(MonoidType monoid, Projection projection = {})
+    {
+        return CustomTerm<Projection, MonoidType>{ std::move(monoid), std::move(projection) };
+    }
+
+    namespace Detail
+    {
+        template<typename Iterator, typename Terms, std::size_t...I>
+        auto FoldStates(Iterator begin, Iterator end, const Terms& terms, std::index_sequence<I...>)
+        {
+            auto states = std::make_tuple(std::get<I>(terms).Initial()...);
+
+            for (; begin != end; ++begin)
+            {
+                const auto& item = *begin;
+                (std::get<I>(terms).Accumulate(std::get<I>(states), item), ...);
+            }
+
+            return states;
+        }
+
+        template<typename Terms, typename States, std::size_t...I>
+        States CombineStates(const Terms& terms, const States& lhs, const States& rhs, std::index_sequence<I...>)
+        {
+            return States{ std::get<I>(terms).Combine(std::get<I>(lhs), std::get<I>(rhs))... };
+        }
+
+        template<typename Terms, typename States, std::size_t...I>
+        auto Results(const Terms& terms, const States& states, std::index_sequence<I...>)
+        {
+            return std::make_tuple(std::get<I>(terms).Result(std::get<I>(states))...);
+        }
+
+        /*
+            The same divide and conquer as Reduce, except every leaf folds all of the terms
+            at once and the partial states are combined term by term on the way out.
+        */
+        template<typename Iterator, typename Terms, typename Indices>
+        auto ParallelFoldStates(Iterator begin, Iterator end, const Terms& terms, std::ptrdiff_t load, Indices indices)
+        {
+            if (std::distance(begin, end) <= load)
+                return FoldStates(begin, end, terms, indices);
+
+            auto middle = std::next(begin, std::distance(begin, end) / 2);
+            auto states = ForkJoinPool::Default().Fork(
+                [=, &terms] { return ParallelFoldStates(begin, middle, terms, load, indices); },
+                [=, &terms] { return ParallelFoldStates(middle, end, terms, load, indices); });
+
+            return CombineStates(terms, states.first, states.second, indices);
+        }
+
+        template<typename Range>
+        using ItemOf = std::decay_t<decltype(*std::begin(std::declval<const Range&>()))>;
+    }
+
+    /*
+        Folds every term over the range in a single sequential pass, and returns a tuple
+        with one result per term, in the order the terms were given.
+    */
+    template<typename Range, typename...Terms>
+    auto Fold(const Range& range, const Terms&...terms)
+    {
+        using Item = Detail::ItemOf<Range>;
+
+        const auto bound = std::make_tuple(terms.template Bind<Item>()...);
+        const auto indices = std::index_sequence_for<Terms...>{};
+
+        return Detail::Results(bound, Detail::FoldStates(std::cbegin(range), std::cend(range), bound, indices), indices);
+    }
+
+    /*
+        The same single pass, split across threads. The range needs random access
+        iterators, and the terms' combines have to be associative.
+    */
+    template<typename Range, typename...Terms>
+    auto ParallelFold(const Range& range, const Terms&...terms)
+    {
+        using Item = Detail::ItemOf<Range>;
+
+        const auto bound = std::make_tuple(terms.template Bind<Item>()...);
+        const auto indices = std::index_sequence_for<Terms...>{};
+
+        const auto size = std::distance(std::cbegin(range), std::cend(range));
+        const auto load = std::max<std::ptrdiff_t>(1, size / std::max(1u, std::thread::hardware_concurrency()));
+
+        return Detail::Results(bound, Detail::ParallelFoldStates(std::cbegin(range), std::cend(range), bound, load, indices), indices);
+    }
+}
+
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    std::unordered_set and std::unordered_map hang every element off a bucket in a node
+    of its own, so every lookup is at least two cache misses and every insert is an
+    allocation. These keep the elements in one flat array instead, and resolve
+    collisions by probing the slots that follow (open addressing, with linear probing).
+    A lookup then reads consecutive memory until it finds the element or an empty slot.
+
+    Every slot has a control byte next to it in a separate array, which is zero for an
+    empty slot and otherwise holds seven bits of the element's hash. Probing compares
+    those bytes first, and only compares elements whose bits match, so long probes stay
+    cheap even for elements that are expensive to compare.
+
+    The hash is mixed with a multiply (Fibonacci hashing) before it's used, since
+    std::hash of an integer is usually the integer itself, and consecutive keys would
+    otherwise fill consecutive slots. The table doubles when it's three quarters full.
+    The elements have to be default constructible, since the empty slots hold one.
+*/
+namespace Detail
+{
+    template<typename Entry, typename Key, typename KeyOf, typename Hash, typename Equal>
+    class OpenTable
+    {
+    public:
+
+        OpenTable(Hash hash, Equal equal)
+            : hash(std::move(hash)), equal(std::move(equal))
+        {
+        }
+
+        std::size_t Size() const
+        {
+            return size;
+        }
+
+        /*
+            Makes room for count entries without growing again
+        */
+        void Reserve(std::size_t count)
+        {
+            auto capacity = std::max<std::size_t>(MinimumCapacity, slots.size());
+            while (count * 4 > capacity * 3)
+                capacity *= 2;
+
+            if (capacity != slots.size())
+                Rehash(capacity);
+        }
+
+        const Entry* Find(const Key& key) const
+        {
+            if (size == 0)
+                return nullptr;
+
+            const auto mixed = Mix(key);
+            const auto fingerprint = Fingerprint(mixed);
+
+            for (auto slot = Home(mixed); control[slot] != 0; slot = (slot + 1) & mask)
+            {
+                if (control[slot] == fingerprint && equal(KeyOf{}(slots[slot]), key))
+                    return &slots[slot];
+            }
+
+            return nullptr;
+        }
+
+        /*
+            The entry for key's slot, and whether it was just made. A new entry is built
+            from entry; an existing one is left for the caller to update.
+        */
+        template<typename Value>
+        std::pair<Entry*, bool> Insert(Value&& entry)
+        {
+            Reserve(size + 1);
+
+            const auto& key = KeyOf{}(entry);
+            const auto mixed = Mix(key);
+            const auto fingerprint = Fingerprint(mixed);
+
+            auto slot = Home(mixed);
+            for (; control[slot] != 0; slot = (slot + 1) & mask)
+            {
+                if (control[slot] == fingerprint && equal(KeyOf{}(slots[slot]), key))
+                    return { &slots[slot], false };
+            }
+
+            control[slot] = fingerprint;
+            slots[slot] = std::forward<Value>(entry);
+            ++size;
+
+            return { &slots[slot], true };
+        }
+
+        /*
+            Keeps only the entries keep says to. Removing from the middle of a probe
+            sequence would break it, so the survivors are put into a fresh table.
+        */
+        template<typename Predicate>
+        void KeepIf(const Predicate& keep)
+        {
+            OpenTable kept{ hash, equal };
+            kept.Reserve(size);
+
+            ForEach([&kept, &keep](const Entry& entry)
+            {
+                if (keep(entry))
+                    kept.Insert(entry);
+            });
+
+            *this = std::move(kept);
+        }
+
+        template<typename Fn>
+        void ForEach(const Fn& fn) const
+        {
+            for (std::size_t slot = 0; slot < slots.size(); ++slot)
+            {
+                if (control[slot] != 0)
+                    fn(slots[slot]);
+            }
+        }
+
+    private:
+
+        static constexpr std::size_t MinimumCapacity = 16;
+
+        std::uint64_t Mix(const Key& key) const
+        {
+            return static_cast<std::uint64_t>(hash(key)) * 0x9E3779B97F4A7C15ULL;
+        }
+
+        // The top bits of the mixed hash pick the slot, and the bottom ones go in the
+        // control byte, with the high bit set so it's never zero
+        std::size_t Home(std::uint64_t mixed) const
+        {
+            return static_cast<std::size_t>(mixed >> shift);
+        }
+
+        static std::uint8_t Fingerprint(std::uint64_t mixed)
+        {
+            return static_cast<std::uint8_t>(0x80 | (mixed & 0x7F));
+        }
+
+        void Rehash(std::size_t capacity)
+        {
+            auto oldControl = std::move(control);
+            auto oldSlots = std::move(slots);
+
+            control.assign(capacity, 0);
+            slots = std::vector<Entry>(capacity);
+            mask = capacity - 1;
+            shift = 64;
+            for (auto bits = capacity; bits > 1; bits /= 2)
+                --shift;
+
+            for (std::size_t slot = 0; slot < oldSlots.size(); ++slot)
+            {
+                if (oldControl[slot] == 0)
+                    continue;
+
+                auto target = Home(Mix(KeyOf{}(oldSlots[slot])));
+                while (control[target] != 0)
+                    target = (target + 1) & mask;
+
+                control[target] = oldControl[slot];
+                slots[target] = std::move(oldSlots[slot]);
+            }
+        }
+
+    private:
+
+        std::vector<std::uint8_t> control{};
+        std::vector<Entry> slots{};
+        std::size_t size = 0;
+        std::size_t mask = 0;
+        unsigned shift = 64;
+
+        Hash hash{};
+        Equal equal{};
+    };
+
+    struct KeyOfElement
+    {
+        template<typename T>
+        const T& operator()(const T& element) const { return element; }
+    };
+
+    struct KeyOfEntry
+    {
+        template<typename Entry>
+        const auto& operator()(const Entry& entry) const { return entry.first; }
+    };
+}
+
+template<typename T, typename Hash = std::hash<T>, typename Equal = std::equal_to<>>
+class HashSet
+{
+public:
+
+    using value_type = T;
+
+    explicit HashSet(Hash hash = {}, Equal equal = {})
+        : table(std::move(hash), std::move(equal))
+    {
+    }
+
+    void Insert(const T& element)
+    {
+        table.Insert(element);
+    }
+
+    /*
+        Adds every element of other, making room for all of them up front
+    */
+    void Merge(const HashSet& other)
+    {
+        table.Reserve(table.Size() + other.table.Size());
+        other.table.ForEach([this](const T& element) { table.Insert(element); });
+    }
+
+    void IntersectWith(const HashSet& other)
+    {
+        table.KeepIf([&other](const T& element) { return other.Contains(element); });
+    }
+
+    bool Contains(const T& element) const
+    {
+        return table.Find(element) != nullptr;
+    }
+
+    std::size_t Size() const
+    {
+        return table.Size();
+    }
+
+    void Reserve(std::size_t count)
+    {
+        table.Reserve(count);
+    }
+
+    /*
+        Calls fn with every element, in no particular order
+    */
+    template<typename Fn>
+    void ForEach(const Fn& fn) const
+    {
+        table.ForEach(fn);
+    }
+
+private:
+
+    Detail::OpenTable<T, T, Detail::KeyOfElement, Hash, Equal> table;
+};
+
+/*
+    A map whose values are combined with ValueMonoid when a key is inserted again, or two
+    maps that share a key are merged, older first
+*/
+template<typename Key, typename ValueMonoid, typename Hash = std::hash<Key>, typename Equal = std::equal_to<>>
+class HashMap
+{
+public:
+
+    using Mapped = typename ValueMonoid::ValueType;
+    using value_type = std::pair<Key, Mapped>;
+
+    explicit HashMap(ValueMonoid monoid = {}, Hash hash = {}, Equal equal = {})
+        : table(std::move(hash), std::move(equal)), monoid(std::move(monoid))
+    {
+    }
+
+    void Insert(const value_type& entry)
+    {
+        const auto [slot, inserted] = table.Insert(entry);
+        if (!inserted)
+            slot->second = monoid(slot->second, entry.second);
+    }
+
+    void Insert(const Key& key, const Mapped& value)
+    {
+        Insert(value_type{ key, value });
+    }
+
+    void Merge(const HashMap& other)
+    {
+        table.Reserve(table.Size() + other.table.Size());
+        other.table.ForEach([this](const value_type& entry) { Insert(entry); });
+    }
+
+    /*
+        The value for key, or the monoid's identity when there isn't one
+    */
+    Mapped Find(const Key& key) const
+    {
+        const auto found = table.Find(key);
+        return found ? found->second : monoid.identity;
+    }
+
+    std::size_t Size() const
+    {
+        return table.Size();
+    }
+
+    void Reserve(std::size_t count)
+    {
+        table.Reserve(count);
+    }
+
+    template<typename Fn>
+    void ForEach(const Fn& fn) const
+    {
+        table.ForEach(fn);
+    }
+
+private:
+
+    Detail::OpenTable<value_type, Key, Detail::KeyOfEntry, Hash, Equal> table;
+    ValueMonoid monoid{};
+};
+
+template<typename T, typename Hash, typename Equal>
+struct IsIdempotent<Union<HashSet<T, Hash, Equal>>> : std::true_type {};
+
+template<typename Key, typename ValueMonoid, typename Hash, typename Equal>
+struct IsIdempotent<Union<HashMap<Key, ValueMonoid, Hash, Equal>>> : IsIdempotent<ValueMonoid> {};
+
+}
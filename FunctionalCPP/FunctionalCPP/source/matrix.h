@@ -0,0 +1,427 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "simd_kernels.h"
+
+namespace Monoids
+{
+/*
+    Matrix multiplication kernels, one per instruction set like the fold kernels. They
+    multiply a rows x inner matrix by an inner x columns one, all stored row by row.
+
+    Every row of the result is built a row of rhs at a time: each element of the lhs
+    row is broadcast and multiplied into the whole rhs row, so the innermost loop walks
+    both rhs and the result contiguously, a vector at a time. For matrices sized at run
+    time, the loops over inner and columns are cut into blocks, so the part of rhs a
+    block needs stays in cache while every row of lhs goes past it. For the fixed sizes,
+    the loops are unrolled at compile time and each row of the result is summed in
+    registers.
+
+    The products and sums are separate instructions rather than fused, and every element
+    of the result adds up its products in the same order in every kernel, so they all
+    give exactly the same result.
+*/
+namespace Kernels
+{
+    template<typename T>
+    using MultiplyKernel = void(*)(const T*, const T*, T*, std::size_t, std::size_t, std::size_t);
+
+    template<typename T>
+    using FixedMultiplyKernel = void(*)(const T*, const T*, T*);
+
+    // Elements of inner and columns per block. Two blocks of doubles fit in 64 KiB.
+    constexpr std::size_t MultiplyBlock = 64;
+
+    namespace Detail
+    {
+        /*
+            The blocked loop every kernel for run time sizes shares. row(a, rhsRow,
+            outRow, first, last) adds a times rhsRow into outRow over the columns
+            [first, last).
+        */
+        template<typename T, typename Row>
+        void BlockedMultiply(const T* lhs, const T* rhs, T* out, std::size_t rows, std::size_t inner, std::size_t columns, const Row& row)
+        {
+            std::fill(out, out + rows * columns, T{});
+
+            for (std::size_t kk = 0; kk < inner; kk += MultiplyBlock)
+            {
+                const auto kEnd = std::min(kk + MultiplyBlock, inner);
+
+                for (std::size_t jj = 0; jj < columns; jj += MultiplyBlock)
+                {
+                    const auto jEnd = std::min(jj + MultiplyBlock, columns);
+
+                    for (std::size_t i = 0; i < rows; ++i)
+                    {
+                        for (auto k = kk; k < kEnd; ++k)
+                            row(lhs[i * inner + k], rhs + k * columns, out + i * columns, jj, jEnd);
+                    }
+                }
+            }
+        }
+
+        /*
+            Element (i, j) of an N x N product, for the columns that don't fill a vector
+        */
+        template<typename T, std::size_t N>
+        T FixedElement(const T* lhs, const T* rhs, std::size_t i, std::size_t j)
+        {
+            T sum{};
+            for (std::size_t k = 0; k < N; ++k)
+                sum += lhs[i * N + k] * rhs[k * N + j];
+
+            return sum;
+        }
+    }
+
+    template<typename T>
+    void ScalarMultiply(const T* lhs, const T* rhs, T* out, std::size_t rows, std::size_t inner, std::size_t columns)
+    {
+        Detail::BlockedMultiply(lhs, rhs, out, rows, inner, columns,
+            [](const T a, const T* rhsRow, T* outRow, std::size_t first, std::size_t last)
+            {
+                for (auto j = first; j < last; ++j)
+                    outRow[j] += a * rhsRow[j];
+            });
+    }
+
+    template<typename T, std::size_t N>
+    void ScalarFixedMultiply(const T* lhs, const T* rhs, T* out)
+    {
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            for (std::size_t j = 0; j < N; ++j)
+                out[i * N + j] = Detail::FixedElement<T, N>(lhs, rhs, i, j);
+        }
+    }
+
+#if defined(FUNCTIONALCPP_X86)
+
+    /*
+        The vector kernels. They use the vector traits of the fold kernels, and are
+        written out once per instruction set for the same reason.
+    */
+    template<typename T>
+    FUNCTIONALCPP_TARGET("sse4.2") void Sse42Row(const T a, const T* rhsRow, T* outRow, std::size_t first, std::size_t last)
+    {
+        using V = Sse42Vector<T>;
+
+        const auto broadcast = V::Splat(a);
+        auto j = first;
+
+        for (; j + V::Width <= last; j += V::Width)
+        {
+            const auto product = V::template Apply<OperationKind::Multiply>(broadcast, V::Load(rhsRow + j));
+            V::Store(outRow + j, V::template Apply<OperationKind::Add>(V::Load(outRow + j), product));
+        }
+
+        for (; j < last; ++j)
+            outRow[j] += a * rhsRow[j];
+    }
+
+    template<typename T>
+    FUNCTIONALCPP_TARGET("avx2") void Avx2Row(const T a, const T* rhsRow, T* outRow, std::size_t first, std::size_t last)
+    {
+        using V = Avx2Vector<T>;
+
+        const auto broadcast = V::Splat(a);
+        auto j = first;
+
+        for (; j + V::Width <= last; j += V::Width)
+        {
+            const auto product = V::template Apply<OperationKind::Multiply>(broadcast, V::Load(rhsRow + j));
+            V::Store(outRow + j, V::template Apply<OperationKind::Add>(V::Load(outRow + j), product));
+        }
+
+        for (; j < last; ++j)
+            outRow[j] += a * rhsRow[j];
+    }
+
+    template<typename T>
+    FUNCTIONALCPP_TARGET("sse4.2") void Sse42Multiply(const T* lhs, const T* rhs, T* out, std::size_t rows, std::size_t inner, std::size_t columns)
+    {
+        Detail::BlockedMultiply(lhs, rhs, out, rows, inner, columns, &Sse42Row<T>);
+    }
+
+    template<typename T>
+    FUNCTIONALCPP_TARGET("avx2") void Avx2Multiply(const T* lhs, const T* rhs, T* out, std::size_t rows, std::size_t inner, std::size_t columns)
+    {
+        Detail::BlockedMultiply(lhs, rhs, out, rows, inner, columns, &Avx2Row<T>);
+    }
+
+    template<typename T, std::size_t N>
+    FUNCTIONALCPP_TARGET("sse4.2") void Sse42FixedMultiply(const T* lhs, const T* rhs, T* out)
+    {
+        using V = Sse42Vector<T>;
+
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            std::size_t j = 0;
+            for (; j + V::Width <= N; j += V::Width)
+            {
+                auto sum = V::Splat(T{});
+                for (std::size_t k = 0; k < N; ++k)
+                    sum = V::template Apply<OperationKind::Add>(sum, V::template Apply<OperationKind::Multiply>(V::Splat(lhs[i * N + k]), V::Load(rhs + k * N + j)));
+
+                V::Store(out + i * N + j, sum);
+            }
+
+            for (; j < N; ++j)
+                out[i * N + j] = Detail::FixedElement<T, N>(lhs, rhs, i, j);
+        }
+    }
+
+    template<typename T, std::size_t N>
+    FUNCTIONALCPP_TARGET("avx2") void Avx2FixedMultiply(const T* lhs, const T* rhs, T* out)
+    {
+        using V = Avx2Vector<T>;
+
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            std::size_t j = 0;
+            for (; j + V::Width <= N; j += V::Width)
+            {
+                auto sum = V::Splat(T{});
+                for (std::size_t k = 0; k < N; ++k)
+                    sum = V::template Apply<OperationKind::Add>(sum, V::template Apply<OperationKind::Multiply>(V::Splat(lhs[i * N + k]), V::Load(rhs + k * N + j)));
+
+                V::Store(out + i * N + j, sum);
+            }
+
+            for (; j < N; ++j)
+                out[i * N + j] = Detail::FixedElement<T, N>(lhs, rhs, i, j);
+        }
+    }
+
+#endif
+
+    template<typename T>
+    constexpr bool IsVectorFloat = std::is_same_v<T, float> || std::is_same_v<T, double>;
+
+    /*
+        There are vector kernels for float and double. Anything else (integers, for
+        counting paths) is multiplied by the scalar kernel. AVX-512 machines use the AVX2
+        kernel, since the small matrices this is for rarely have rows wide enough for it.
+    */
+    template<typename T>
+    MultiplyKernel<T> SelectMultiplyKernel(Isa isa)
+    {
+#if defined(FUNCTIONALCPP_X86)
+        if constexpr (IsVectorFloat<T>)
+        {
+            if (isa >= Isa::Avx2)
+                return &Avx2Multiply<T>;
+
+            if (isa >= Isa::Sse42)
+                return &Sse42Multiply<T>;
+        }
+#else
+        (void)isa;
+#endif
+        return &ScalarMultiply<T>;
+    }
+
+    /*
+        The same for a fixed size, where a row too narrow for an instruction set's vectors
+        is left to a narrower one
+    */
+    template<typename T, std::size_t N>
+    FixedMultiplyKernel<T> SelectFixedMultiplyKernel(Isa isa)
+    {
+#if defined(FUNCTIONALCPP_X86)
+        if constexpr (IsVectorFloat<T>)
+        {
+            if constexpr (N >= Avx2Vector<T>::Width)
+            {
+                if (isa >= Isa::Avx2)
+                    return &Avx2FixedMultiply<T, N>;
+            }
+
+            if constexpr (N >= Sse42Vector<T>::Width)
+            {
+                if (isa >= Isa::Sse42)
+                    return &Sse42FixedMultiply<T, N>;
+            }
+        }
+#else
+        (void)isa;
+#endif
+        return &ScalarFixedMultiply<T, N>;
+    }
+
+    template<typename T>
+    void Multiply(const T* lhs, const T* rhs, T* out, std::size_t rows, std::size_t inner, std::size_t columns)
+    {
+        static const MultiplyKernel<T> kernel = SelectMultiplyKernel<T>(SelectedIsa());
+        kernel(lhs, rhs, out, rows, inner, columns);
+    }
+
+    template<typename T, std::size_t N>
+    void FixedMultiply(const T* lhs, const T* rhs, T* out)
+    {
+        static const FixedMultiplyKernel<T> kernel = SelectFixedMultiplyKernel<T, N>(SelectedIsa());
+        kernel(lhs, rhs, out);
+    }
+}
+
+/*
+    Square matrices under multiplication form a monoid: the product is associative, and
+    the identity matrix is its identity. A matrix is a linear map, and multiplying two of
+    them composes the maps, so this is FunctionComposition for functions that happen to
+    be linear. Unlike arbitrary functions, though, two matrices compose into another
+    matrix of the same size, so a chain of a million transforms can be collapsed by
+    Reduce into one, in parallel, instead of being applied one after the other.
+
+    Matrix is the fixed size one, for the usual 2x2 to 8x8 transforms, kept inline with
+    no allocation. DynamicMatrix is sized at run time, for things like Markov transition
+    matrices.
+*/
+template<typename T, std::size_t N>
+struct Matrix
+{
+    static_assert(N > 0, "A matrix needs at least one row");
+
+    std::array<T, N * N> values{};
+
+    static Matrix Identity()
+    {
+        Matrix identity{};
+        for (std::size_t i = 0; i < N; ++i)
+            identity(i, i) = T{ 1 };
+
+        return identity;
+    }
+
+    T& operator()(std::size_t row, std::size_t column) { return values[row * N + column]; }
+    const T& operator()(std::size_t row, std::size_t column) const { return values[row * N + column]; }
+
+    friend Matrix operator*(const Matrix& lhs, const Matrix& rhs)
+    {
+        Matrix product{};
+        Kernels::FixedMultiply<T, N>(lhs.values.data(), rhs.values.data(), product.values.data());
+        return product;
+    }
+
+    friend bool operator==(const Matrix& lhs, const Matrix& rhs) { return lhs.values == rhs.values; }
+    friend bool operator!=(const Matrix& lhs, const Matrix& rhs) { return !(lhs == rhs); }
+};
+
+/*
+    A matrix sized at run time. Which size the identity should be depends on what it's
+    multiplied with, so Identity() gives a matrix marked as the identity that stands in
+    for it: multiplying by it gives back the other matrix, whatever its size. Every other
+    matrix is multiplied as what it is, empty ones included.
+*/
+template<typename T>
+class DynamicMatrix
+{
+public:
+
+    DynamicMatrix() = default;
+
+    DynamicMatrix(std::size_t rows, std::size_t columns)
+        : rows(rows), columns(columns), values(rows * columns, T{})
+    {
+    }
+
+    static DynamicMatrix Identity()
+    {
+        DynamicMatrix identity{};
+        identity.identity = true;
+        return identity;
+    }
+
+    static DynamicMatrix Identity(std::size_t size)
+    {
+        DynamicMatrix identity{ size, size };
+        for (std::size_t i = 0; i < size; ++i)
+            identity(i, i) = T{ 1 };
+
+        return identity;
+    }
+
+    std::size_t Rows() const { return rows; }
+    std::size_t Columns() const { return columns; }
+    bool Empty() const { return values.empty(); }
+    bool IsIdentity() const { return identity; }
+
+    T& operator()(std::size_t row, std::size_t column) { return values[row * columns + column]; }
+    const T& operator()(std::size_t row, std::size_t column) const { return values[row * columns + column]; }
+
+    friend DynamicMatrix operator*(const DynamicMatrix& lhs, const DynamicMatrix& rhs)
+    {
+        if (lhs.identity)
+            return rhs;
+
+        if (rhs.identity)
+            return lhs;
+
+        if (lhs.columns != rhs.rows)
+            throw std::invalid_argument{ "Multiplying matrices whose sizes don't match" };
+
+        DynamicMatrix product{ lhs.rows, rhs.columns };
+        Kernels::Multiply(lhs.values.data(), rhs.values.data(), product.values.data(), lhs.rows, lhs.columns, rhs.columns);
+        return product;
+    }
+
+    friend bool operator==(const DynamicMatrix& lhs, const DynamicMatrix& rhs)
+    {
+        return lhs.identity == rhs.identity && lhs.rows == rhs.rows && lhs.columns == rhs.columns && lhs.values == rhs.values;
+    }
+
+    friend bool operator!=(const DynamicMatrix& lhs, const DynamicMatrix& rhs) { return !(lhs == rhs); }
+
+private:
+
+    std::size_t rows = 0;
+    std::size_t columns = 0;
+    std::vector<T> values{};
+
+    // Only set by Identity(), so a 0 by n matrix isn't mistaken for it
+    bool identity = false;
+};
+
+/*
+    The product of a sequence of matrices, first to last. That's also the composition
+    of the maps for row vectors (v * A * B applies A first), which is how Markov
+    transition matrices are multiplied.
+*/
+template<typename MatrixType>
+struct MatrixProduct
+{
+    using ValueType = MatrixType;
+
+    MatrixType identity = MatrixType::Identity();
+
+    MatrixType operator()(const MatrixType& lhs, const MatrixType& rhs) const
+    {
+        return lhs * rhs;
+    }
+};
+
+/*
+    The composition of a sequence of transforms of column vectors, applied first to last,
+    like FunctionComposition: combining A and then B gives B * A.
+*/
+template<typename MatrixType>
+struct LinearComposition
+{
+    using ValueType = MatrixType;
+
+    MatrixType identity = MatrixType::Identity();
+
+    MatrixType operator()(const MatrixType& first, const MatrixType& then) const
+    {
+        return then * first;
+    }
+};
+
+}
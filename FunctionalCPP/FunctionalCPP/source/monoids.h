@@ -2,20 +2,53 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <iostream>
+#include <iterator>
 #include <functional>
-#include <future>
 #include <numeric>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <optional>
 #include <vector>
 #include <thread>
 #include <list>
+#include <set>
+#include <unordered_map>
 #include <execution>
+#include <filesystem>
 #include <fstream>
 #include <type_traits>
 
+#include "arena.h"
+#include "auto_tuner.h"
+#include "batched_reduce.h"
+#include "bit_set.h"
+#include "bounded_queue.h"
+#include "checkpoint.h"
+#include "concurrent_accumulator.h"
+#include "constexpr_folds.h"
+#include "external_aggregation.h"
+#include "flat_set.h"
+#include "fold_kernels.h"
+#include "fork_join.h"
+#include "fused_fold.h"
+#include "hash_set.h"
+#include "matrix.h"
+#include "mpmc_queue.h"
+#include "pipeline.h"
+#include "roaring_bitmap.h"
+#include "segment_tree.h"
+#include "serialization.h"
+#include "shared_memory_reduce.h"
+#include "socket_reduce.h"
+#include "sliding_window.h"
+#include "sorted_runs.h"
+
 /*
     Monoids are defined by the laws that classify them. There are three that
     make something a monoid:
@@ -50,6 +83,24 @@ public:
         OptionalReduction();
         FunctionComposition();
         MapReduce();
+        RangeQueries();
+        SlidingWindows();
+        ConcurrentAccumulation();
+        ProcessReduction();
+        DistributedReduction();
+        SerializingPartials();
+        SpillingAggregation();
+        ResumingAfterACrash();
+        FusedFolds();
+        CompileTimeFolds();
+        BatchedReduction();
+        PipelinedMapReduce();
+        QueueContention();
+        ArenaReduction();
+        SortedMerging();
+        DistinctKeys();
+        MatchedUserIds();
+        LinearMaps();
         Parallelization();
     }
 
@@ -61,26 +112,24 @@ private:
     template<typename Container, typename Value, typename BinaryOp>
     static auto LeftFold(const Container& container, Value&& init, BinaryOp&& combine)
     {
-        return std::accumulate(std::cbegin(container), std::cend(container),
+        return Kernels::Accumulate(std::cbegin(container), std::cend(container),
             std::forward<Value>(init), std::forward<BinaryOp>(combine));
     }
 
     /*
-        Creates a task that runs based on the given policy. This is a helper function
-        to ease making async tasks from arbitrary callable objects.
+        The same fold over a std::array, which can also run at compile time
     */
-    template<typename Fn, typename...Args>
-    static auto CreateTask(const std::launch policy, Fn&& fn, Args&&...args)
+    template<typename T, std::size_t N, typename Value, typename BinaryOp>
+    static constexpr auto LeftFold(const std::array<T, N>& container, Value&& init, BinaryOp&& combine)
     {
-        return std::future<std::invoke_result_t<Fn, Args...>>
-            { std::async(policy, std::forward<Fn>(fn), std::forward<Args>(args)...)};
+        return ConstexprLeftFold(container, std::forward<Value>(init), std::forward<BinaryOp>(combine));
     }
 
     /*
         A divide and conquer algorithm that recursively subdivides the range [begin, end)
         until it hits a load factor, then reduces each sub problem on the way out of recursion.
         The sums are computed sequentially, but as we work our way out of recursion, we
-        reduce each side of the split asynchronously.
+        reduce each side of the split in parallel on the fork-join pool.
 
         There are some things that can be done to improve the algorithm:
 
@@ -90,33 +139,22 @@ private:
         2. Mimic c++17 execution policies, which would allow the reduction of a container
             that requires each reduction process to not be interleaved
 
-        3. Investigate the inconsistent performance. It performs as expected,
-            but could be optimized to perform better. (I believe this may be due
-            to using task-based programming. If we could control the threads, then
-            we may be able to even out the overall performance)
+        3. Investigate the inconsistent performance. This used to start a new async task for
+            both halves of every split, and then block waiting on them, so half the threads
+            did nothing. Now the current thread reduces the left half itself while the right
+            half waits to be stolen by an idle worker, and a thread waiting on a stolen half
+            runs other work instead of blocking, so it all runs on the pool's threads.
+
+        The split itself lives in the tuner (Tuning::Reduce), so the configurations it
+        measures are the ones this runs with.
     */
     template<typename Iterator, typename Value, typename BinaryOp>
     static auto Reduce(Iterator begin, Iterator end, Value&& init, BinaryOp&& combine)
     {
-        // Obtains the distance between begin and end in the first call to reduce
-        static std::ptrdiff_t load = std::distance(begin, end) / std::thread::hardware_concurrency();
-
-        // Constant with random access iterators, linear otherwise
-        if (std::distance(begin, end) <= load)
-            return std::accumulate(begin, end, std::forward<Value>(init), std::forward<BinaryOp>(combine));
-
-        // Recursively reduce the left and right hand sides asynchronously. If this isn't done
-        // in separate threads, then the algorithm is sequential.
-        auto middle = std::next(begin, std::distance(begin, end) / 2);
-        auto lhsTask = CreateTask(std::launch::async, Reduce<Iterator, Value, BinaryOp>,
-            begin, middle, std::forward<Value>(init), std::forward<BinaryOp>(combine));
-
-        auto rhsTask = CreateTask(std::launch::async, Reduce<Iterator, Value, BinaryOp>,
-            middle, end, std::forward<Value>(init), std::forward<BinaryOp>(combine));
-
-        // Left fold the results, but they could really be combined in any way.
-        // This is an out of order reduction, and hence isn't a left or right fold.
-        return combine(combine(init, lhsTask.get()), rhsTask.get());
+        // Looks up the tuned configuration for this many elements once per call, and hands it
+        // down the whole recursion. Without a profile, that's one leaf per hardware thread.
+        const auto configuration = Tuning::ConfigurationFor<BinaryOp, Value>(std::distance(begin, end));
+        return Tuning::Reduce(begin, end, init, combine, configuration);
     }
 
     class Timer
@@ -291,6 +329,687 @@ private:
         */
     }
 
+    /*
+        Folding the whole container is O(n), which is too slow when the question is
+        "what's the fold of this sub-range" and it gets asked millions of times.
+        Since a monoid is associative, the partial folds can be precomputed once and reused.
+    */
+    static void RangeQueries()
+    {
+        std::vector<int> values(1'000);
+        std::iota(std::begin(values), std::end(values), 1);
+
+        // Sums of ranges, which can change after being built
+        SegmentTree<Sum<int>> sums{ std::begin(values), std::end(values) };
+        std::cout << "Sum of [10, 20): " << sums.Query(10, 20) << "\n";
+
+        sums.Update(15, 0);
+        std::cout << "Sum of [10, 20) after zeroing index 15: " << sums.Query(10, 20) << "\n";
+
+        // Any monoid works, including ones that aren't commutative
+        std::vector<std::string> words{ "Range ", "queries ", "over ", "any ", "monoid!\n" };
+        SegmentTree<Monoid<std::string, std::plus<std::string>>> concatenated
+            { std::begin(words), std::end(words), MakeMonoid(std::string{}, std::plus<std::string>{}) };
+        std::cout << concatenated.Query(0, words.size());
+
+        // Min is idempotent, so overlapping blocks can answer a query in constant time
+        SparseTable<Min<int>> minimums{ std::begin(values), std::end(values) };
+        std::cout << "Min of [250, 750): " << minimums.Query(250, 750) << "\n";
+    }
+
+    /*
+        Streams don't have an end to fold up to, so the question becomes "what's the fold
+        of the most recent values". Recomputing the window on every new value is O(n) per value,
+        but the window can be maintained as values come and go without needing an inverse.
+    */
+    static void SlidingWindows()
+    {
+        // The maximum of the last 3 values, with worst case O(1) per value
+        CountWindow<DabaAggregator<Max<int>>> rollingMax{ 3 };
+
+        for (const auto value : { 4, 8, 1, 2, 3, 9, 0, 1, 1 })
+        {
+            rollingMax.Push(value);
+            std::cout << rollingMax.Query() << " ";
+        }
+
+        std::cout << "\n";
+
+        // Concatenation of whatever arrived in the last 3 seconds
+        using Clock = std::chrono::steady_clock;
+        auto concatenate = MakeMonoid(std::string{}, std::plus<std::string>{});
+
+        TimeWindow<TwoStacksAggregator<decltype(concatenate)>, Clock> recent
+            { std::chrono::seconds{ 3 }, TwoStacksAggregator<decltype(concatenate)>{ concatenate } };
+
+        const auto start = Clock::now();
+        const std::vector<std::string> words{ "Sliding ", "windows ", "over ", "streams ", "of ", "monoids!" };
+
+        for (auto i = 0u; i < words.size(); ++i)
+            recent.Push(start + std::chrono::seconds{ i }, words[i]);
+
+        std::cout << recent.Query() << "\n";
+    }
+
+    /*
+        Reduce needs all of the data up front, but metrics arrive one value at a time from
+        many threads. Since the order doesn't matter for a commutative monoid, each thread
+        can fold into its own cell and the cells only get combined when someone reads them.
+    */
+    static void ConcurrentAccumulation()
+    {
+        struct Mean
+        {
+            double sum;
+            double count;
+        };
+
+        // 16 bytes, so it's combined with a double word CAS where the platform has one
+        auto meanMonoid = MakeMonoid(Mean{ 0.0, 0.0 },
+            [](const Mean& lhs, const Mean& rhs) { return Mean{ lhs.sum + rhs.sum, lhs.count + rhs.count }; });
+
+        ConcurrentAccumulator<Sum<long long>> requests{};
+        ConcurrentAccumulator<Max<int>> slowest{};
+        ConcurrentAccumulator<decltype(meanMonoid)> latency{ meanMonoid };
+
+        std::vector<std::thread> workers{};
+        for (auto i = 0; i < 4; ++i)
+        {
+            workers.emplace_back([&, i]
+            {
+                for (auto j = 0; j < 100'000; ++j)
+                {
+                    const auto elapsed = (i + j) % 50;
+
+                    requests.Add(1);
+                    slowest.Add(elapsed);
+                    latency.Add({ static_cast<double>(elapsed), 1.0 });
+                }
+            });
+        }
+
+        for (auto& worker : workers)
+            worker.join();
+
+        const auto mean = latency.Read();
+        std::cout << "Requests: " << requests.Read() << ", slowest: " << slowest.Read()
+            << ", mean: " << mean.sum / mean.count << "\n";
+    }
+
+    /*
+        Threads share a fate: if one of them crashes, the whole reduction goes with it.
+        Worker processes can each reduce a shard of a memory mapped file and hand their
+        partial monoid back through shared memory, and a crashed worker only costs its shard.
+    */
+    static void ProcessReduction()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const auto path = std::filesystem::temp_directory_path() / "functionalcpp_values.bin";
+
+        {
+            std::ofstream file{ path, std::ios::out | std::ios::binary };
+            for (auto i = 0; i < 1'000'000; ++i)
+            {
+                const auto value = static_cast<double>(i % 100);
+                file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+            }
+        }
+
+        {
+            MappedFile<double> values{ path.string() };
+            auto sum = ProcessReduce(std::begin(values), std::end(values), 0.0, std::plus<>(), 4);
+            std::cout << "Sum reduced by 4 processes: " << sum << "\n";
+        }
+
+        std::filesystem::remove(path);
+#endif
+    }
+
+    /*
+        Past a single machine, the partial monoids have to travel over the network.
+        Recursive doubling gets the full reduction to every rank in log2(n) exchanges.
+        This runs each rank as a local process talking over loopback, which is the
+        same code that would run across hosts.
+    */
+    static void DistributedReduction()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        auto results = RunLoopback<long long>(4, [](Endpoint& endpoint)
+        {
+            // Each rank owns its own shard of the data
+            std::vector<long long> shard(1'000'000);
+            std::iota(std::begin(shard), std::end(shard), static_cast<long long>(endpoint.rank * shard.size()));
+
+            return DistributedReduce(std::move(endpoint), std::begin(shard), std::end(shard), 0LL, std::plus<>());
+        });
+
+        for (const auto& result : results)
+            std::cout << "Rank result: " << (result ? std::to_string(*result) : "failed") << "\n";
+#endif
+    }
+
+    /*
+        A partial reduction is just a monoid value, so it can be saved and combined with
+        the rest later. Here two halves of a word count are reduced separately, encoded
+        as they would be on disk, then decoded and merged.
+    */
+    static void SerializingPartials()
+    {
+        using WordCounts = std::unordered_map<std::string, unsigned>;
+
+        auto combine = [](WordCounts counts, const WordCounts& other)
+        {
+            for (const auto& [word, count] : other)
+                counts[word] += count;
+
+            return counts;
+        };
+
+        auto count = [](WordCounts counts, const std::string& word)
+        {
+            ++counts[word];
+            return counts;
+        };
+
+        const std::vector<std::string> firstHalf{ "fold", "reduce", "fold", "monoid" };
+        const std::vector<std::string> secondHalf{ "monoid", "fold", "identity" };
+
+        // The counts are bit-packed and the words are length prefixed
+        const auto firstEncoded = Encode(LeftFold(firstHalf, WordCounts{}, count));
+        const auto secondEncoded = Encode(LeftFold(secondHalf, WordCounts{}, count));
+        std::cout << "Encoded partials: " << firstEncoded.size() << " and " << secondEncoded.size() << " bytes\n";
+
+        const auto merged = combine(Decode<WordCounts>(firstEncoded), Decode<WordCounts>(secondEncoded));
+        std::cout << "fold: " << merged.at("fold") << ", monoid: " << merged.at("monoid") << "\n";
+
+        // Arrays of plain values can be used right where they sit in the buffer
+        const std::vector<double> histogram{ 0.5, 1.5, 2.5, 3.5 };
+        const auto encodedHistogram = Encode(histogram);
+        const auto view = Decode<ArrayView<double>>(encodedHistogram);
+        std::cout << "Histogram total, read in place: " << std::accumulate(std::begin(view), std::end(view), 0.0) << "\n";
+    }
+
+    /*
+        Grouping by key keeps one monoid per distinct key, and with enough distinct keys
+        that stops fitting in memory. Since the values for a key can be combined in pieces,
+        parts of the table can be written out and combined back in one partition at a time.
+    */
+    static void SpillingAggregation()
+    {
+        // Pretend only 10'000 entries fit in memory
+        auto visitsPerUser = MakeSpillingAggregator<int, long long>(std::plus<long long>{}, 10'000);
+
+        for (auto i = 0; i < 1'000'000; ++i)
+            visitsPerUser.Add((i * 31) % 100'000, 1);
+
+        std::cout << "Spilled " << visitsPerUser.Spills() << " times\n";
+
+        long long users = 0;
+        long long visits = 0;
+        visitsPerUser.Drain([&](const int, const long long count)
+        {
+            ++users;
+            visits += count;
+        });
+
+        std::cout << "Users: " << users << ", visits: " << visits << "\n";
+    }
+
+    /*
+        Associativity means a reduction can stop anywhere and carry on later, as long as the
+        partial result and the position are remembered. Here the first attempt "crashes"
+        partway through, and the second one resumes from the last checkpoint.
+    */
+    static void ResumingAfterACrash()
+    {
+        std::vector<double> values(10'000'000, 1.0);
+
+        CheckpointOptions options{};
+        options.path = std::filesystem::temp_directory_path() / "functionalcpp_checkpoint.bin";
+        options.chunkSize = 100'000;
+
+        // A generous budget, so that a run this short still gets a few checkpoints
+        options.maximumOverhead = 0.25;
+        options.onCheckpoint = [](std::size_t done, std::size_t total)
+        {
+            std::cout << "Checkpoint at chunk " << done << " of " << total << "\n";
+        };
+
+        auto chunksReduced = 0;
+        auto crashingReducer = [&](auto first, auto last)
+        {
+            if (++chunksReduced == 60)
+                throw std::runtime_error{ "Preempted" };
+
+            return std::accumulate(first, last, 0.0);
+        };
+
+        try
+        {
+            ResumableReduce(std::begin(values), std::end(values), 0.0, std::plus<>(), crashingReducer, options);
+        }
+        catch (const std::runtime_error& error)
+        {
+            std::cout << error.what() << " after " << chunksReduced << " chunks\n";
+        }
+
+        chunksReduced = 0;
+        auto reducer = [&](auto first, auto last)
+        {
+            ++chunksReduced;
+            return std::accumulate(first, last, 0.0);
+        };
+
+        options.onCheckpoint = nullptr;
+        const auto sum = ResumableReduce(std::begin(values), std::end(values), 0.0, std::plus<>(), reducer, options);
+        std::cout << "Sum: " << sum << ", with only " << chunksReduced << " chunks reduced after resuming\n";
+    }
+
+    /*
+        MapReduce computes one aggregate per pass. Asking for a count, a sum and a maximum
+        would be three passes, but a tuple of monoids is itself a monoid, so all three can
+        be folded together in one pass over the data.
+    */
+    static void FusedFolds()
+    {
+        struct NonMonoid
+        {
+            std::string name;
+            int age;
+        };
+
+        std::vector<NonMonoid> vecNonMonoids
+        {
+            {"Sam", 25},
+            {"Jaina", 107},
+            {"Michelle", 23},
+            {"Bob", 15},
+            {"Lacy", 11},
+            {"Margret", 22},
+            {"Dave", 24},
+            {"Louis", 31},
+        };
+
+        auto [between15And30, totalAge, oldest] = Fused::Fold(vecNonMonoids,
+            Fused::CountIf([](const auto& value) { return value.age < 30 && value.age >= 15; }),
+            Fused::Sum(&NonMonoid::age),
+            Fused::Max(&NonMonoid::age));
+
+        std::cout << "Between 15 and 30: " << between15And30 << ", total age: " << totalAge << ", oldest: " << oldest << "\n";
+
+        // The same single pass, split across threads
+        std::vector<double> values(1'000'000, 2.0);
+        auto [count, sum, largest] = Fused::ParallelFold(values, Fused::Count(), Fused::Sum(), Fused::Max());
+        std::cout << "Count: " << count << ", sum: " << sum << ", max: " << largest << "\n";
+    }
+
+    /*
+        FunctionComposition and friends, except everything is known up front, so the
+        compiler does the folding and the results end up in the binary as constants.
+        The static_asserts prove that none of it is left for run time.
+    */
+    static void CompileTimeFolds()
+    {
+        // The same transformations as FunctionComposition, composed at compile time
+        constexpr auto BigTransformation = Compose(
+            [](const int item) { return 2 * item; },
+            [](const int item) { return item + 4; },
+            [](const int item) { return item / 6; },
+            [](const int item) { return item - 7; });
+
+        static_assert(BigTransformation(25) == 2);
+
+        // A lookup table of the transformation, for inputs that are only known at run time
+        constexpr auto table = MakeTable<64>([BigTransformation](const std::size_t i) { return BigTransformation(static_cast<int>(i)); });
+        static_assert(table[25] == BigTransformation(25));
+
+        // Aggregating some configuration with the standard monoids
+        constexpr std::array<int, 5> timeouts{ 250, 1000, 50, 400, 125 };
+
+        constexpr auto totalTimeout = LeftFold(timeouts, 0, Sum<int>{});
+        constexpr auto longestTimeout = ConstexprFold(timeouts, Max<int>{});
+        static_assert(totalTimeout == 1825 && longestTimeout == 1000);
+
+        // Parameter packs fold too, with any combine
+        constexpr auto digits = LeftFoldPack(0, [](const int number, const int digit) { return number * 10 + digit; }, 1, 8, 2, 5);
+        static_assert(digits == 1825);
+
+        std::cout << "Composed: " << BigTransformation(25) << ", table[40]: " << table[40]
+            << ", total timeout: " << totalTimeout << ", longest: " << longestTimeout << "\n";
+    }
+
+    /*
+        Reduce has to find the middle of its range. A stream can only be read once, front
+        to back, but it can still be reduced in parallel, a batch at a time as it's read.
+    */
+    static void BatchedReduction()
+    {
+        std::ostringstream text{};
+        for (auto i = 1; i <= 100'000; ++i)
+            text << i << ' ';
+
+        // Sums don't care which batch finishes first
+        std::istringstream numbers{ text.str() };
+        BatchedReduceOptions anyOrder{};
+        anyOrder.commutative = true;
+
+        const auto sum = BatchedReduce(std::istream_iterator<long long>{ numbers }, std::istream_iterator<long long>{},
+            0LL, std::plus<>(), anyOrder);
+
+        // Joining words does, so these are combined in the order they were read
+        std::istringstream words{ "batches are combined in the order that they were read" };
+        BatchedReduceOptions inOrder{};
+        inOrder.batchSize = 2;
+
+        const auto sentence = BatchedReduce(std::istream_iterator<std::string>{ words }, std::istream_iterator<std::string>{},
+            std::string{}, [](const std::string& lhs, const std::string& rhs)
+            {
+                return lhs.empty() || rhs.empty() ? lhs + rhs : lhs + " " + rhs;
+            }, inOrder);
+
+        std::cout << "Sum of the stream: " << sum << "\n" << sentence << "\n";
+    }
+
+    /*
+        MapReduce again, except the data comes from a stream, and reading, parsing,
+        mapping and reducing all happen at once, each on its own threads.
+    */
+    static void PipelinedMapReduce()
+    {
+        std::ostringstream text{};
+        const std::vector<std::string> names{ "Sam", "Jaina", "Michelle", "Bob", "Lacy", "Margret", "Dave", "Louis" };
+
+        for (auto i = 0; i < 100'000; ++i)
+            text << names[i % names.size()] << ":" << (i * 7) % 90 << "\n";
+
+        std::istringstream lines{ text.str() };
+        Pipelines::PipelineOptions options{};
+        options.batchSize = 512;
+
+        // Parsing is the expensive part here, so it gets the most threads
+        const auto entriesBetween15And30 = Pipelines::From(std::istream_iterator<std::string>{ lines }, std::istream_iterator<std::string>{}, options)
+            .Map([](const std::string& line) { return std::stoi(line.substr(line.find(':') + 1)); }, 3)
+            .Filter([](const int age) { return age < 30 && age >= 15; })
+            .Map([](const int) { return 1; })
+            .Reduce(0, std::plus<>());
+
+        std::cout << "Entries between 15 and 30, pipelined: " << entriesBetween15And30 << "\n";
+    }
+
+    /*
+        The reduction engines hand batches between threads through queues, so the queue
+        is on the hot path whenever the batches are small. Four producers and four
+        consumers pass a million items through a queue that takes a lock, the lock-free
+        one, and the lock-free one 32 items at a time.
+    */
+    static void QueueContention()
+    {
+        constexpr auto producers = 4;
+        constexpr auto consumers = 4;
+        constexpr auto itemsPerProducer = 250'000;
+        constexpr auto batch = 32;
+
+        auto measure = [](const char* name, auto produce, auto consume, auto close)
+        {
+            Timer timer{};
+            std::atomic<long long> total{ 0 };
+            std::vector<std::thread> producing{}, consuming{};
+
+            timer.Start();
+            for (auto i = 0; i < producers; ++i)
+                producing.emplace_back(produce);
+
+            for (auto i = 0; i < consumers; ++i)
+                consuming.emplace_back([&] { total += consume(); });
+
+            for (auto& thread : producing)
+                thread.join();
+
+            close();
+            for (auto& thread : consuming)
+                thread.join();
+
+            std::cout << name << ": " << timer.GetElapsed() << "ms, sum " << total << "\n";
+        };
+
+        BoundedQueue<int> locked{ 1024 };
+        measure("Locked queue",
+            [&] { for (auto i = 0; i < itemsPerProducer; ++i) locked.Push(i); },
+            [&] { long long sum = 0; for (int item{}; locked.Pop(item);) sum += item; return sum; },
+            [&] { locked.Close(); });
+
+        MpmcQueue<int> lockFree{ 1024 };
+        measure("Lock-free queue",
+            [&] { for (auto i = 0; i < itemsPerProducer; ++i) lockFree.Push(i); },
+            [&] { long long sum = 0; for (int item{}; lockFree.Pop(item);) sum += item; return sum; },
+            [&] { lockFree.Close(); });
+
+        MpmcQueue<int> batched{ 1024 };
+        measure("Lock-free queue, in batches",
+            [&]
+            {
+                std::array<int, batch> items{};
+                for (auto i = 0; i < itemsPerProducer; i += batch)
+                {
+                    const auto count = std::min<std::size_t>(batch, itemsPerProducer - i);
+                    std::iota(std::begin(items), std::begin(items) + count, i);
+
+                    // Whatever doesn't fit waits for room one item at a time
+                    for (auto pushed = batched.TryPushBatch(std::begin(items), count); pushed < count; ++pushed)
+                        batched.Push(items[pushed]);
+                }
+            },
+            [&]
+            {
+                long long sum = 0;
+                std::array<int, batch> items{};
+
+                // Wait for one item, then take whatever else is there with it
+                while (batched.Pop(items[0]))
+                {
+                    const auto count = 1 + batched.TryPopBatch(std::begin(items) + 1, batch - 1);
+                    sum = std::accumulate(std::begin(items), std::begin(items) + count, sum);
+                }
+
+                return sum;
+            },
+            [&] { batched.Close(); });
+    }
+
+    /*
+        A monoid over strings allocates a new string for every combine, on every thread at
+        once, and the threads end up waiting on the allocator. With the temporaries in
+        per-thread arenas they don't share an allocator, and everything is released in one
+        go at the end. (The names are long enough that they don't fit inline in a string.)
+    */
+    static void ArenaReduction()
+    {
+        std::vector<std::string> names{};
+        for (auto i = 0; i < 1'000'000; ++i)
+            names.push_back("functionalcpp-user-" + std::to_string((i * 7919LL) % 1'000'003));
+
+        auto later = [](std::string_view lhs, std::string_view rhs) { return lhs < rhs ? rhs : lhs; };
+        Timer timer{};
+
+        timer.Start();
+        const auto last = Reduce(std::begin(names), std::end(names), std::string{},
+            [&later](const auto& lhs, const auto& rhs) { return std::string{ later(lhs, rhs) }; });
+        const auto heapTime = timer.GetElapsed();
+
+        ReductionArena arena{};
+        timer.Start();
+        const auto lastInArena = Reduce(std::begin(names), std::end(names), std::pmr::string{},
+            [&later, &arena](const auto& lhs, const auto& rhs) { return std::pmr::string{ later(lhs, rhs), arena.Resource() }; });
+
+        std::cout << "Last name: " << last << " in " << heapTime << "ms on the heap, " << lastInArena << " in "
+            << timer.GetElapsed() << "ms in " << arena.Arenas() << " arenas\n";
+    }
+
+    /*
+        Sorted runs are a monoid under merging, so sorting is a reduction too
+    */
+    static void SortedMerging()
+    {
+        std::vector<std::vector<int>> runs(64);
+        for (auto i = 0; i < 4'000'000; ++i)
+            runs[i % runs.size()].push_back(static_cast<int>((i * 7919LL) % 1'000'003));
+
+        for (auto& run : runs)
+            std::sort(std::begin(run), std::end(run));
+
+        Timer timer{};
+
+        timer.Start();
+        const auto reduced = Reduce(std::begin(runs), std::end(runs), std::vector<int>{}, SortedRuns<int>{});
+        const auto reduceTime = timer.GetElapsed();
+
+        timer.Start();
+        const auto merged = MergeRuns(runs);
+        const auto mergeTime = timer.GetElapsed();
+
+        std::vector<int> values{};
+        for (const auto& run : runs)
+            values.insert(std::end(values), std::begin(run), std::end(run));
+
+        timer.Start();
+        const auto sorted = ParallelMergeSort(std::begin(values), std::end(values));
+
+        std::cout << "Merged " << runs.size() << " runs pairwise in " << reduceTime << "ms, all at once in " << mergeTime
+            << "ms, and sorted them in " << timer.GetElapsed() << "ms ("
+            << (reduced == merged && merged == sorted ? "all equal" : "mismatch") << ")\n";
+    }
+
+    /*
+        Collecting the distinct keys of a range is a fold into a set under union. The set
+        it folds into decides how fast that is. A flat set keeps itself sorted, so it takes
+        the keys as one range instead of one at a time.
+    */
+    static void DistinctKeys()
+    {
+        std::vector<std::size_t> keys{};
+        for (auto i = 0; i < 4'000'000; ++i)
+            keys.push_back(static_cast<std::size_t>((i * 7919LL) % 1'000'003 / 4));
+
+        Timer timer{};
+
+        timer.Start();
+        const auto tree = LeftFold(keys, std::set<std::size_t>{}, [](auto set, std::size_t key) { set.insert(key); return set; });
+        const auto treeTime = timer.GetElapsed();
+
+        timer.Start();
+        FlatSet<std::size_t> flat{};
+        flat.Insert(std::begin(keys), std::end(keys));
+        const auto flatTime = timer.GetElapsed();
+
+        timer.Start();
+        const auto hashed = Reduce(std::begin(keys), std::end(keys), HashSet<std::size_t>{}, Union<HashSet<std::size_t>>{});
+        const auto hashTime = timer.GetElapsed();
+
+        timer.Start();
+        const auto bits = Reduce(std::begin(keys), std::end(keys), DenseBitSet{}, Union<DenseBitSet>{});
+
+        std::cout << "Distinct keys: " << tree.size() << " in a std::set in " << treeTime << "ms, " << flat.Size() << " in a flat set in "
+            << flatTime << "ms, " << hashed.Size() << " in hash sets in " << hashTime << "ms, " << bits.Size() << " in bit sets in "
+            << timer.GetElapsed() << "ms\n";
+    }
+
+    /*
+        The users that matched two queries, out of hundreds of millions of ids. Each query
+        matches a few long blocks of users, and a scattering of others.
+    */
+    static void MatchedUserIds()
+    {
+        auto matches = [](std::uint32_t seed)
+        {
+            std::vector<std::uint32_t> ids{};
+            for (std::uint32_t block = 0; block < 16; ++block)
+            {
+                const auto first = (block * 2'654'435'761u + seed) % 300'000'000u;
+                for (std::uint32_t id = first; id < first + 100'000; ++id)
+                    ids.push_back(id);
+            }
+
+            auto state = seed;
+            for (auto i = 0; i < 1'000'000; ++i)
+            {
+                state = state * 1'664'525u + 1'013'904'223u;
+                ids.push_back(state % 300'000'000u);
+            }
+
+            return ids;
+        };
+
+        const auto first = matches(1);
+        const auto second = matches(7);
+
+        Timer timer{};
+        timer.Start();
+
+        auto matchedFirst = Reduce(std::begin(first), std::end(first), RoaringBitmap{}, Union<RoaringBitmap>{});
+        auto matchedSecond = Reduce(std::begin(second), std::end(second), RoaringBitmap{}, Union<RoaringBitmap>{});
+        matchedFirst.RunOptimize();
+        matchedSecond.RunOptimize();
+
+        auto matchedBoth = matchedFirst;
+        matchedBoth.IntersectWith(matchedSecond);
+
+        std::cout << "Matched users: " << matchedFirst.Size() << " and " << matchedSecond.Size() << " in "
+            << matchedFirst.SizeInBytes() + matchedSecond.SizeInBytes() << " bytes, " << matchedBoth.Size() << " matched both, in "
+            << timer.GetElapsed() << "ms\n";
+    }
+
+    /*
+        FunctionComposition for linear maps. Two matrices compose into one matrix, so a
+        long chain of them can be collapsed in parallel.
+    */
+    static void LinearMaps()
+    {
+        // A million small turns about the z axis, each followed by a step along x
+        std::vector<Matrix<double, 4>> transforms{};
+        for (auto i = 0; i < 1'000'000; ++i)
+        {
+            const auto angle = 1e-6 * (i % 7);
+            auto transform = Matrix<double, 4>::Identity();
+
+            transform(0, 0) = std::cos(angle);
+            transform(0, 1) = -std::sin(angle);
+            transform(1, 0) = std::sin(angle);
+            transform(1, 1) = std::cos(angle);
+            transform(0, 3) = 1e-6;
+            transforms.push_back(transform);
+        }
+
+        Timer timer{};
+
+        timer.Start();
+        const auto sequential = LeftFold(transforms, Matrix<double, 4>::Identity(), LinearComposition<Matrix<double, 4>>{});
+        const auto sequentialTime = timer.GetElapsed();
+
+        timer.Start();
+        const auto reduced = Reduce(std::begin(transforms), std::end(transforms), Matrix<double, 4>::Identity(), LinearComposition<Matrix<double, 4>>{});
+
+        std::cout << "Composed transform moves the origin to (" << sequential(0, 3) << ", " << sequential(1, 3) << ") in "
+            << sequentialTime << "ms, (" << reduced(0, 3) << ", " << reduced(1, 3) << ") in " << timer.GetElapsed() << "ms reduced\n";
+
+        // A random walk on a ring of 64 states, which steps forward more often than back.
+        // Its 1024 step transition matrix is the product of 1024 one step matrices.
+        DynamicMatrix<double> step{ 64, 64 };
+        for (std::size_t state = 0; state < 64; ++state)
+        {
+            step(state, state) = 0.5;
+            step(state, (state + 1) % 64) = 0.3;
+            step(state, (state + 63) % 64) = 0.2;
+        }
+
+        const std::vector<DynamicMatrix<double>> steps(1024, step);
+
+        timer.Start();
+        const auto walk = Reduce(std::begin(steps), std::end(steps), DynamicMatrix<double>::Identity(), MatrixProduct<DynamicMatrix<double>>{});
+
+        std::cout << "After 1024 steps, a walk from state 0 is back in it with probability " << walk(0, 0) << ", in "
+            << timer.GetElapsed() << "ms\n";
+    }
+
     /*
         This is an experiment at parallelizing the reduction process, since monoids
         are trivially parallelizable. The point is to show that we can reduce, not left or right fold,
@@ -300,12 +1019,28 @@ private:
     {
         Timer timer{};
 
+        // The leaves of Reduce run on vector kernels picked for this CPU at startup
+        std::cout << "Fold kernels: " << ToString(SelectedIsa()) << "\n";
+
         std::vector<double> values{};
         values.reserve(10'000'000);
 
         for (auto i = 0; i < values.capacity(); ++i)
             values.emplace_back(1.0);
 
+        // Tune Reduce for this machine the first time through. The winner goes into the
+        // profile, and every later run (and the Reduce calls below) just load it.
+        const auto key = Tuning::KeyFor<std::plus<>, double>(values.size());
+        if (!Tuning::Profile::Current().Find(key))
+            Tuning::TuneReduce(std::plus<>(), 0.0, values.size(), 1.0);
+
+        const auto configuration = Tuning::ConfigurationFor<std::plus<>, double>(values.size());
+        std::cout << "Reducing with " << configuration.threads << " threads, a grain of " << configuration.grain
+            << ", " << ToString(configuration.kernel.isa) << " kernels, prefetching "
+            << configuration.kernel.streaming.prefetchBytes << " bytes ahead"
+            << (configuration.kernel.streaming.nonTemporal ? " (non-temporal)" : "")
+            << ", pinned " << ToString(configuration.placement) << "\n";
+
         std::ofstream logger{ "D:\\execution_times.csv", std::ios::out };
         logger << "Iteration,Custom Reduce,C++17 Reduce,Sequential Reduce\n";
 
@@ -0,0 +1,26 @@
+#include "mpmc_queue.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+
+namespace Monoids
+{
+namespace Detail
+{
+    void WaitOnWord(std::atomic<std::uint32_t>& word, std::uint32_t expected)
+    {
+        WaitOnAddress(&word, &expected, sizeof(expected), INFINITE);
+    }
+
+    void WakeAllOnWord(std::atomic<std::uint32_t>& word)
+    {
+        WakeByAddressAll(&word);
+    }
+}
+}
+
+#endif
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "cpu_dispatch.h"
+
+namespace Monoids
+{
+namespace Detail
+{
+    static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "Futexes need a plain 32 bit word");
+
+#if defined(_WIN32)
+    // WaitOnAddress and WakeByAddressAll, in mpmc_queue.cpp, so that windows.h and its
+    // macros stay out of every header that includes this one
+    void WaitOnWord(std::atomic<std::uint32_t>& word, std::uint32_t expected);
+    void WakeAllOnWord(std::atomic<std::uint32_t>& word);
+#endif
+
+    /*
+        Sleeps while word still holds expected. It can wake up for no reason, so callers
+        check their condition again afterwards. Linux has futexes and Windows has
+        WaitOnAddress for this; anywhere else it naps briefly instead.
+    */
+    inline void WaitWhileEqual(std::atomic<std::uint32_t>& word, std::uint32_t expected)
+    {
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+        WaitOnWord(word, expected);
+#else
+        if (word.load(std::memory_order_acquire) == expected)
+            std::this_thread::sleep_for(std::chrono::microseconds{ 50 });
+#endif
+    }
+
+    inline void WakeAll(std::atomic<std::uint32_t>& word)
+    {
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+        WakeAllOnWord(word);
+#else
+        (void)word;
+#endif
+    }
+
+    /*
+        Something to sleep on until an event. A sleeper reads the epoch, announces itself,
+        checks its condition one last time, and sleeps until the epoch moves. Signalling
+        only costs a system call when someone is actually asleep.
+    */
+    class alignas(CacheLineSize) Event
+    {
+    public:
+
+        std::uint32_t Prepare()
+        {
+            const auto seen = epoch.load(std::memory_order_acquire);
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return seen;
+        }
+
+        void Wait(std::uint32_t seen)
+        {
+            WaitWhileEqual(epoch, seen);
+        }
+
+        void Cancel()
+        {
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        /*
+            The fence pairs with the one in Prepare: either the sleeper's last check sees
+            what happened before this, or this sees the sleeper.
+        */
+        void Signal()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_relaxed) == 0)
+                return;
+
+            epoch.fetch_add(1, std::memory_order_release);
+            WakeAll(epoch);
+        }
+
+    private:
+
+        std::atomic<std::uint32_t> epoch{ 0 };
+        std::atomic<std::uint32_t> waiters{ 0 };
+    };
+}
+
+/*
+    A bounded multi-producer, multi-consumer queue that never takes a lock (Dmitry Vyukov's
+    ring). Every cell carries a sequence number that says whose turn it is: a producer
+    claims a position by moving the tail forward with one CAS, fills the cell, and then
+    bumps its sequence to hand it to the consumer of that position. Producers only
+    contend on the tail and consumers only on the head, which sit on separate cache lines
+    so the two sides don't invalidate each other's line on every operation.
+
+    The batch operations claim several consecutive cells with a single CAS, so handing
+    over a batch of k items costs one contended operation instead of k.
+
+    Push and Pop spin briefly, then sleep on a futex (WaitOnAddress on Windows) until the
+    other side makes progress, so idle workers cost nothing. Close wakes everyone: Push
+    then fails, and Pop fails once the queue is empty. Close is meant to be called after
+    the last Push has returned.
+
+    The capacity is rounded up to a power of two, so positions map to cells with a mask.
+*/
+template<typename T>
+class MpmcQueue
+{
+public:
+
+    explicit MpmcQueue(std::size_t capacity)
+        : mask(RoundUp(capacity) - 1), cells(std::make_unique<Cell[]>(mask + 1))
+    {
+        for (std::size_t i = 0; i <= mask; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    ~MpmcQueue()
+    {
+        const auto last = tail.load(std::memory_order_relaxed);
+        for (auto position = head.load(std::memory_order_relaxed); position != last; ++position)
+            std::launder(reinterpret_cast<T*>(cells[position & mask].Storage()))->~T();
+    }
+
+    std::size_t Capacity() const
+    {
+        return mask + 1;
+    }
+
+    bool TryPush(T item)
+    {
+        return TryPushBatch(&item, 1) == 1;
+    }
+
+    bool TryPop(T& item)
+    {
+        return TryPopBatch(&item, 1) == 1;
+    }
+
+    /*
+        Pushes as many of the count items at first as there's room for, all or nothing
+        per claimed run, and returns how many that was. The items are moved from.
+    */
+    template<typename Iterator>
+    std::size_t TryPushBatch(Iterator first, std::size_t count)
+    {
+        const auto claimed = Claim(tail, count, 0);
+        if (claimed.count == 0)
+            return 0;
+
+        for (std::size_t i = 0; i < claimed.count; ++i, ++first)
+        {
+            auto& cell = cells[(claimed.position + i) & mask];
+            new (cell.Storage()) T(std::move(*first));
+            cell.sequence.store(claimed.position + i + 1, std::memory_order_release);
+        }
+
+        itemsAvailable.Signal();
+        return claimed.count;
+    }
+
+    /*
+        Pops up to count items into out, and returns how many there were
+    */
+    template<typename Iterator>
+    std::size_t TryPopBatch(Iterator out, std::size_t count)
+    {
+        const auto claimed = Claim(head, count, 1);
+        if (claimed.count == 0)
+            return 0;
+
+        for (std::size_t i = 0; i < claimed.count; ++i, ++out)
+        {
+            auto& cell = cells[(claimed.position + i) & mask];
+            auto& item = *std::launder(reinterpret_cast<T*>(cell.Storage()));
+
+            *out = std::move(item);
+            item.~T();
+            cell.sequence.store(claimed.position + i + mask + 1, std::memory_order_release);
+        }
+
+        spaceAvailable.Signal();
+        return claimed.count;
+    }
+
+    /*
+        Waits for room. false if the queue was closed, in which case item wasn't added.
+    */
+    bool Push(T item)
+    {
+        // Moved from only once there's a cell for it
+        return Block(spaceAvailable, [this, &item] { return TryPushBatch(&item, 1) == 1; });
+    }
+
+    /*
+        Waits for an item. false once the queue is closed and empty.
+    */
+    bool Pop(T& item)
+    {
+        return Block(itemsAvailable, [this, &item] { return TryPop(item); });
+    }
+
+    void Close()
+    {
+        closed.store(true, std::memory_order_seq_cst);
+        itemsAvailable.Signal();
+        spaceAvailable.Signal();
+    }
+
+private:
+
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence{};
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        void* Storage()
+        {
+            return storage;
+        }
+    };
+
+    struct Claimed
+    {
+        std::size_t position;
+        std::size_t count;
+    };
+
+    static std::size_t RoundUp(std::size_t capacity)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+
+        return size;
+    }
+
+    /*
+        Claims up to count consecutive cells starting at position. A cell is ready when
+        its sequence is position + lag: 0 for producers (the cell is empty for this lap),
+        1 for consumers (it was filled on this lap). The cells after the first can't
+        change state while position is unchanged, since that takes claiming them first,
+        so checking them before the CAS is enough.
+    */
+    Claimed Claim(std::atomic<std::size_t>& cursor, std::size_t count, std::size_t lag)
+    {
+        auto position = cursor.load(std::memory_order_relaxed);
+
+        while (count != 0)
+        {
+            std::size_t ready = 0;
+            while (ready < count && cells[(position + ready) & mask].sequence.load(std::memory_order_acquire) == position + ready + lag)
+                ++ready;
+
+            if (ready == 0)
+            {
+                const auto sequence = cells[position & mask].sequence.load(std::memory_order_acquire);
+
+                // Behind by a lap: full for producers, empty for consumers
+                if (static_cast<std::ptrdiff_t>(sequence - (position + lag)) < 0)
+                    return { position, 0 };
+
+                // Someone else claimed it first
+                position = cursor.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (cursor.compare_exchange_weak(position, position + ready, std::memory_order_relaxed))
+                return { position, ready };
+        }
+
+        return { position, 0 };
+    }
+
+    template<typename Attempt>
+    bool Block(Detail::Event& event, Attempt attempt)
+    {
+        for (auto spin = 0; spin < 64; ++spin)
+        {
+            if (closed.load(std::memory_order_acquire))
+                return &event == &itemsAvailable && attempt();
+
+            if (attempt())
+                return true;
+        }
+
+        for (;;)
+        {
+            const auto seen = event.Prepare();
+            const auto wasClosed = closed.load(std::memory_order_seq_cst);
+
+            // Pushing into a closed queue fails, but popping drains what's left
+            if (wasClosed && &event == &spaceAvailable)
+            {
+                event.Cancel();
+                return false;
+            }
+
+            if (attempt())
+            {
+                event.Cancel();
+                return true;
+            }
+
+            if (wasClosed)
+            {
+                event.Cancel();
+                return false;
+            }
+
+            event.Wait(seen);
+            event.Cancel();
+        }
+    }
+
+private:
+
+    std::size_t mask{};
+    std::unique_ptr<Cell[]> cells{};
+
+    // Producers and consumers each get a cache line to fight over
+    alignas(CacheLineSize) std::atomic<std::size_t> tail{ 0 };
+    alignas(CacheLineSize) std::atomic<std::size_t> head{ 0 };
+    alignas(CacheLineSize) std::atomic<bool> closed{ false };
+
+    Detail::Event itemsAvailable{};
+    Detail::Event spaceAvailable{};
+};
+
+}
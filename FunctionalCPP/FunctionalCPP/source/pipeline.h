@@ -0,0 +1,438 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "fold_kernels.h"
+#include "mpmc_queue.h"
+
+namespace Monoids
+{
+/*
+    MapReduce maps everything and then reduces everything, one stage after the other. When
+    the stages are expensive, or the source is slow (a file, a socket), that leaves most
+    of the machine idle most of the time: while the data is read nothing is mapped, and
+    while it's mapped nothing is read.
+
+    A pipeline runs every stage at once, each on its own threads, and connects them with
+    bounded queues of batches:
+
+        auto adults = Pipelines::From(std::istream_iterator<Person>{ file }, {})
+            .Map(ParseAge, 4)
+            .Filter([](int age) { return age >= 18; })
+            .Reduce(0, std::plus<>());
+
+    Items move between stages a batch at a time, so the queues are only touched once per
+    batch. The queues hold a few batches each, so a stage that gets ahead of the next one
+    blocks until there's room again, which is the back-pressure that keeps memory bounded
+    no matter how fast the source is. Every stage has its own worker count, so a slow map
+    can get more threads than a cheap filter.
+
+    Batches keep the sequence number they were read with, so the reduction combines them
+    in the order of the source even when they're mapped out of order, and combine only
+    has to be associative. A batch that's reduced before the ones ahead of it has to
+    wait for them, so the source doesn't read a batch until the oldest one that isn't
+    reduced yet is less than a window behind it. That way one slow batch stalls the
+    source instead of piling up everything read after it.
+
+    Nothing runs until Reduce is called, which starts every stage, waits for the source to
+    run dry and the last batch to be reduced, and returns the result. An exception in any
+    stage stops all of them and is rethrown from Reduce.
+*/
+namespace Pipelines
+{
+    struct PipelineOptions
+    {
+        // Items handed from one stage to the next at a time
+        std::size_t batchSize = 1024;
+
+        // Batches that can wait between two stages before the earlier one has to stop
+        std::size_t queueCapacity = 4;
+    };
+
+    namespace Detail
+    {
+        template<typename T>
+        struct Batch
+        {
+            std::uint64_t sequence{};
+            std::vector<T> items{};
+        };
+
+        template<typename T>
+        using Channel = MpmcQueue<Batch<T>>;
+
+        /*
+            How far the source may get ahead of the reduction, in sequence numbers. The
+            source waits in Acquire until its next sequence number is inside the window,
+            and the reduction moves the window along as it combines batches. Closing it
+            releases the source, for when the pipeline fails.
+        */
+        class SequenceWindow
+        {
+        public:
+
+            void Resize(std::uint64_t batches)
+            {
+                {
+                    std::lock_guard<std::mutex> lock{ mutex };
+                    size = std::max<std::uint64_t>(1, batches);
+                }
+
+                condition.notify_all();
+            }
+
+            /*
+                False if the window was closed while waiting
+            */
+            bool Acquire(std::uint64_t sequence)
+            {
+                std::unique_lock<std::mutex> lock{ mutex };
+                condition.wait(lock, [this, sequence] { return closed || sequence < oldest + size; });
+                return !closed;
+            }
+
+            /*
+                Every batch before oldest has been reduced
+            */
+            void Advance(std::uint64_t oldest)
+            {
+                {
+                    std::lock_guard<std::mutex> lock{ mutex };
+                    this->oldest = oldest;
+                }
+
+                condition.notify_all();
+            }
+
+            void Close()
+            {
+                {
+                    std::lock_guard<std::mutex> lock{ mutex };
+                    closed = true;
+                }
+
+                condition.notify_all();
+            }
+
+        private:
+
+            std::mutex mutex{};
+            std::condition_variable condition{};
+            std::uint64_t oldest{};
+            std::uint64_t size = ~std::uint64_t{ 0 } / 2;
+            bool closed{};
+        };
+
+        /*
+            Everything a pipeline needs to run: the stages, in order, and the queues
+            between them, so they can all be closed when something goes wrong.
+        */
+        class Runtime
+        {
+        public:
+
+            explicit Runtime(const PipelineOptions& options)
+                : options(options)
+            {
+            }
+
+            const PipelineOptions& Options() const
+            {
+                return options;
+            }
+
+            SequenceWindow& Window()
+            {
+                return window;
+            }
+
+            template<typename T>
+            std::shared_ptr<Channel<T>> MakeChannel()
+            {
+                auto channel = std::make_shared<Channel<T>>(options.queueCapacity);
+                closers.push_back([channel] { channel->Close(); });
+                return channel;
+            }
+
+            /*
+                work runs on workers threads. finish runs once, after the last of them is
+                done, and is where a stage tells the next one that nothing more is coming.
+            */
+            void AddStage(unsigned workers, std::function<void()> work, std::function<void()> finish)
+            {
+                if (ran)
+                    throw std::logic_error{ "A pipeline can only be run once" };
+
+                stages.push_back({ std::max(1u, workers), std::move(work), std::move(finish) });
+            }
+
+            /*
+                Runs every stage to the end. The stages are dropped afterwards, since the
+                source has been used up and the reduction's state was on its caller's
+                stack, so a pipeline only runs once.
+            */
+            void Run()
+            {
+                if (ran)
+                    throw std::logic_error{ "A pipeline can only be run once" };
+
+                ran = true;
+
+                // Twice what the queues and the stages' workers can hold between them, so
+                // batches that are merely out of order never hold the source up
+                std::uint64_t inFlight = closers.size() * std::max<std::size_t>(1, options.queueCapacity);
+                for (const auto& stage : stages)
+                    inFlight += stage.workers;
+
+                window.Resize(2 * inFlight);
+
+                std::vector<std::atomic<unsigned>> remaining(stages.size());
+                std::vector<std::thread> threads{};
+
+                for (std::size_t i = 0; i < stages.size(); ++i)
+                {
+                    remaining[i].store(stages[i].workers);
+
+                    for (auto j = 0u; j < stages[i].workers; ++j)
+                    {
+                        threads.emplace_back([this, &remaining, i]
+                        {
+                            try
+                            {
+                                stages[i].work();
+                            }
+                            catch (...)
+                            {
+                                Fail();
+                            }
+
+                            if (remaining[i].fetch_sub(1) == 1)
+                                stages[i].finish();
+                        });
+                    }
+                }
+
+                for (auto& thread : threads)
+                    thread.join();
+
+                stages.clear();
+                closers.clear();
+
+                if (error)
+                    std::rethrow_exception(error);
+            }
+
+        private:
+
+            struct Stage
+            {
+                unsigned workers;
+                std::function<void()> work;
+                std::function<void()> finish;
+            };
+
+            /*
+                Keeps the first exception and closes every queue, which unblocks every
+                stage and makes each one stop at its next push
+            */
+            void Fail()
+            {
+                {
+                    std::lock_guard<std::mutex> lock{ errorMutex };
+                    if (!error)
+                        error = std::current_exception();
+                }
+
+                for (const auto& close : closers)
+                    close();
+
+                window.Close();
+            }
+
+        private:
+
+            PipelineOptions options{};
+            std::vector<Stage> stages{};
+            std::vector<std::function<void()>> closers{};
+            SequenceWindow window{};
+            bool ran{};
+
+            std::mutex errorMutex{};
+            std::exception_ptr error{};
+        };
+    }
+
+    /*
+        A pipeline whose last stage produces items of type T
+    */
+    template<typename T>
+    class Pipeline
+    {
+    public:
+
+        Pipeline(std::shared_ptr<Detail::Runtime> runtime, std::shared_ptr<Detail::Channel<T>> output)
+            : runtime(std::move(runtime)), output(std::move(output))
+        {
+        }
+
+        /*
+            Transforms every item with fn, on workers threads
+        */
+        template<typename Fn>
+        auto Map(Fn fn, unsigned workers = 1)
+        {
+            using Mapped = std::decay_t<std::invoke_result_t<Fn&, T&&>>;
+
+            auto mapped = runtime->template MakeChannel<Mapped>();
+            runtime->AddStage(workers, [input = output, mapped, fn]
+            {
+                auto transform = fn;
+                Detail::Batch<T> batch{};
+
+                while (input->Pop(batch))
+                {
+                    Detail::Batch<Mapped> result{ batch.sequence, {} };
+                    result.items.reserve(batch.items.size());
+
+                    for (auto& item : batch.items)
+                        result.items.push_back(transform(std::move(item)));
+
+                    if (!mapped->Push(std::move(result)))
+                        return;
+                }
+            }, [mapped] { mapped->Close(); });
+
+            return Pipeline<Mapped>{ runtime, mapped };
+        }
+
+        /*
+            Keeps the items that satisfy predicate, on workers threads
+        */
+        template<typename Predicate>
+        auto Filter(Predicate predicate, unsigned workers = 1)
+        {
+            auto kept = runtime->template MakeChannel<T>();
+            runtime->AddStage(workers, [input = output, kept, predicate]
+            {
+                auto keep = predicate;
+                Detail::Batch<T> batch{};
+
+                while (input->Pop(batch))
+                {
+                    // Even a batch with nothing left is passed on, since the reduction
+                    // counts on seeing every sequence number
+                    batch.items.erase(std::remove_if(std::begin(batch.items), std::end(batch.items),
+                        [&keep](const T& item) { return !keep(item); }), std::end(batch.items));
+
+                    if (!kept->Push(std::move(batch)))
+                        return;
+                }
+            }, [kept] { kept->Close(); });
+
+            return Pipeline<T>{ runtime, kept };
+        }
+
+        /*
+            Runs the pipeline and reduces everything that comes out of it, on workers
+            threads. init has to be the identity of combine, since every batch starts
+            from it. A pipeline runs once; reducing it again, or any other handle to it,
+            throws std::logic_error.
+        */
+        template<typename Value, typename BinaryOp>
+        Value Reduce(Value init, BinaryOp combine, unsigned workers = 1)
+        {
+            // Batches that were reduced before the ones ahead of them wait here. The
+            // source stays within the window of the oldest batch missing, which bounds
+            // how many can.
+            std::mutex orderMutex{};
+            std::map<std::uint64_t, Value> pending{};
+            std::uint64_t next = 0;
+            auto result = init;
+
+            auto& window = runtime->Window();
+
+            runtime->AddStage(workers, [&, input = output]
+            {
+                auto op = combine;
+                Detail::Batch<T> batch{};
+
+                while (input->Pop(batch))
+                {
+                    auto partial = Kernels::Reduce(std::begin(batch.items), std::end(batch.items), init, op);
+
+                    std::lock_guard<std::mutex> lock{ orderMutex };
+                    pending.emplace(batch.sequence, std::move(partial));
+
+                    const auto oldest = next;
+                    for (auto ready = pending.begin(); ready != pending.end() && ready->first == next; ready = pending.erase(ready), ++next)
+                        result = op(result, ready->second);
+
+                    if (next != oldest)
+                        window.Advance(next);
+                }
+            }, [] {});
+
+            runtime->Run();
+            return result;
+        }
+
+    private:
+
+        std::shared_ptr<Detail::Runtime> runtime{};
+        std::shared_ptr<Detail::Channel<T>> output{};
+    };
+
+    /*
+        A pipeline that starts by reading [first, last) on a thread of its own. The
+        iterators only have to be input iterators.
+    */
+    template<typename InputIterator>
+    auto From(InputIterator first, InputIterator last, const PipelineOptions& options = {})
+    {
+        using Item = typename std::iterator_traits<InputIterator>::value_type;
+
+        auto runtime = std::make_shared<Detail::Runtime>(options);
+        auto source = runtime->template MakeChannel<Item>();
+        const auto batchSize = std::max<std::size_t>(1, options.batchSize);
+
+        // The runtime owns the stages, so it outlives them
+        auto window = &runtime->Window();
+
+        runtime->AddStage(1, [first, last, source, batchSize, window]() mutable
+        {
+            for (std::uint64_t sequence = 0; first != last; ++sequence)
+            {
+                if (!window->Acquire(sequence))
+                    return;
+
+                Detail::Batch<Item> batch{ sequence, {} };
+                batch.items.reserve(batchSize);
+
+                for (; first != last && batch.items.size() < batchSize; ++first)
+                    batch.items.push_back(*first);
+
+                if (!source->Push(std::move(batch)))
+                    return;
+            }
+        }, [source] { source->Close(); });
+
+        return Pipeline<Item>{ runtime, source };
+    }
+}
+
+}
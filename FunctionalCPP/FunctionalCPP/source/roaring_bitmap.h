@@ -0,0 +1,559 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "bit_set.h"
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    A compressed set of 32 bit ids (a Roaring bitmap). A dense bit set over hundreds of
+    millions of ids takes tens of megabytes however few of them are set, and a hash set
+    takes several bytes per id however dense they are. A Roaring bitmap cuts the ids
+    into chunks of 65536 by their top 16 bits, and stores the bottom 16 bits of every
+    chunk in whichever container is smallest for it:
+
+        an array of the sorted values, for chunks of up to 4096 ids (2 bytes per id)
+        a bitmap of all 65536 values, for denser chunks (8 KiB however many ids)
+        a list of runs of consecutive values, for chunks that are mostly ranges
+            (4 bytes per run)
+
+    Chunks with no ids take no space at all. Every container keeps its own count, so
+    the size of the set is a sum over the chunks rather than a pass over the ids.
+
+    Bitmap containers are combined with the vector kernels of the bit sets, a word of
+    every container at a time. Arrays are merged, and intersected by looking up the
+    values of the array in the other container. Runs are only kept when a combine
+    produces them, or after RunOptimize; inserting into a run container unpacks it.
+*/
+class RoaringBitmap
+{
+public:
+
+    using value_type = std::uint32_t;
+
+    void Insert(std::uint32_t id)
+    {
+        const auto key = static_cast<std::uint16_t>(id >> 16);
+        const auto found = std::lower_bound(std::begin(keys), std::end(keys), key);
+        const auto index = static_cast<std::size_t>(std::distance(std::begin(keys), found));
+
+        if (found == std::end(keys) || *found != key)
+        {
+            keys.insert(found, key);
+            containers.insert(std::next(std::begin(containers), index), Container{});
+        }
+
+        Add(containers[index], static_cast<std::uint16_t>(id));
+    }
+
+    bool Contains(std::uint32_t id) const
+    {
+        const auto key = static_cast<std::uint16_t>(id >> 16);
+        const auto found = std::lower_bound(std::begin(keys), std::end(keys), key);
+
+        return found != std::end(keys) && *found == key &&
+            Has(containers[static_cast<std::size_t>(std::distance(std::begin(keys), found))], static_cast<std::uint16_t>(id));
+    }
+
+    /*
+        Adds every id of other. Chunks only one of them has are copied, and the shared
+        ones are unioned container by container.
+    */
+    void Merge(const RoaringBitmap& other)
+    {
+        std::vector<std::uint16_t> mergedKeys{};
+        std::vector<Container> merged{};
+
+        std::size_t i = 0, j = 0;
+        while (i < keys.size() || j < other.keys.size())
+        {
+            if (j == other.keys.size() || (i < keys.size() && keys[i] < other.keys[j]))
+            {
+                mergedKeys.push_back(keys[i]);
+                merged.push_back(std::move(containers[i++]));
+            }
+            else if (i == keys.size() || other.keys[j] < keys[i])
+            {
+                mergedKeys.push_back(other.keys[j]);
+                merged.push_back(other.containers[j++]);
+            }
+            else
+            {
+                mergedKeys.push_back(keys[i]);
+                merged.push_back(Union(containers[i++], other.containers[j++]));
+            }
+        }
+
+        keys = std::move(mergedKeys);
+        containers = std::move(merged);
+    }
+
+    /*
+        Keeps only the ids other has too. Only the chunks both have can have any.
+    */
+    void IntersectWith(const RoaringBitmap& other)
+    {
+        std::vector<std::uint16_t> keptKeys{};
+        std::vector<Container> kept{};
+
+        std::size_t i = 0, j = 0;
+        while (i < keys.size() && j < other.keys.size())
+        {
+            if (keys[i] < other.keys[j])
+            {
+                ++i;
+            }
+            else if (other.keys[j] < keys[i])
+            {
+                ++j;
+            }
+            else
+            {
+                auto container = Intersect(containers[i], other.containers[j]);
+                if (container.cardinality != 0)
+                {
+                    keptKeys.push_back(keys[i]);
+                    kept.push_back(std::move(container));
+                }
+
+                ++i;
+                ++j;
+            }
+        }
+
+        keys = std::move(keptKeys);
+        containers = std::move(kept);
+    }
+
+    /*
+        The number of ids in the set, from the count every container keeps
+    */
+    std::uint64_t Size() const
+    {
+        std::uint64_t size = 0;
+        for (const auto& container : containers)
+            size += container.cardinality;
+
+        return size;
+    }
+
+    /*
+        Roughly how much memory the containers take, not counting what's reserved
+    */
+    std::size_t SizeInBytes() const
+    {
+        std::size_t bytes = keys.size() * (sizeof(std::uint16_t) + sizeof(Container));
+        for (const auto& container : containers)
+        {
+            bytes += container.array.size() * sizeof(std::uint16_t) + container.bitmap.size() * sizeof(std::uint64_t) +
+                container.runs.size() * sizeof(Run);
+        }
+
+        return bytes;
+    }
+
+    /*
+        Stores every container as runs when that's the smallest it can be
+    */
+    void RunOptimize()
+    {
+        for (auto& container : containers)
+            Shrink(container, true);
+    }
+
+    /*
+        Calls fn with every id, in increasing order
+    */
+    template<typename Fn>
+    void ForEach(const Fn& fn) const
+    {
+        for (std::size_t i = 0; i < keys.size(); ++i)
+        {
+            const auto high = static_cast<std::uint32_t>(keys[i]) << 16;
+            ForEachValue(containers[i], [high, &fn](std::uint32_t low) { fn(high | low); });
+        }
+    }
+
+private:
+
+    static constexpr std::uint32_t ArrayLimit = 4096;
+    static constexpr std::size_t BitmapWords = 65536 / 64;
+
+    enum class Kind
+    {
+        Array,
+        Bitmap,
+        Runs,
+    };
+
+    // Both ends are in the run
+    struct Run
+    {
+        std::uint16_t first;
+        std::uint16_t last;
+    };
+
+    /*
+        Only the vector for the container's kind is used; the others are empty
+    */
+    struct Container
+    {
+        Kind kind = Kind::Array;
+        std::uint32_t cardinality = 0;
+
+        std::vector<std::uint16_t> array{};
+        std::vector<std::uint64_t> bitmap{};
+        std::vector<Run> runs{};
+    };
+
+    template<typename Fn>
+    static void ForEachValue(const Container& container, const Fn& fn)
+    {
+        switch (container.kind)
+        {
+        case Kind::Array:
+            for (const auto value : container.array)
+                fn(value);
+            break;
+
+        case Kind::Bitmap:
+            for (std::size_t word = 0; word < BitmapWords; ++word)
+            {
+                for (auto bits = container.bitmap[word]; bits != 0; bits &= bits - 1)
+                    fn(static_cast<std::uint32_t>(word * 64 + PopCount((bits & (~bits + 1)) - 1)));
+            }
+            break;
+
+        case Kind::Runs:
+            for (const auto run : container.runs)
+            {
+                for (std::uint32_t value = run.first; value <= run.last; ++value)
+                    fn(value);
+            }
+            break;
+        }
+    }
+
+    static bool Has(const Container& container, std::uint16_t value)
+    {
+        switch (container.kind)
+        {
+        case Kind::Array:
+            return std::binary_search(std::begin(container.array), std::end(container.array), value);
+
+        case Kind::Bitmap:
+            return ((container.bitmap[value / 64] >> (value % 64)) & 1) != 0;
+
+        default:
+        {
+            // The last run that starts at or before value
+            const auto after = std::upper_bound(std::begin(container.runs), std::end(container.runs), value,
+                [](std::uint16_t wanted, const Run& run) { return wanted < run.first; });
+
+            return after != std::begin(container.runs) && std::prev(after)->last >= value;
+        }
+        }
+    }
+
+    static void SetRange(std::uint64_t* words, std::uint32_t first, std::uint32_t last)
+    {
+        for (auto word = first / 64; word <= last / 64; ++word)
+        {
+            const auto low = word == first / 64 ? first % 64 : 0;
+            const auto high = word == last / 64 ? last % 64 : 63;
+
+            words[word] |= (~std::uint64_t{ 0 } >> (63 - high)) & (~std::uint64_t{ 0 } << low);
+        }
+    }
+
+    /*
+        The container's values as a bitmap, whatever it's stored as
+    */
+    static std::vector<std::uint64_t> Words(const Container& container)
+    {
+        if (container.kind == Kind::Bitmap)
+            return container.bitmap;
+
+        std::vector<std::uint64_t> words(BitmapWords, 0);
+
+        if (container.kind == Kind::Runs)
+        {
+            for (const auto run : container.runs)
+                SetRange(words.data(), run.first, run.last);
+        }
+        else
+        {
+            for (const auto value : container.array)
+                words[value / 64] |= std::uint64_t{ 1 } << (value % 64);
+        }
+
+        return words;
+    }
+
+    static Container FromWords(std::vector<std::uint64_t> words)
+    {
+        Container container{};
+        container.kind = Kind::Bitmap;
+        container.cardinality = static_cast<std::uint32_t>(Kernels::CountBits(words.data(), words.size()));
+        container.bitmap = std::move(words);
+
+        return container;
+    }
+
+    static std::size_t CountRuns(const Container& container)
+    {
+        switch (container.kind)
+        {
+        case Kind::Array:
+        {
+            std::size_t runs = container.array.empty() ? 0 : 1;
+            for (std::size_t i = 1; i < container.array.size(); ++i)
+                runs += container.array[i] != container.array[i - 1] + 1;
+
+            return runs;
+        }
+
+        case Kind::Bitmap:
+        {
+            // A run starts at every set bit whose lower neighbour isn't set
+            std::size_t runs = 0;
+            std::uint64_t carry = 0;
+
+            for (const auto word : container.bitmap)
+            {
+                runs += PopCount(word & ~((word << 1) | carry));
+                carry = word >> 63;
+            }
+
+            return runs;
+        }
+
+        default:
+            return container.runs.size();
+        }
+    }
+
+    static void Convert(Container& container, Kind kind)
+    {
+        if (container.kind == kind)
+            return;
+
+        Container converted{};
+        converted.kind = kind;
+        converted.cardinality = container.cardinality;
+
+        if (kind == Kind::Bitmap)
+        {
+            converted.bitmap = Words(container);
+        }
+        else if (kind == Kind::Array)
+        {
+            converted.array.reserve(container.cardinality);
+            ForEachValue(container, [&converted](std::uint32_t value) { converted.array.push_back(static_cast<std::uint16_t>(value)); });
+        }
+        else
+        {
+            ForEachValue(container, [&converted](std::uint32_t value)
+            {
+                auto& runs = converted.runs;
+                if (!runs.empty() && runs.back().last + 1u == value)
+                    runs.back().last = static_cast<std::uint16_t>(value);
+                else
+                    runs.push_back({ static_cast<std::uint16_t>(value), static_cast<std::uint16_t>(value) });
+            });
+        }
+
+        container = std::move(converted);
+    }
+
+    /*
+        Converts the container to whichever kind stores it in the fewest bytes. Counting
+        the runs takes a pass, so they're only considered when asked to.
+    */
+    static void Shrink(Container& container, bool considerRuns)
+    {
+        const auto arrayBytes = container.cardinality <= ArrayLimit ? container.cardinality * sizeof(std::uint16_t) : SIZE_MAX;
+        const auto bitmapBytes = BitmapWords * sizeof(std::uint64_t);
+        const auto runBytes = considerRuns ? CountRuns(container) * sizeof(Run) : SIZE_MAX;
+
+        if (runBytes < arrayBytes && runBytes < bitmapBytes)
+            Convert(container, Kind::Runs);
+        else if (arrayBytes <= bitmapBytes)
+            Convert(container, Kind::Array);
+        else
+            Convert(container, Kind::Bitmap);
+    }
+
+    static void Add(Container& container, std::uint16_t value)
+    {
+        if (container.kind == Kind::Runs)
+        {
+            if (Has(container, value))
+                return;
+
+            Convert(container, container.cardinality < ArrayLimit ? Kind::Array : Kind::Bitmap);
+        }
+
+        if (container.kind == Kind::Bitmap)
+        {
+            auto& word = container.bitmap[value / 64];
+            const auto bit = std::uint64_t{ 1 } << (value % 64);
+
+            container.cardinality += (word & bit) == 0;
+            word |= bit;
+            return;
+        }
+
+        const auto found = std::lower_bound(std::begin(container.array), std::end(container.array), value);
+        if (found != std::end(container.array) && *found == value)
+            return;
+
+        if (container.cardinality == ArrayLimit)
+        {
+            Convert(container, Kind::Bitmap);
+            return Add(container, value);
+        }
+
+        container.array.insert(found, value);
+        ++container.cardinality;
+    }
+
+    static Container Union(const Container& lhs, const Container& rhs)
+    {
+        Container result{};
+
+        if (lhs.kind == Kind::Array && rhs.kind == Kind::Array && lhs.cardinality + rhs.cardinality <= ArrayLimit)
+        {
+            result.array.reserve(lhs.cardinality + rhs.cardinality);
+            std::set_union(std::begin(lhs.array), std::end(lhs.array), std::begin(rhs.array), std::end(rhs.array),
+                std::back_inserter(result.array));
+
+            result.cardinality = static_cast<std::uint32_t>(result.array.size());
+            return result;
+        }
+
+        if (lhs.kind == Kind::Runs && rhs.kind == Kind::Runs)
+        {
+            result.kind = Kind::Runs;
+
+            // Both lists are sorted, so merging them by start and joining the runs that
+            // touch or overlap gives the union
+            std::vector<Run> both{};
+            std::merge(std::begin(lhs.runs), std::end(lhs.runs), std::begin(rhs.runs), std::end(rhs.runs), std::back_inserter(both),
+                [](const Run& a, const Run& b) { return a.first < b.first; });
+
+            for (const auto run : both)
+            {
+                if (!result.runs.empty() && run.first <= result.runs.back().last + 1u)
+                    result.runs.back().last = std::max(result.runs.back().last, run.last);
+                else
+                    result.runs.push_back(run);
+            }
+
+            for (const auto run : result.runs)
+                result.cardinality += run.last - run.first + 1u;
+
+            Shrink(result, true);
+            return result;
+        }
+
+        auto words = Words(lhs);
+
+        if (rhs.kind == Kind::Bitmap)
+        {
+            Kernels::Bitwise<Kernels::BitwiseKind::Or>(words.data(), rhs.bitmap.data(), BitmapWords);
+        }
+        else if (rhs.kind == Kind::Runs)
+        {
+            for (const auto run : rhs.runs)
+                SetRange(words.data(), run.first, run.last);
+        }
+        else
+        {
+            for (const auto value : rhs.array)
+                words[value / 64] |= std::uint64_t{ 1 } << (value % 64);
+        }
+
+        result = FromWords(std::move(words));
+        Shrink(result, lhs.kind == Kind::Runs || rhs.kind == Kind::Runs);
+        return result;
+    }
+
+    static Container Intersect(const Container& lhs, const Container& rhs)
+    {
+        Container result{};
+
+        // The result is never bigger than the array, so it's an array too
+        if (lhs.kind == Kind::Array || rhs.kind == Kind::Array)
+        {
+            const auto& array = lhs.kind == Kind::Array ? lhs : rhs;
+            const auto& other = lhs.kind == Kind::Array ? rhs : lhs;
+
+            if (other.kind == Kind::Array)
+            {
+                std::set_intersection(std::begin(array.array), std::end(array.array), std::begin(other.array), std::end(other.array),
+                    std::back_inserter(result.array));
+            }
+            else
+            {
+                std::copy_if(std::begin(array.array), std::end(array.array), std::back_inserter(result.array),
+                    [&other](std::uint16_t value) { return Has(other, value); });
+            }
+
+            result.cardinality = static_cast<std::uint32_t>(result.array.size());
+            return result;
+        }
+
+        if (lhs.kind == Kind::Runs && rhs.kind == Kind::Runs)
+        {
+            result.kind = Kind::Runs;
+
+            for (std::size_t i = 0, j = 0; i < lhs.runs.size() && j < rhs.runs.size();)
+            {
+                const auto first = std::max(lhs.runs[i].first, rhs.runs[j].first);
+                const auto last = std::min(lhs.runs[i].last, rhs.runs[j].last);
+
+                if (first <= last)
+                {
+                    result.runs.push_back({ first, last });
+                    result.cardinality += last - first + 1u;
+                }
+
+                // Whichever run ends first can't overlap anything further on
+                if (lhs.runs[i].last < rhs.runs[j].last)
+                    ++i;
+                else
+                    ++j;
+            }
+
+            Shrink(result, true);
+            return result;
+        }
+
+        auto words = Words(lhs);
+        const auto other = rhs.kind == Kind::Bitmap ? std::vector<std::uint64_t>{} : Words(rhs);
+        Kernels::Bitwise<Kernels::BitwiseKind::And>(words.data(), other.empty() ? rhs.bitmap.data() : other.data(), BitmapWords);
+
+        result = FromWords(std::move(words));
+        Shrink(result, lhs.kind == Kind::Runs || rhs.kind == Kind::Runs);
+        return result;
+    }
+
+private:
+
+    // The top 16 bits of every chunk, sorted, and each chunk's container
+    std::vector<std::uint16_t> keys{};
+    std::vector<Container> containers{};
+};
+
+template<>
+struct IsIdempotent<Union<RoaringBitmap>> : std::true_type {};
+
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "fork_join.h"
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    A segment tree stores the fold of every power of two aligned block of a sequence,
+    so any range [l, r) can be folded from O(log n) precomputed partial results.
+    It only needs associativity and an identity, so it works with any monoid.
+
+    The nodes are kept in a single array in Eytzinger (breadth first) order: the root is
+    at index 1, and the children of node i are at 2i and 2i + 1. There are no pointers to
+    chase, the top levels of the tree (which every query touches) share a handful of
+    cache lines, and the leaves are a contiguous copy of the input starting at index
+    leafCount. Leaves past the end of the input are padded with the identity.
+
+    Queries walk up from both ends of the range at once, keeping a left and a right
+    partial result so that the order of combination is preserved. This matters for
+    monoids that aren't commutative, like string concatenation or function composition.
+*/
+template<typename MonoidType>
+class SegmentTree
+{
+public:
+
+    using ValueType = typename MonoidType::ValueType;
+
+    template<typename Iterator>
+    SegmentTree(Iterator begin, Iterator end, MonoidType monoid = {})
+        : monoid(std::move(monoid))
+    {
+        static_assert(std::is_base_of_v<std::random_access_iterator_tag,
+            typename std::iterator_traits<Iterator>::iterator_category>,
+            "The parallel build splits the input, so it needs random access iterators");
+
+        count = static_cast<std::size_t>(std::distance(begin, end));
+
+        leafCount = 1;
+        while (leafCount < count)
+            leafCount *= 2;
+
+        nodes.assign(2 * leafCount, this->monoid.identity);
+
+        // Each subtree of the split owns at most this many leaves, mirroring the load
+        // factor that Reduce uses to decide when to stop splitting.
+        const auto load = std::max<std::size_t>(1, leafCount / ForkJoinPool::Default().Threads());
+
+        Build(begin, 1, leafCount, load);
+    }
+
+    /*
+        Folds the values in [l, r). An empty range folds to the identity.
+    */
+    ValueType Query(std::size_t l, std::size_t r) const
+    {
+        assert(l <= r && r <= count);
+
+        ValueType lhs = monoid.identity;
+        ValueType rhs = monoid.identity;
+
+        for (l += leafCount, r += leafCount; l < r; l /= 2, r /= 2)
+        {
+            if (l & 1)
+                lhs = monoid(lhs, nodes[l++]);
+
+            if (r & 1)
+                rhs = monoid(nodes[--r], rhs);
+        }
+
+        return monoid(lhs, rhs);
+    }
+
+    /*
+        Replaces the value at index i and recomputes the O(log n) partial results above it.
+    */
+    void Update(std::size_t i, ValueType value)
+    {
+        assert(i < count);
+
+        i += leafCount;
+        nodes[i] = std::move(value);
+
+        for (i /= 2; i > 0; i /= 2)
+            nodes[i] = monoid(nodes[2 * i], nodes[2 * i + 1]);
+    }
+
+    const ValueType& operator[](std::size_t i) const
+    {
+        assert(i < count);
+        return nodes[leafCount + i];
+    }
+
+    std::size_t Size() const
+    {
+        return count;
+    }
+
+private:
+
+    /*
+        Builds the subtree rooted at node, which covers `width` leaves. This is the same
+        divide and conquer as Reduce: split in half until a subtree is small enough,
+        build the halves in parallel on the fork-join pool, then combine them on the way out.
+        The two halves write to disjoint parts of the node array, so nothing is shared.
+    */
+    template<typename Iterator>
+    void Build(Iterator begin, std::size_t node, std::size_t width, std::size_t load)
+    {
+        if (width <= load)
+        {
+            BuildSequential(begin, node, width);
+            return;
+        }
+
+        ForkJoinPool::Default().Fork(
+            [this, begin, node, width, load] { Build(begin, 2 * node, width / 2, load); },
+            [this, begin, node, width, load] { Build(begin, 2 * node + 1, width / 2, load); });
+
+        nodes[node] = monoid(nodes[2 * node], nodes[2 * node + 1]);
+    }
+
+    /*
+        Copies the leaves under node from the input, then fills in the subtree
+        level by level from the bottom up.
+    */
+    template<typename Iterator>
+    void BuildSequential(Iterator begin, std::size_t node, std::size_t width)
+    {
+        // The leftmost leaf below node, both as a node index and as an input index
+        auto first = node;
+        auto depth = std::size_t{ 1 };
+        while (depth < width)
+        {
+            first *= 2;
+            depth *= 2;
+        }
+
+        const auto offset = first - leafCount;
+        if (offset < count)
+        {
+            const auto last = std::min(count, offset + width);
+            std::copy(std::next(begin, offset), std::next(begin, last), std::next(std::begin(nodes), first));
+        }
+
+        for (auto levelBegin = first / 2, levelWidth = width / 2; levelWidth > 0; levelBegin /= 2, levelWidth /= 2)
+        {
+            for (auto i = levelBegin; i < levelBegin + levelWidth; ++i)
+                nodes[i] = monoid(nodes[2 * i], nodes[2 * i + 1]);
+        }
+    }
+
+private:
+
+    MonoidType monoid{};
+    std::size_t count{};
+    std::size_t leafCount{};
+    std::vector<ValueType> nodes{};
+};
+
+/*
+    Returns floor(log2(value)) for value > 0, using the bit scan instruction where the
+    compiler exposes one so that a sparse table query stays O(1).
+*/
+inline std::size_t FloorLog2(std::size_t value)
+{
+    assert(value > 0);
+
+#if defined(__GNUC__)
+    return static_cast<std::size_t>(std::numeric_limits<unsigned long long>::digits - 1 - __builtin_clzll(value));
+#else
+    std::size_t result = 0;
+    while (value >>= 1)
+        ++result;
+
+    return result;
+#endif
+}
+
+/*
+    For idempotent monoids (min, max, gcd, bitwise and/or...) overlapping blocks can be
+    combined without changing the answer. A sparse table precomputes the fold of every
+    block of length 2^k, and then any range is covered by just two overlapping blocks,
+    which gives O(1) queries at the cost of O(n log n) memory and no updates.
+    It's the structure to use for static data, and the segment tree for data that changes.
+*/
+template<typename MonoidType>
+class SparseTable
+{
+public:
+
+    static_assert(IsIdempotentV<MonoidType>,
+        "Sparse tables combine overlapping blocks, so the monoid has to be idempotent");
+
+    using ValueType = typename MonoidType::ValueType;
+
+    template<typename Iterator>
+    SparseTable(Iterator begin, Iterator end, MonoidType monoid = {})
+        : monoid(std::move(monoid))
+    {
+        levels.emplace_back(begin, end);
+        count = levels.front().size();
+
+        // Level k holds the fold of [i, i + 2^k), which is the combination
+        // of two adjacent blocks from level k - 1.
+        for (std::size_t width = 2; width <= count; width *= 2)
+        {
+            const auto& previous = levels.back();
+            std::vector<ValueType> level{};
+            level.reserve(count - width + 1);
+
+            for (std::size_t i = 0; i + width <= count; ++i)
+                level.emplace_back(this->monoid(previous[i], previous[i + width / 2]));
+
+            levels.emplace_back(std::move(level));
+        }
+    }
+
+    /*
+        Folds the values in [l, r). An empty range folds to the identity.
+    */
+    ValueType Query(std::size_t l, std::size_t r) const
+    {
+        assert(l <= r && r <= count);
+
+        if (l == r)
+            return monoid.identity;
+
+        const auto k = FloorLog2(r - l);
+        return monoid(levels[k][l], levels[k][r - (std::size_t{ 1 } << k)]);
+    }
+
+    std::size_t Size() const
+    {
+        return count;
+    }
+
+private:
+
+    MonoidType monoid{};
+    std::size_t count{};
+    std::vector<std::vector<ValueType>> levels{};
+};
+
+}
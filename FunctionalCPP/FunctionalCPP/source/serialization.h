@@ -0,0 +1,713 @@
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Monoids
+{
+/*
+    A compact binary encoding for partial monoid states, so that a partial reduction
+    can be written to disk or sent somewhere else and combined later.
+
+    Every encoded buffer starts with a small header:
+
+        magic           4 bytes, "FCPS", the same whatever the byte order
+        byte order      2 bytes, to reject buffers written on a machine of the other endianness
+        format version  varint, the version of this encoding
+        state version   varint, chosen by the caller for the layout of their own state
+
+    Integers are written as varints (zigzag for signed ones), so the small counts that
+    make up most partial states take a byte or two. Arrays of trivially copyable values
+    are written as raw, aligned blocks, which means they can be used in place, straight
+    out of a memory mapped file, through an ArrayView instead of being parsed.
+*/
+constexpr std::array<unsigned char, 4> SerializationMagic{ 'F', 'C', 'P', 'S' };
+constexpr std::uint16_t SerializationByteOrder = 0x0102;
+constexpr std::uint32_t SerializationFormatVersion = 1;
+
+class SerializationError : public std::runtime_error
+{
+public:
+
+    using std::runtime_error::runtime_error;
+};
+
+/*
+    A read-only view of an array of T that lives inside an encoded buffer.
+*/
+template<typename T>
+class ArrayView
+{
+public:
+
+    ArrayView() = default;
+
+    ArrayView(const T* data, std::size_t count)
+        : items(data), count(count)
+    {
+    }
+
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+    const T* data() const { return items; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const T& operator[](std::size_t i) const
+    {
+        assert(i < count);
+        return items[i];
+    }
+
+private:
+
+    const T* items{};
+    std::size_t count{};
+};
+
+class BinaryWriter
+{
+public:
+
+    void WriteBytes(const void* data, std::size_t size)
+    {
+        const auto bytes = static_cast<const unsigned char*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    }
+
+    /*
+        Writes the object representation as is, in native byte order.
+    */
+    template<typename T>
+    void WriteRaw(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be written raw");
+        WriteBytes(&value, sizeof(T));
+    }
+
+    /*
+        LEB128: 7 bits per byte, with the high bit set on every byte but the last.
+    */
+    void WriteVarint(std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+
+        buffer.push_back(static_cast<unsigned char>(value));
+    }
+
+    /*
+        Zigzag maps small negative numbers to small varints: 0, -1, 1, -2... -> 0, 1, 2, 3...
+    */
+    void WriteSignedVarint(std::int64_t value)
+    {
+        WriteVarint((static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+    }
+
+    /*
+        Pads with zeros so that the next write starts at a multiple of alignment
+        from the start of the buffer.
+    */
+    void Align(std::size_t alignment)
+    {
+        while (buffer.size() % alignment != 0)
+            buffer.push_back(0);
+    }
+
+    /*
+        Bit-packs a column of unsigned values using the width of the largest one,
+        which is much smaller than a varint per value when the values are similar.
+    */
+    void WritePacked(const std::uint64_t* values, std::size_t count)
+    {
+        std::uint64_t largest = 0;
+        for (std::size_t i = 0; i < count; ++i)
+            largest |= values[i];
+
+        // At least one bit per value, so that a count can never claim more
+        // values than the buffer has bits for
+        unsigned width = 1;
+        while (width < 64 && (largest >> width) != 0)
+            ++width;
+
+        WriteVarint(count);
+        buffer.push_back(static_cast<unsigned char>(width));
+
+        std::uint64_t pending = 0;
+        unsigned pendingBits = 0;
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto value = values[i];
+            auto remaining = width;
+
+            while (remaining > 0)
+            {
+                const auto taken = std::min(remaining, 64 - pendingBits);
+                const auto mask = taken == 64 ? ~std::uint64_t{ 0 } : (std::uint64_t{ 1 } << taken) - 1;
+
+                pending |= (value & mask) << pendingBits;
+                pendingBits += taken;
+                remaining -= taken;
+                value = taken == 64 ? 0 : value >> taken;
+
+                if (pendingBits == 64)
+                {
+                    WriteRaw(pending);
+                    pending = 0;
+                    pendingBits = 0;
+                }
+            }
+        }
+
+        // Only the bytes that hold bits are written
+        for (unsigned bit = 0; bit < pendingBits; bit += 8)
+            buffer.push_back(static_cast<unsigned char>(pending >> bit));
+    }
+
+    std::size_t Size() const
+    {
+        return buffer.size();
+    }
+
+    const std::vector<unsigned char>& Buffer() const
+    {
+        return buffer;
+    }
+
+    std::vector<unsigned char> Release()
+    {
+        return std::move(buffer);
+    }
+
+    /*
+        Empties the buffer but keeps its storage, for writing many small records in turn
+    */
+    void Clear()
+    {
+        buffer.clear();
+    }
+
+private:
+
+    std::vector<unsigned char> buffer{};
+};
+
+/*
+    Reads from a buffer it doesn't own, which can be a memory mapped file.
+    Reading past the end throws a SerializationError instead of reading garbage.
+*/
+class BinaryReader
+{
+public:
+
+    BinaryReader(const void* data, std::size_t size)
+        : start(static_cast<const unsigned char*>(data)), size(size)
+    {
+    }
+
+    void ReadBytes(void* data, std::size_t count)
+    {
+        std::memcpy(data, Take(count), count);
+    }
+
+    template<typename T>
+    T ReadRaw()
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be read raw");
+
+        T value;
+        ReadBytes(&value, sizeof(T));
+        return value;
+    }
+
+    std::uint64_t ReadVarint()
+    {
+        std::uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            const auto byte = *Take(1);
+            value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+
+        throw SerializationError{ "Varint is longer than 64 bits" };
+    }
+
+    std::int64_t ReadSignedVarint()
+    {
+        const auto value = ReadVarint();
+        return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+    }
+
+    void Align(std::size_t alignment)
+    {
+        const auto padding = (alignment - offset % alignment) % alignment;
+        Take(padding);
+    }
+
+    std::vector<std::uint64_t> ReadPacked()
+    {
+        const auto count = ReadVarint();
+        const auto width = static_cast<unsigned>(*Take(1));
+        if (width == 0 || width > 64)
+            throw SerializationError{ "Invalid bit width" };
+
+        if (count > Remaining() * 8)
+            throw SerializationError{ "Count is larger than the buffer" };
+
+        const auto totalBits = static_cast<std::uint64_t>(count) * width;
+        const auto bytes = Take(static_cast<std::size_t>((totalBits + 7) / 8));
+
+        std::vector<std::uint64_t> values(static_cast<std::size_t>(count));
+        std::uint64_t bit = 0;
+
+        // Gathers each value a byte (or the part of one that belongs to it) at a time
+        for (auto& value : values)
+        {
+            for (unsigned filled = 0; filled < width;)
+            {
+                const auto shift = static_cast<unsigned>(bit % 8);
+                const auto taken = std::min(8 - shift, width - filled);
+                const auto bits = (static_cast<unsigned>(bytes[bit / 8]) >> shift) & ((1u << taken) - 1);
+
+                value |= static_cast<std::uint64_t>(bits) << filled;
+                filled += taken;
+                bit += taken;
+            }
+        }
+
+        return values;
+    }
+
+    /*
+        Returns a view of `count` values of T directly inside the buffer, without copying.
+        The block has to be aligned in memory, which it is as long as the buffer itself
+        is aligned to alignof(T) (memory mapped files and heap buffers always are).
+    */
+    template<typename T>
+    ArrayView<T> ReadArrayView(std::size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable values can be viewed in place");
+
+        Align(alignof(T));
+        if (count > Remaining() / sizeof(T))
+            throw SerializationError{ "Array runs past the end of the buffer" };
+
+        const auto data = Take(count * sizeof(T));
+        if (reinterpret_cast<std::uintptr_t>(data) % alignof(T) != 0)
+            throw SerializationError{ "Buffer isn't aligned for in-place access" };
+
+        return { reinterpret_cast<const T*>(data), count };
+    }
+
+    /*
+        Reads a count of elements that each take at least minimumSize bytes, rejecting
+        counts that couldn't possibly fit in what's left of the buffer.
+    */
+    std::size_t ReadCount(std::size_t minimumSize)
+    {
+        const auto count = ReadVarint();
+        if (minimumSize > 0 && count > Remaining() / minimumSize + 1)
+            throw SerializationError{ "Count is larger than the buffer" };
+
+        return static_cast<std::size_t>(count);
+    }
+
+    std::size_t Remaining() const
+    {
+        return size - offset;
+    }
+
+private:
+
+    const unsigned char* Take(std::size_t count)
+    {
+        if (count > Remaining())
+            throw SerializationError{ "Unexpected end of buffer" };
+
+        const auto data = start + offset;
+        offset += count;
+        return data;
+    }
+
+private:
+
+    const unsigned char* start{};
+    std::size_t size{};
+    std::size_t offset{};
+};
+
+/*
+    Serializer<T> describes how a T is written and read:
+
+        static void Write(BinaryWriter& writer, const T& value);
+        static T Read(BinaryReader& reader);
+
+    By default, trivially copyable values (floating point numbers, and structs like
+    running means, compensated sums or min/max pairs) are written as their raw bytes.
+    It's specialized below for integers, strings, optionals, pairs, vectors and maps.
+    Specialize it for user-defined partial states that aren't trivially copyable.
+*/
+template<typename T, typename = void>
+struct Serializer
+{
+    static_assert(std::is_trivially_copyable_v<T>,
+        "There's no Serializer for this type, and it isn't trivially copyable. Specialize Serializer<T> for it.");
+
+    static void Write(BinaryWriter& writer, const T& value)
+    {
+        writer.WriteRaw(value);
+    }
+
+    static T Read(BinaryReader& reader)
+    {
+        return reader.ReadRaw<T>();
+    }
+};
+
+template<typename T>
+struct Serializer<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+{
+    static void Write(BinaryWriter& writer, const T& value)
+    {
+        if constexpr (std::is_signed_v<T>)
+            writer.WriteSignedVarint(value);
+        else
+            writer.WriteVarint(value);
+    }
+
+    static T Read(BinaryReader& reader)
+    {
+        if constexpr (std::is_signed_v<T>)
+            return static_cast<T>(reader.ReadSignedVarint());
+        else
+            return static_cast<T>(reader.ReadVarint());
+    }
+};
+
+template<>
+struct Serializer<bool>
+{
+    static void Write(BinaryWriter& writer, const bool& value)
+    {
+        writer.WriteRaw(static_cast<std::uint8_t>(value ? 1 : 0));
+    }
+
+    static bool Read(BinaryReader& reader)
+    {
+        return reader.ReadRaw<std::uint8_t>() != 0;
+    }
+};
+
+template<typename T>
+struct Serializer<T, std::enable_if_t<std::is_enum_v<T>>>
+{
+    using Underlying = std::underlying_type_t<T>;
+
+    static void Write(BinaryWriter& writer, const T& value)
+    {
+        Serializer<Underlying>::Write(writer, static_cast<Underlying>(value));
+    }
+
+    static T Read(BinaryReader& reader)
+    {
+        return static_cast<T>(Serializer<Underlying>::Read(reader));
+    }
+};
+
+template<>
+struct Serializer<std::string>
+{
+    static void Write(BinaryWriter& writer, const std::string& value)
+    {
+        writer.WriteVarint(value.size());
+        writer.WriteBytes(value.data(), value.size());
+    }
+
+    static std::string Read(BinaryReader& reader)
+    {
+        std::string value(reader.ReadCount(1), '\0');
+        reader.ReadBytes(value.data(), value.size());
+        return value;
+    }
+};
+
+template<typename T>
+struct Serializer<std::optional<T>>
+{
+    static void Write(BinaryWriter& writer, const std::optional<T>& value)
+    {
+        Serializer<bool>::Write(writer, value.has_value());
+        if (value)
+            Serializer<T>::Write(writer, *value);
+    }
+
+    static std::optional<T> Read(BinaryReader& reader)
+    {
+        if (!Serializer<bool>::Read(reader))
+            return std::nullopt;
+
+        return Serializer<T>::Read(reader);
+    }
+};
+
+template<typename First, typename Second>
+struct Serializer<std::pair<First, Second>>
+{
+    static void Write(BinaryWriter& writer, const std::pair<First, Second>& value)
+    {
+        Serializer<First>::Write(writer, value.first);
+        Serializer<Second>::Write(writer, value.second);
+    }
+
+    static std::pair<First, Second> Read(BinaryReader& reader)
+    {
+        auto first = Serializer<First>::Read(reader);
+        auto second = Serializer<Second>::Read(reader);
+        return { std::move(first), std::move(second) };
+    }
+};
+
+/*
+    Vectors of trivially copyable values are written as one aligned block, the same
+    layout an ArrayView reads in place. Anything else is written element by element.
+*/
+template<typename T>
+struct Serializer<std::vector<T>>
+{
+    static void Write(BinaryWriter& writer, const std::vector<T>& values)
+    {
+        writer.WriteVarint(values.size());
+
+        if constexpr (std::is_trivially_copyable_v<T>)
+        {
+            writer.Align(alignof(T));
+            writer.WriteBytes(values.data(), values.size() * sizeof(T));
+        }
+        else
+        {
+            for (const auto& value : values)
+                Serializer<T>::Write(writer, value);
+        }
+    }
+
+    static std::vector<T> Read(BinaryReader& reader)
+    {
+        if constexpr (std::is_trivially_copyable_v<T>)
+        {
+            const auto view = Serializer<ArrayView<T>>::Read(reader);
+            return { view.begin(), view.end() };
+        }
+        else
+        {
+            const auto count = reader.ReadCount(1);
+
+            std::vector<T> values{};
+            values.reserve(count);
+
+            for (std::size_t i = 0; i < count; ++i)
+                values.push_back(Serializer<T>::Read(reader));
+
+            return values;
+        }
+    }
+};
+
+/*
+    std::vector<bool> packs its bits and has no data() to write them from, so it's
+    written eight to a byte, lowest bit first
+*/
+template<>
+struct Serializer<std::vector<bool>>
+{
+    static void Write(BinaryWriter& writer, const std::vector<bool>& values)
+    {
+        writer.WriteVarint(values.size());
+
+        for (std::size_t i = 0; i < values.size(); i += 8)
+        {
+            std::uint8_t byte = 0;
+            for (std::size_t bit = 0; bit < 8 && i + bit < values.size(); ++bit)
+                byte |= static_cast<std::uint8_t>(values[i + bit] ? 1u << bit : 0u);
+
+            writer.WriteRaw(byte);
+        }
+    }
+
+    static std::vector<bool> Read(BinaryReader& reader)
+    {
+        const auto count = reader.ReadVarint();
+        if (count > static_cast<std::uint64_t>(reader.Remaining()) * 8)
+            throw SerializationError{ "Count is larger than the buffer" };
+
+        std::vector<bool> values(static_cast<std::size_t>(count));
+        for (std::size_t i = 0; i < values.size(); i += 8)
+        {
+            const auto byte = reader.ReadRaw<std::uint8_t>();
+            for (std::size_t bit = 0; bit < 8 && i + bit < values.size(); ++bit)
+                values[i + bit] = ((byte >> bit) & 1) != 0;
+        }
+
+        return values;
+    }
+};
+
+template<typename T>
+struct Serializer<ArrayView<T>>
+{
+    static void Write(BinaryWriter& writer, const ArrayView<T>& values)
+    {
+        writer.WriteVarint(values.size());
+        writer.Align(alignof(T));
+        writer.WriteBytes(values.data(), values.size() * sizeof(T));
+    }
+
+    static ArrayView<T> Read(BinaryReader& reader)
+    {
+        const auto count = reader.ReadCount(0);
+        return reader.ReadArrayView<T>(count);
+    }
+};
+
+/*
+    Hash aggregation tables are written as a column of keys followed by a column of
+    values. When the values are unsigned counts, the column is bit-packed.
+*/
+template<typename Map>
+struct MapSerializer
+{
+    using Key = typename Map::key_type;
+    using Value = typename Map::mapped_type;
+
+    static constexpr bool PacksValues = std::is_integral_v<Value> && std::is_unsigned_v<Value> && !std::is_same_v<Value, bool>;
+
+    static void Write(BinaryWriter& writer, const Map& map)
+    {
+        writer.WriteVarint(map.size());
+
+        for (const auto& entry : map)
+            Serializer<Key>::Write(writer, entry.first);
+
+        if constexpr (PacksValues)
+        {
+            std::vector<std::uint64_t> counts{};
+            counts.reserve(map.size());
+
+            for (const auto& entry : map)
+                counts.push_back(entry.second);
+
+            writer.WritePacked(counts.data(), counts.size());
+        }
+        else
+        {
+            for (const auto& entry : map)
+                Serializer<Value>::Write(writer, entry.second);
+        }
+    }
+
+    static Map Read(BinaryReader& reader)
+    {
+        std::vector<Key> keys(reader.ReadCount(1));
+        for (auto& key : keys)
+            key = Serializer<Key>::Read(reader);
+
+        Map map{};
+        if constexpr (PacksValues)
+        {
+            const auto counts = reader.ReadPacked();
+            if (counts.size() != keys.size())
+                throw SerializationError{ "Key and value columns differ in size" };
+
+            for (std::size_t i = 0; i < keys.size(); ++i)
+                map.emplace(std::move(keys[i]), static_cast<Value>(counts[i]));
+        }
+        else
+        {
+            for (auto& key : keys)
+                map.emplace(std::move(key), Serializer<Value>::Read(reader));
+        }
+
+        return map;
+    }
+};
+
+template<typename Key, typename Value, typename Hash, typename Equal, typename Allocator>
+struct Serializer<std::unordered_map<Key, Value, Hash, Equal, Allocator>>
+    : MapSerializer<std::unordered_map<Key, Value, Hash, Equal, Allocator>> {};
+
+template<typename Key, typename Value, typename Compare, typename Allocator>
+struct Serializer<std::map<Key, Value, Compare, Allocator>>
+    : MapSerializer<std::map<Key, Value, Compare, Allocator>> {};
+
+/*
+    Encodes a value with the header. The state version is stored alongside the value
+    so that readers can reject (or migrate) states written with an older layout.
+*/
+template<typename T>
+std::vector<unsigned char> Encode(const T& value, std::uint32_t stateVersion = 0)
+{
+    BinaryWriter writer{};
+    writer.WriteBytes(SerializationMagic.data(), SerializationMagic.size());
+    writer.WriteRaw(SerializationByteOrder);
+    writer.WriteVarint(SerializationFormatVersion);
+    writer.WriteVarint(stateVersion);
+
+    Serializer<T>::Write(writer, value);
+    return writer.Release();
+}
+
+/*
+    Checks the header and returns the state version that was written.
+*/
+inline std::uint32_t ReadHeader(BinaryReader& reader)
+{
+    std::array<unsigned char, 4> magic{};
+    reader.ReadBytes(magic.data(), magic.size());
+
+    if (magic != SerializationMagic)
+        throw SerializationError{ "Not an encoded monoid state" };
+
+    if (reader.ReadRaw<std::uint16_t>() != SerializationByteOrder)
+        throw SerializationError{ "Encoded on a machine with a different byte order" };
+
+    if (reader.ReadVarint() != SerializationFormatVersion)
+        throw SerializationError{ "Unsupported encoding version" };
+
+    return static_cast<std::uint32_t>(reader.ReadVarint());
+}
+
+template<typename T>
+T Decode(const void* data, std::size_t size, std::uint32_t stateVersion = 0)
+{
+    BinaryReader reader{ data, size };
+    if (ReadHeader(reader) != stateVersion)
+        throw SerializationError{ "Unexpected state version" };
+
+    return Serializer<T>::Read(reader);
+}
+
+template<typename T>
+T Decode(const std::vector<unsigned char>& buffer, std::uint32_t stateVersion = 0)
+{
+    return Decode<T>(buffer.data(), buffer.size(), stateVersion);
+}
+
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+/*
+    Process based reduction relies on fork, mmap and POSIX shared memory,
+    so it's only available on POSIX systems.
+*/
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <new>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "concurrent_accumulator.h"
+
+namespace Monoids
+{
+/*
+    A read-only view of a file mapped into memory. The pages are shared with every
+    process forked after the mapping is made, so workers read the dataset straight
+    out of the page cache without copying it.
+*/
+template<typename T>
+class MappedFile
+{
+public:
+
+    static_assert(std::is_trivially_copyable_v<T>, "Mapped files are reinterpreted as arrays of T");
+
+    explicit MappedFile(const std::string& path)
+    {
+        const auto descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor == -1)
+            throw std::system_error{ errno, std::generic_category(), "Unable to open " + path };
+
+        struct stat status{};
+        if (::fstat(descriptor, &status) == -1)
+        {
+            const auto error = errno;
+            ::close(descriptor);
+            throw std::system_error{ error, std::generic_category(), "Unable to stat " + path };
+        }
+
+        bytes = static_cast<std::size_t>(status.st_size);
+        if (bytes > 0)
+        {
+            address = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, descriptor, 0);
+            if (address == MAP_FAILED)
+            {
+                const auto error = errno;
+                ::close(descriptor);
+                throw std::system_error{ error, std::generic_category(), "Unable to map " + path };
+            }
+        }
+
+        ::close(descriptor);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        if (address != nullptr)
+            ::munmap(address, bytes);
+    }
+
+    const T* begin() const
+    {
+        return static_cast<const T*>(address);
+    }
+
+    const T* end() const
+    {
+        return begin() + size();
+    }
+
+    std::size_t size() const
+    {
+        return bytes / sizeof(T);
+    }
+
+private:
+
+    void* address{};
+    std::size_t bytes{};
+};
+
+/*
+    A POSIX shared memory segment holding an array of T. The creating process owns the
+    name and unlinks it when the segment is destroyed, so nothing is left in /dev/shm.
+*/
+template<typename T>
+class SharedSegment
+{
+public:
+
+    explicit SharedSegment(std::size_t count)
+        : count(count)
+    {
+        static std::atomic<unsigned> segments{ 0 };
+        name = "/functionalcpp-" + std::to_string(::getpid()) + "-" + std::to_string(segments++);
+
+        const auto descriptor = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+        if (descriptor == -1)
+            throw std::system_error{ errno, std::generic_category(), "Unable to create " + name };
+
+        const auto bytes = std::max<std::size_t>(1, count) * sizeof(T);
+        if (::ftruncate(descriptor, static_cast<off_t>(bytes)) == -1)
+        {
+            const auto error = errno;
+            ::close(descriptor);
+            ::shm_unlink(name.c_str());
+            throw std::system_error{ error, std::generic_category(), "Unable to size " + name };
+        }
+
+        address = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+        ::close(descriptor);
+
+        if (address == MAP_FAILED)
+        {
+            const auto error = errno;
+            ::shm_unlink(name.c_str());
+            throw std::system_error{ error, std::generic_category(), "Unable to map " + name };
+        }
+
+        for (std::size_t i = 0; i < count; ++i)
+            new (data() + i) T{};
+    }
+
+    SharedSegment(const SharedSegment&) = delete;
+    SharedSegment& operator=(const SharedSegment&) = delete;
+
+    ~SharedSegment()
+    {
+        for (std::size_t i = 0; i < count; ++i)
+            data()[i].~T();
+
+        ::munmap(address, std::max<std::size_t>(1, count) * sizeof(T));
+        ::shm_unlink(name.c_str());
+    }
+
+    T* data()
+    {
+        return static_cast<T*>(address);
+    }
+
+    T& operator[](std::size_t i)
+    {
+        assert(i < count);
+        return data()[i];
+    }
+
+private:
+
+    std::string name{};
+    std::size_t count{};
+    void* address{};
+};
+
+/*
+    A value that one process publishes for another through shared memory. The flag is
+    only set once the value has been written, so a reader that sees it set (with acquire
+    ordering) sees the whole value. Each slot gets its own cache line.
+*/
+template<typename T>
+struct alignas(CacheLineSize) PublishedSlot
+{
+    std::atomic<std::uint32_t> published;
+    T value;
+
+    void Publish(const T& item)
+    {
+        value = item;
+        published.store(1, std::memory_order_release);
+    }
+
+    bool IsPublished() const
+    {
+        return published.load(std::memory_order_acquire) == 1;
+    }
+};
+
+/*
+    Reduces [begin, end) using separate worker processes instead of threads.
+
+    Each worker is forked with the dataset already in its address space (an mmapped file
+    is shared, not copied), folds its shard sequentially, publishes the partial result in
+    its own cache-line sized slot of a shared memory segment, and exits. The coordinator
+    waits for the workers, then combines the partials pairwise in a tree, keeping them
+    in order so non-commutative monoids reduce the same way they would sequentially.
+
+    A worker that crashes or gets killed only loses its own shard: the coordinator sees
+    that the slot was never published and folds that shard itself.
+
+    Partials cross a process boundary, so the value type has to be trivially copyable.
+    As with Reduce, init is used to start every shard, so it has to be the identity.
+*/
+template<typename Iterator, typename Value, typename BinaryOp>
+auto ProcessReduce(Iterator begin, Iterator end, Value init, BinaryOp combine, std::size_t processes)
+{
+    static_assert(std::is_trivially_copyable_v<Value>,
+        "Partials are published through shared memory, so they have to be trivially copyable");
+
+    const auto count = static_cast<std::size_t>(std::distance(begin, end));
+    processes = std::max<std::size_t>(1, std::min(processes, count));
+
+    const auto shardBegin = [&](std::size_t shard) { return std::next(begin, count * shard / processes); };
+    const auto foldShard = [&](std::size_t shard)
+    {
+        return std::accumulate(shardBegin(shard), shardBegin(shard + 1), init, combine);
+    };
+
+    SharedSegment<PublishedSlot<Value>> slots{ processes };
+    std::vector<pid_t> workers(processes, -1);
+
+    for (std::size_t shard = 0; shard < processes; ++shard)
+    {
+        const auto pid = ::fork();
+        if (pid == 0)
+        {
+            // A throwing combine must not unwind into the caller's program. The shard just
+            // stays unpublished, and the coordinator folds it itself.
+            auto status = 0;
+            try
+            {
+                slots[shard].Publish(foldShard(shard));
+            }
+            catch (...)
+            {
+                status = 1;
+            }
+
+            // Skip the parent's atexit handlers and destructors, they aren't ours to run
+            ::_exit(status);
+        }
+
+        // If fork fails, the coordinator just does the shard itself
+        workers[shard] = pid;
+    }
+
+    std::vector<Value> partials{};
+    partials.reserve(processes);
+
+    for (std::size_t shard = 0; shard < processes; ++shard)
+    {
+        if (workers[shard] > 0)
+        {
+            auto status = 0;
+            while (::waitpid(workers[shard], &status, 0) == -1 && errno == EINTR) {}
+        }
+
+        if (slots[shard].IsPublished())
+            partials.push_back(slots[shard].value);
+        else
+            partials.push_back(foldShard(shard));
+    }
+
+    // Combine neighbouring partials until only one is left
+    for (std::size_t width = 1; width < partials.size(); width *= 2)
+    {
+        for (std::size_t i = 0; i + width < partials.size(); i += 2 * width)
+            partials[i] = combine(partials[i], partials[i + width]);
+    }
+
+    return partials.empty() ? init : partials.front();
+}
+
+}
+
+#endif
@@ -0,0 +1,509 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "cpu_dispatch.h"
+#include "streaming.h"
+
+namespace Monoids
+{
+/*
+    Vectorized versions of the fold kernels, one per instruction set, and the table that
+    picks between them at run time.
+
+    Every instruction set gets a small traits struct per element type that knows how to
+    load, broadcast and store a vector and how to apply each combine to two of them. The
+    kernel folds four vectors at a time into four independent accumulators, then spills
+    them to memory and finishes with the scalar combine, so the lanes are combined in
+    order and any leftover elements are folded in after them.
+
+    The kernel is written out once per instruction set rather than shared, because GCC
+    and Clang only allow the intrinsics inside functions compiled for that instruction set.
+*/
+namespace Kernels
+{
+    /*
+        The combines the vector kernels know about
+    */
+    enum class OperationKind
+    {
+        Add,
+        Multiply,
+        Minimum,
+        Maximum,
+        And,
+        Or,
+        Xor,
+    };
+
+    template<typename T>
+    using FoldKernel = T(*)(const T*, const T*, const StreamingOptions&);
+
+    namespace Detail
+    {
+        /*
+            Folds the spilled accumulator lanes in order, then whatever didn't fill a block
+        */
+        template<typename Op, typename T, std::size_t Count>
+        T FinishFold(const T(&lanes)[Count], const T* first, const T* last)
+        {
+            auto result = Op::Identity();
+
+            for (const auto lane : lanes)
+                result = Op::Combine(result, lane);
+
+            for (; first != last; ++first)
+                result = Op::Combine(result, *first);
+
+            return result;
+        }
+
+        template<typename T>
+        constexpr bool IsVectorInteger = std::is_integral_v<T> && !std::is_same_v<T, bool> && (sizeof(T) == 4 || sizeof(T) == 8);
+
+        /*
+            What every instruction set can do with 32 and 64 bit integers. Multiplying
+            64 bit integers, and min or max on them, need AVX-512.
+        */
+        template<typename T>
+        constexpr bool IntegerSupports(OperationKind kind, bool wide)
+        {
+            switch (kind)
+            {
+            case OperationKind::Multiply:
+            case OperationKind::Minimum:
+            case OperationKind::Maximum:
+                return sizeof(T) == 4 || (wide && kind != OperationKind::Multiply);
+            default:
+                return true;
+            }
+        }
+
+        constexpr bool FloatSupports(OperationKind kind)
+        {
+            return kind == OperationKind::Add || kind == OperationKind::Multiply ||
+                kind == OperationKind::Minimum || kind == OperationKind::Maximum;
+        }
+    }
+
+#if defined(FUNCTIONALCPP_X86)
+
+    /*
+        SSE4.2, 128 bit vectors
+    */
+    template<typename T, typename = void>
+    struct Sse42Vector
+    {
+        static constexpr bool Supports(OperationKind) { return false; }
+    };
+
+    template<>
+    struct Sse42Vector<float>
+    {
+        using Vector = __m128;
+        static constexpr std::size_t Width = 4;
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::FloatSupports(kind); }
+
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Load(const float* values) { return _mm_loadu_ps(values); }
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Splat(float value) { return _mm_set1_ps(value); }
+        FUNCTIONALCPP_TARGET("sse4.2") static void Store(float* values, Vector vector) { _mm_storeu_ps(values, vector); }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Apply(Vector accumulator, Vector values)
+        {
+            if constexpr (Kind == OperationKind::Add) return _mm_add_ps(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm_mul_ps(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return _mm_min_ps(values, accumulator);
+            else return _mm_max_ps(values, accumulator);
+        }
+    };
+
+    template<>
+    struct Sse42Vector<double>
+    {
+        using Vector = __m128d;
+        static constexpr std::size_t Width = 2;
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::FloatSupports(kind); }
+
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Load(const double* values) { return _mm_loadu_pd(values); }
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Splat(double value) { return _mm_set1_pd(value); }
+        FUNCTIONALCPP_TARGET("sse4.2") static void Store(double* values, Vector vector) { _mm_storeu_pd(values, vector); }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Apply(Vector accumulator, Vector values)
+        {
+            if constexpr (Kind == OperationKind::Add) return _mm_add_pd(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm_mul_pd(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return _mm_min_pd(values, accumulator);
+            else return _mm_max_pd(values, accumulator);
+        }
+    };
+
+    template<typename T>
+    struct Sse42Vector<T, std::enable_if_t<Detail::IsVectorInteger<T>>>
+    {
+        using Vector = __m128i;
+        static constexpr std::size_t Width = 16 / sizeof(T);
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::IntegerSupports<T>(kind, false); }
+
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Load(const T* values) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(values)); }
+        FUNCTIONALCPP_TARGET("sse4.2") static void Store(T* values, Vector vector) { _mm_storeu_si128(reinterpret_cast<__m128i*>(values), vector); }
+
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Splat(T value)
+        {
+            if constexpr (sizeof(T) == 4) return _mm_set1_epi32(static_cast<int>(value));
+            else return _mm_set1_epi64x(static_cast<long long>(value));
+        }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("sse4.2") static Vector Apply(Vector accumulator, Vector values)
+        {
+            constexpr auto Narrow = sizeof(T) == 4;
+            constexpr auto Signed = std::is_signed_v<T>;
+
+            if constexpr (Kind == OperationKind::Add) return Narrow ? _mm_add_epi32(accumulator, values) : _mm_add_epi64(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm_mullo_epi32(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return Signed ? _mm_min_epi32(accumulator, values) : _mm_min_epu32(accumulator, values);
+            else if constexpr (Kind == OperationKind::Maximum) return Signed ? _mm_max_epi32(accumulator, values) : _mm_max_epu32(accumulator, values);
+            else if constexpr (Kind == OperationKind::And) return _mm_and_si128(accumulator, values);
+            else if constexpr (Kind == OperationKind::Or) return _mm_or_si128(accumulator, values);
+            else return _mm_xor_si128(accumulator, values);
+        }
+    };
+
+    /*
+        AVX2, 256 bit vectors
+    */
+    template<typename T, typename = void>
+    struct Avx2Vector
+    {
+        static constexpr bool Supports(OperationKind) { return false; }
+    };
+
+    template<>
+    struct Avx2Vector<float>
+    {
+        using Vector = __m256;
+        static constexpr std::size_t Width = 8;
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::FloatSupports(kind); }
+
+        FUNCTIONALCPP_TARGET("avx2") static Vector Load(const float* values) { return _mm256_loadu_ps(values); }
+        FUNCTIONALCPP_TARGET("avx2") static Vector Splat(float value) { return _mm256_set1_ps(value); }
+        FUNCTIONALCPP_TARGET("avx2") static void Store(float* values, Vector vector) { _mm256_storeu_ps(values, vector); }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("avx2") static Vector Apply(Vector accumulator, Vector values)
+        {
+            if constexpr (Kind == OperationKind::Add) return _mm256_add_ps(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm256_mul_ps(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return _mm256_min_ps(values, accumulator);
+            else return _mm256_max_ps(values, accumulator);
+        }
+    };
+
+    template<>
+    struct Avx2Vector<double>
+    {
+        using Vector = __m256d;
+        static constexpr std::size_t Width = 4;
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::FloatSupports(kind); }
+
+        FUNCTIONALCPP_TARGET("avx2") static Vector Load(const double* values) { return _mm256_loadu_pd(values); }
+        FUNCTIONALCPP_TARGET("avx2") static Vector Splat(double value) { return _mm256_set1_pd(value); }
+        FUNCTIONALCPP_TARGET("avx2") static void Store(double* values, Vector vector) { _mm256_storeu_pd(values, vector); }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("avx2") static Vector Apply(Vector accumulator, Vector values)
+        {
+            if constexpr (Kind == OperationKind::Add) return _mm256_add_pd(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm256_mul_pd(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return _mm256_min_pd(values, accumulator);
+            else return _mm256_max_pd(values, accumulator);
+        }
+    };
+
+    template<typename T>
+    struct Avx2Vector<T, std::enable_if_t<Detail::IsVectorInteger<T>>>
+    {
+        using Vector = __m256i;
+        static constexpr std::size_t Width = 32 / sizeof(T);
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::IntegerSupports<T>(kind, false); }
+
+        FUNCTIONALCPP_TARGET("avx2") static Vector Load(const T* values) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values)); }
+        FUNCTIONALCPP_TARGET("avx2") static void Store(T* values, Vector vector) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(values), vector); }
+
+        FUNCTIONALCPP_TARGET("avx2") static Vector Splat(T value)
+        {
+            if constexpr (sizeof(T) == 4) return _mm256_set1_epi32(static_cast<int>(value));
+            else return _mm256_set1_epi64x(static_cast<long long>(value));
+        }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("avx2") static Vector Apply(Vector accumulator, Vector values)
+        {
+            constexpr auto Narrow = sizeof(T) == 4;
+            constexpr auto Signed = std::is_signed_v<T>;
+
+            if constexpr (Kind == OperationKind::Add) return Narrow ? _mm256_add_epi32(accumulator, values) : _mm256_add_epi64(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm256_mullo_epi32(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return Signed ? _mm256_min_epi32(accumulator, values) : _mm256_min_epu32(accumulator, values);
+            else if constexpr (Kind == OperationKind::Maximum) return Signed ? _mm256_max_epi32(accumulator, values) : _mm256_max_epu32(accumulator, values);
+            else if constexpr (Kind == OperationKind::And) return _mm256_and_si256(accumulator, values);
+            else if constexpr (Kind == OperationKind::Or) return _mm256_or_si256(accumulator, values);
+            else return _mm256_xor_si256(accumulator, values);
+        }
+    };
+
+    /*
+        AVX-512 (just the foundation subset), 512 bit vectors. Min and max are written as
+        their masked forms with every lane selected: the plain forms pass an undefined
+        vector through to the masked builtin, which GCC warns about as uninitialized.
+    */
+    template<typename T, typename = void>
+    struct Avx512Vector
+    {
+        static constexpr bool Supports(OperationKind) { return false; }
+    };
+
+    template<>
+    struct Avx512Vector<float>
+    {
+        using Vector = __m512;
+        static constexpr std::size_t Width = 16;
+        static constexpr __mmask16 AllLanes = 0xFFFF;
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::FloatSupports(kind); }
+
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Load(const float* values) { return _mm512_loadu_ps(values); }
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Splat(float value) { return _mm512_set1_ps(value); }
+        FUNCTIONALCPP_TARGET("avx512f") static void Store(float* values, Vector vector) { _mm512_storeu_ps(values, vector); }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Apply(Vector accumulator, Vector values)
+        {
+            if constexpr (Kind == OperationKind::Add) return _mm512_add_ps(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm512_mul_ps(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return _mm512_mask_min_ps(accumulator, AllLanes, values, accumulator);
+            else return _mm512_mask_max_ps(accumulator, AllLanes, values, accumulator);
+        }
+    };
+
+    template<>
+    struct Avx512Vector<double>
+    {
+        using Vector = __m512d;
+        static constexpr std::size_t Width = 8;
+        static constexpr __mmask8 AllLanes = 0xFF;
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::FloatSupports(kind); }
+
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Load(const double* values) { return _mm512_loadu_pd(values); }
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Splat(double value) { return _mm512_set1_pd(value); }
+        FUNCTIONALCPP_TARGET("avx512f") static void Store(double* values, Vector vector) { _mm512_storeu_pd(values, vector); }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Apply(Vector accumulator, Vector values)
+        {
+            if constexpr (Kind == OperationKind::Add) return _mm512_add_pd(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply) return _mm512_mul_pd(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum) return _mm512_mask_min_pd(accumulator, AllLanes, values, accumulator);
+            else return _mm512_mask_max_pd(accumulator, AllLanes, values, accumulator);
+        }
+    };
+
+    template<typename T>
+    struct Avx512Vector<T, std::enable_if_t<Detail::IsVectorInteger<T>>>
+    {
+        using Vector = __m512i;
+        static constexpr std::size_t Width = 64 / sizeof(T);
+        static constexpr std::uint16_t AllLanes = static_cast<std::uint16_t>((1u << Width) - 1);
+
+        static constexpr bool Supports(OperationKind kind) { return Detail::IntegerSupports<T>(kind, true); }
+
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Load(const T* values) { return _mm512_loadu_si512(values); }
+        FUNCTIONALCPP_TARGET("avx512f") static void Store(T* values, Vector vector) { _mm512_storeu_si512(values, vector); }
+
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Splat(T value)
+        {
+            if constexpr (sizeof(T) == 4) return _mm512_set1_epi32(static_cast<int>(value));
+            else return _mm512_set1_epi64(static_cast<long long>(value));
+        }
+
+        template<OperationKind Kind>
+        FUNCTIONALCPP_TARGET("avx512f") static Vector Apply(Vector accumulator, Vector values)
+        {
+            constexpr auto Narrow = sizeof(T) == 4;
+            constexpr auto Signed = std::is_signed_v<T>;
+
+            if constexpr (Kind == OperationKind::Add)
+                return Narrow ? _mm512_add_epi32(accumulator, values) : _mm512_add_epi64(accumulator, values);
+            else if constexpr (Kind == OperationKind::Multiply)
+                return _mm512_mullo_epi32(accumulator, values);
+            else if constexpr (Kind == OperationKind::Minimum)
+                return Narrow ? (Signed ? _mm512_mask_min_epi32(accumulator, AllLanes, accumulator, values) : _mm512_mask_min_epu32(accumulator, AllLanes, accumulator, values))
+                    : (Signed ? _mm512_mask_min_epi64(accumulator, AllLanes, accumulator, values) : _mm512_mask_min_epu64(accumulator, AllLanes, accumulator, values));
+            else if constexpr (Kind == OperationKind::Maximum)
+                return Narrow ? (Signed ? _mm512_mask_max_epi32(accumulator, AllLanes, accumulator, values) : _mm512_mask_max_epu32(accumulator, AllLanes, accumulator, values))
+                    : (Signed ? _mm512_mask_max_epi64(accumulator, AllLanes, accumulator, values) : _mm512_mask_max_epu64(accumulator, AllLanes, accumulator, values));
+            else if constexpr (Kind == OperationKind::And) return _mm512_and_si512(accumulator, values);
+            else if constexpr (Kind == OperationKind::Or) return _mm512_or_si512(accumulator, values);
+            else return _mm512_xor_si512(accumulator, values);
+        }
+    };
+
+    /*
+        The kernels. Each block is four vectors, and the prefetches cover every cache
+        line of the block that's options.prefetchBytes ahead.
+    */
+    template<typename Op, typename T>
+    FUNCTIONALCPP_TARGET("sse4.2") T Sse42Fold(const T* first, const T* last, const StreamingOptions& options)
+    {
+        using V = Sse42Vector<T>;
+        constexpr auto Block = 4 * V::Width;
+
+        auto a0 = V::Splat(Op::Identity()), a1 = a0, a2 = a0, a3 = a0;
+
+        for (; static_cast<std::size_t>(last - first) >= Block; first += Block)
+        {
+            PrefetchBlock(first, Block * sizeof(T), options);
+
+            a0 = V::template Apply<Op::kind>(a0, V::Load(first));
+            a1 = V::template Apply<Op::kind>(a1, V::Load(first + V::Width));
+            a2 = V::template Apply<Op::kind>(a2, V::Load(first + 2 * V::Width));
+            a3 = V::template Apply<Op::kind>(a3, V::Load(first + 3 * V::Width));
+        }
+
+        T lanes[Block];
+        V::Store(lanes, a0);
+        V::Store(lanes + V::Width, a1);
+        V::Store(lanes + 2 * V::Width, a2);
+        V::Store(lanes + 3 * V::Width, a3);
+
+        return Detail::FinishFold<Op>(lanes, first, last);
+    }
+
+    template<typename Op, typename T>
+    FUNCTIONALCPP_TARGET("avx2") T Avx2Fold(const T* first, const T* last, const StreamingOptions& options)
+    {
+        using V = Avx2Vector<T>;
+        constexpr auto Block = 4 * V::Width;
+
+        auto a0 = V::Splat(Op::Identity()), a1 = a0, a2 = a0, a3 = a0;
+
+        for (; static_cast<std::size_t>(last - first) >= Block; first += Block)
+        {
+            PrefetchBlock(first, Block * sizeof(T), options);
+
+            a0 = V::template Apply<Op::kind>(a0, V::Load(first));
+            a1 = V::template Apply<Op::kind>(a1, V::Load(first + V::Width));
+            a2 = V::template Apply<Op::kind>(a2, V::Load(first + 2 * V::Width));
+            a3 = V::template Apply<Op::kind>(a3, V::Load(first + 3 * V::Width));
+        }
+
+        T lanes[Block];
+        V::Store(lanes, a0);
+        V::Store(lanes + V::Width, a1);
+        V::Store(lanes + 2 * V::Width, a2);
+        V::Store(lanes + 3 * V::Width, a3);
+
+        return Detail::FinishFold<Op>(lanes, first, last);
+    }
+
+    template<typename Op, typename T>
+    FUNCTIONALCPP_TARGET("avx512f") T Avx512Fold(const T* first, const T* last, const StreamingOptions& options)
+    {
+        using V = Avx512Vector<T>;
+        constexpr auto Block = 4 * V::Width;
+
+        auto a0 = V::Splat(Op::Identity()), a1 = a0, a2 = a0, a3 = a0;
+
+        for (; static_cast<std::size_t>(last - first) >= Block; first += Block)
+        {
+            PrefetchBlock(first, Block * sizeof(T), options);
+
+            a0 = V::template Apply<Op::kind>(a0, V::Load(first));
+            a1 = V::template Apply<Op::kind>(a1, V::Load(first + V::Width));
+            a2 = V::template Apply<Op::kind>(a2, V::Load(first + 2 * V::Width));
+            a3 = V::template Apply<Op::kind>(a3, V::Load(first + 3 * V::Width));
+        }
+
+        T lanes[Block];
+        V::Store(lanes, a0);
+        V::Store(lanes + V::Width, a1);
+        V::Store(lanes + 2 * V::Width, a2);
+        V::Store(lanes + 3 * V::Width, a3);
+
+        return Detail::FinishFold<Op>(lanes, first, last);
+    }
+
+#endif
+
+    /*
+        The best kernel for isa, or nullptr when no instruction set up to isa has one for
+        this combine and element type.
+    */
+    template<typename Op, typename T>
+    FoldKernel<T> SelectFoldKernel(Isa isa)
+    {
+#if defined(FUNCTIONALCPP_X86)
+        if constexpr (Avx512Vector<T>::Supports(Op::kind))
+        {
+            if (isa >= Isa::Avx512)
+                return &Avx512Fold<Op, T>;
+        }
+
+        if constexpr (Avx2Vector<T>::Supports(Op::kind))
+        {
+            if (isa >= Isa::Avx2)
+                return &Avx2Fold<Op, T>;
+        }
+
+        if constexpr (Sse42Vector<T>::Supports(Op::kind))
+        {
+            if (isa >= Isa::Sse42)
+                return &Sse42Fold<Op, T>;
+        }
+#else
+        (void)isa;
+#endif
+        return nullptr;
+    }
+
+    /*
+        The dispatch table: one entry per instruction set for every combine and element
+        type, filled in the first time that combine and type are folded.
+    */
+    template<typename Op, typename T>
+    FoldKernel<T> VectorFoldKernel(Isa isa)
+    {
+        static const FoldKernel<T> table[] =
+        {
+            SelectFoldKernel<Op, T>(Isa::Scalar),
+            SelectFoldKernel<Op, T>(Isa::Sse42),
+            SelectFoldKernel<Op, T>(Isa::Avx2),
+            SelectFoldKernel<Op, T>(Isa::Avx512),
+        };
+
+        return table[static_cast<std::size_t>(isa < DetectedIsa() ? isa : DetectedIsa())];
+    }
+
+    /*
+        Everything about how a kernel runs that can be tuned, so a caller can choose it per
+        reduction. The tuner keeps one of these per reduction in the machine's profile.
+    */
+    struct KernelOptions
+    {
+        Isa isa = SelectedIsa();
+        StreamingOptions streaming{};
+    };
+}
+
+}
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <assert.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "standard_monoids.h"
+
+namespace Monoids
+{
+/*
+    Sliding window aggregation keeps the fold of a FIFO window: values are inserted at
+    the back, evicted from the front, and the fold of whatever is currently inside can
+    be asked for at any time. If the monoid had an inverse (like addition) evicting could
+    just subtract the value, but max, min and string concatenation don't have one, so the
+    fold has to be maintained without ever "undoing" a combine.
+
+    Both aggregators below only rely on associativity and keep the order of the values,
+    so non-commutative monoids work too. They share the same interface:
+
+        Insert(value)   push a value on the back of the window
+        Evict()         drop the oldest value
+        Query()         the fold of the window, oldest to newest
+*/
+
+/*
+    The two-stacks algorithm. The back stack keeps a running fold of everything inserted
+    since the last flip, and the front stack keeps, for every element, the fold from that
+    element to the end of the front stack. The window's fold is then front + back.
+
+    When the front stack runs out, the back stack is flipped onto it, computing the
+    suffix folds on the way. Every value is flipped once, so insert and evict are
+    amortized O(1), but a single evict can take O(n).
+*/
+template<typename MonoidType>
+class TwoStacksAggregator
+{
+public:
+
+    using ValueType = typename MonoidType::ValueType;
+
+    explicit TwoStacksAggregator(MonoidType monoid = {})
+        : monoid(std::move(monoid)), backFold(this->monoid.identity)
+    {
+    }
+
+    void Insert(ValueType value)
+    {
+        backFold = monoid(backFold, value);
+        back.emplace_back(std::move(value));
+    }
+
+    void Evict()
+    {
+        assert(!Empty());
+
+        if (front.empty())
+            Flip();
+
+        front.pop_back();
+    }
+
+    ValueType Query() const
+    {
+        if (front.empty())
+            return backFold;
+
+        return monoid(front.back().fold, backFold);
+    }
+
+    std::size_t Size() const
+    {
+        return front.size() + back.size();
+    }
+
+    bool Empty() const
+    {
+        return front.empty() && back.empty();
+    }
+
+private:
+
+    struct Entry
+    {
+        ValueType value;
+        ValueType fold;
+    };
+
+    /*
+        Moves the back stack onto the front stack so the oldest value ends up on top.
+    */
+    void Flip()
+    {
+        auto fold = monoid.identity;
+        front.reserve(back.size());
+
+        for (auto it = back.rbegin(); it != back.rend(); ++it)
+        {
+            fold = monoid(*it, fold);
+            front.push_back({ std::move(*it), fold });
+        }
+
+        back.clear();
+        backFold = monoid.identity;
+    }
+
+private:
+
+    MonoidType monoid{};
+    std::vector<Entry> front{};
+    std::vector<ValueType> back{};
+    ValueType backFold{};
+};
+
+/*
+    DABA, the De-Amortized Banker's Aggregator (Tangwongsan, Hirzel and Schneider).
+    It's the two-stacks algorithm with the flip spread across the operations that lead
+    up to it: every insert and evict does a constant amount of the reversal, so both
+    operations are O(1) in the worst case, with a constant number of combines. This is the
+    one to use when a latency spike on the evict that triggers a flip isn't acceptable.
+
+    The values live in a single deque, split into five consecutive sub-lists by the
+    positions F <= L <= R <= A <= B <= E, where each entry keeps a partial fold:
+
+        [F, L)  fold from the entry up to B             (finished front)
+        [L, R)  fold from the entry up to R             (old front, being extended)
+        [R, A)  fold from R up to the entry             (old back, being reversed)
+        [A, B)  fold from the entry up to B             (reversed back)
+        [B, E)  fold from B up to the entry             (back)
+
+    Positions are absolute (they keep increasing as values are evicted), so they stay
+    valid while the deque shifts underneath them.
+*/
+template<typename MonoidType>
+class DabaAggregator
+{
+public:
+
+    using ValueType = typename MonoidType::ValueType;
+
+    explicit DabaAggregator(MonoidType monoid = {})
+        : monoid(std::move(monoid))
+    {
+    }
+
+    void Insert(ValueType value)
+    {
+        auto fold = monoid(BackFold(), value);
+        entries.push_back({ std::move(value), std::move(fold) });
+        ++e;
+
+        Fixup();
+    }
+
+    void Evict()
+    {
+        assert(!Empty());
+
+        entries.pop_front();
+        ++f;
+
+        Fixup();
+    }
+
+    ValueType Query() const
+    {
+        return monoid(FrontFold(), BackFold());
+    }
+
+    std::size_t Size() const
+    {
+        return entries.size();
+    }
+
+    bool Empty() const
+    {
+        return entries.empty();
+    }
+
+private:
+
+    struct Entry
+    {
+        ValueType value;
+        ValueType fold;
+    };
+
+    Entry& At(std::uint64_t position)
+    {
+        return entries[static_cast<std::size_t>(position - f)];
+    }
+
+    const Entry& At(std::uint64_t position) const
+    {
+        return entries[static_cast<std::size_t>(position - f)];
+    }
+
+    ValueType FrontFold() const
+    {
+        return f == b ? monoid.identity : At(f).fold;
+    }
+
+    ValueType BackFold() const
+    {
+        return b == e ? monoid.identity : At(e - 1).fold;
+    }
+
+    ValueType RightFold() const
+    {
+        return r == a ? monoid.identity : At(a - 1).fold;
+    }
+
+    ValueType ReversedFold() const
+    {
+        return a == b ? monoid.identity : At(a).fold;
+    }
+
+    /*
+        Restores the size invariants after an insert or evict by doing one step of the
+        incremental flip: either start a new flip, move a finished element over, or
+        extend one element of the old front and reverse one element of the old back.
+    */
+    void Fixup()
+    {
+        if (f == b)
+        {
+            b = a = r = l = e;
+            return;
+        }
+
+        if (l == b)
+        {
+            l = f;
+            a = e;
+            b = e;
+        }
+
+        if (l == r)
+        {
+            ++a;
+            ++r;
+            ++l;
+        }
+        else
+        {
+            auto& front = At(l);
+            front.fold = monoid(monoid(front.fold, RightFold()), ReversedFold());
+            ++l;
+
+            auto& reversed = At(a - 1);
+            reversed.fold = monoid(reversed.value, ReversedFold());
+            --a;
+        }
+    }
+
+private:
+
+    MonoidType monoid{};
+    std::deque<Entry> entries{};
+
+    std::uint64_t f{};
+    std::uint64_t l{};
+    std::uint64_t r{};
+    std::uint64_t a{};
+    std::uint64_t b{};
+    std::uint64_t e{};
+};
+
+/*
+    A window over the last `capacity` values of a stream.
+*/
+template<typename Aggregator>
+class CountWindow
+{
+public:
+
+    using ValueType = typename Aggregator::ValueType;
+
+    explicit CountWindow(std::size_t capacity, Aggregator aggregator = Aggregator{})
+        : capacity(capacity), aggregator(std::move(aggregator))
+    {
+        assert(capacity > 0);
+    }
+
+    void Push(ValueType value)
+    {
+        if (aggregator.Size() == capacity)
+            aggregator.Evict();
+
+        aggregator.Insert(std::move(value));
+    }
+
+    ValueType Query() const
+    {
+        return aggregator.Query();
+    }
+
+    std::size_t Size() const
+    {
+        return aggregator.Size();
+    }
+
+private:
+
+    std::size_t capacity{};
+    Aggregator aggregator{};
+};
+
+/*
+    A window over the values of a stream that arrived in the last `span` of time.
+    Timestamps have to be pushed in non-decreasing order. Values expire when the
+    window is advanced, either by a push or by an explicit call with the current time.
+*/
+template<typename Aggregator, typename Clock = std::chrono::steady_clock>
+class TimeWindow
+{
+public:
+
+    using ValueType = typename Aggregator::ValueType;
+    using TimePoint = typename Clock::time_point;
+    using Duration = typename Clock::duration;
+
+    explicit TimeWindow(Duration span, Aggregator aggregator = Aggregator{})
+        : span(span), aggregator(std::move(aggregator))
+    {
+    }
+
+    void Push(TimePoint time, ValueType value)
+    {
+        assert(timestamps.empty() || timestamps.back() <= time);
+
+        Advance(time);
+        timestamps.push_back(time);
+        aggregator.Insert(std::move(value));
+    }
+
+    /*
+        Evicts every value that is older than `span` at the given time.
+    */
+    void Advance(TimePoint now)
+    {
+        while (!timestamps.empty() && timestamps.front() + span <= now)
+        {
+            timestamps.pop_front();
+            aggregator.Evict();
+        }
+    }
+
+    ValueType Query() const
+    {
+        return aggregator.Query();
+    }
+
+    std::size_t Size() const
+    {
+        return aggregator.Size();
+    }
+
+private:
+
+    Duration span{};
+    Aggregator aggregator{};
+    std::deque<TimePoint> timestamps{};
+};
+
+}
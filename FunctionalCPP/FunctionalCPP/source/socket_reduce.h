@@ -0,0 +1,795 @@
+#pragma once
+
+/*
+    The socket based reduction uses BSD sockets and, for the loopback harness, fork,
+    so it's only available on POSIX systems.
+*/
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <assert.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "auto_tuner.h"
+#include "fork_join.h"
+#include "serialization.h"
+#include "shared_memory_reduce.h"
+
+namespace Monoids
+{
+struct Address
+{
+    std::string host;
+    std::uint16_t port;
+};
+
+/*
+    An owning TCP socket descriptor. Sends and receives always transfer the whole buffer.
+*/
+class Socket
+{
+public:
+
+    Socket() = default;
+
+    explicit Socket(int descriptor)
+        : descriptor(descriptor)
+    {
+    }
+
+    Socket(Socket&& other) noexcept
+        : descriptor(std::exchange(other.descriptor, -1))
+    {
+    }
+
+    Socket& operator=(Socket&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Close();
+            descriptor = std::exchange(other.descriptor, -1);
+        }
+
+        return *this;
+    }
+
+    ~Socket()
+    {
+        Close();
+    }
+
+    /*
+        Creates a socket listening on the given address. A port of 0 picks any free port,
+        which can be read back with Port().
+    */
+    static Socket Listen(const Address& address, int backlog)
+    {
+        Socket listener{ ::socket(AF_INET, SOCK_STREAM, 0) };
+        if (!listener.IsOpen())
+            ThrowError("Unable to create a socket");
+
+        const int enable = 1;
+        ::setsockopt(listener.descriptor, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+        auto socketAddress = ToSocketAddress(address);
+        if (::bind(listener.descriptor, reinterpret_cast<sockaddr*>(&socketAddress), sizeof(socketAddress)) == -1)
+            ThrowError("Unable to bind to port " + std::to_string(address.port));
+
+        if (::listen(listener.descriptor, backlog) == -1)
+            ThrowError("Unable to listen on port " + std::to_string(address.port));
+
+        return listener;
+    }
+
+    /*
+        Connects to the given address, retrying until the timeout runs out since
+        the peer may not be listening yet.
+    */
+    static Socket Connect(const Address& address, std::chrono::milliseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        const auto socketAddress = ToSocketAddress(address);
+
+        for (;;)
+        {
+            Socket connection{ ::socket(AF_INET, SOCK_STREAM, 0) };
+            if (!connection.IsOpen())
+                ThrowError("Unable to create a socket");
+
+            if (::connect(connection.descriptor, reinterpret_cast<const sockaddr*>(&socketAddress), sizeof(socketAddress)) == 0)
+            {
+                connection.DisableNagle();
+                return connection;
+            }
+
+            if (std::chrono::steady_clock::now() >= deadline)
+                ThrowError("Unable to connect to " + address.host + ":" + std::to_string(address.port));
+
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+        }
+    }
+
+    /*
+        Waits for the next connection, but no longer than the timeout, since a peer that
+        never starts would otherwise hang this one forever
+    */
+    Socket Accept(std::chrono::milliseconds timeout) const
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+        for (;;)
+        {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+            pollfd listening{ descriptor, POLLIN, 0 };
+            const auto ready = ::poll(&listening, 1, static_cast<int>(std::max<std::chrono::milliseconds::rep>(0, remaining.count())));
+
+            if (ready > 0)
+                break;
+
+            if (ready == 0)
+                throw std::system_error{ std::make_error_code(std::errc::timed_out), "Timed out waiting for a connection" };
+
+            if (errno != EINTR)
+                ThrowError("Unable to wait for a connection");
+        }
+
+        Socket connection{};
+        do
+        {
+            connection = Socket{ ::accept(descriptor, nullptr, nullptr) };
+        } while (!connection.IsOpen() && errno == EINTR);
+
+        if (!connection.IsOpen())
+            ThrowError("Unable to accept a connection");
+
+        connection.DisableNagle();
+        return connection;
+    }
+
+    void SendAll(const void* data, std::size_t size) const
+    {
+#if defined(MSG_NOSIGNAL)
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            const auto sent = ::send(descriptor, bytes, size, flags);
+            if (sent == -1 && errno == EINTR)
+                continue;
+
+            if (sent <= 0)
+                ThrowError("Unable to send");
+
+            bytes += sent;
+            size -= static_cast<std::size_t>(sent);
+        }
+    }
+
+    void ReceiveAll(void* data, std::size_t size) const
+    {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            const auto received = ::recv(descriptor, bytes, size, 0);
+            if (received == -1 && errno == EINTR)
+                continue;
+
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                throw std::system_error{ std::make_error_code(std::errc::timed_out), "Timed out receiving" };
+
+            if (received == 0)
+                throw std::system_error{ std::make_error_code(std::errc::connection_reset), "Peer closed the connection" };
+
+            if (received < 0)
+                ThrowError("Unable to receive");
+
+            bytes += received;
+            size -= static_cast<std::size_t>(received);
+        }
+    }
+
+    /*
+        Makes a receive that waits longer than timeout for the next bytes fail instead
+    */
+    void SetReceiveTimeout(std::chrono::milliseconds timeout) const
+    {
+        timeval limit{};
+        limit.tv_sec = static_cast<decltype(limit.tv_sec)>(timeout.count() / 1000);
+        limit.tv_usec = static_cast<decltype(limit.tv_usec)>(timeout.count() % 1000 * 1000);
+
+        ::setsockopt(descriptor, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    }
+
+    std::uint16_t Port() const
+    {
+        sockaddr_in socketAddress{};
+        socklen_t length = sizeof(socketAddress);
+        ::getsockname(descriptor, reinterpret_cast<sockaddr*>(&socketAddress), &length);
+
+        return ntohs(socketAddress.sin_port);
+    }
+
+    bool IsOpen() const
+    {
+        return descriptor != -1;
+    }
+
+    void Close()
+    {
+        if (descriptor != -1)
+            ::close(std::exchange(descriptor, -1));
+    }
+
+private:
+
+    [[noreturn]] static void ThrowError(const std::string& message)
+    {
+        throw std::system_error{ errno, std::generic_category(), message };
+    }
+
+    static sockaddr_in ToSocketAddress(const Address& address)
+    {
+        sockaddr_in socketAddress{};
+        socketAddress.sin_family = AF_INET;
+        socketAddress.sin_port = htons(address.port);
+
+        if (::inet_pton(AF_INET, address.host.c_str(), &socketAddress.sin_addr) != 1)
+            throw std::system_error{ std::make_error_code(std::errc::invalid_argument), "Invalid IPv4 address " + address.host };
+
+        return socketAddress;
+    }
+
+    // Partials are tiny, so waiting to coalesce them only adds latency
+    void DisableNagle() const
+    {
+        const int enable = 1;
+        ::setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+
+private:
+
+    int descriptor{ -1 };
+};
+
+/*
+    A fully connected group of processes, one per address, where this process is `rank`.
+    Every pair of ranks shares one TCP connection: the higher rank connects to the lower
+    rank's listener and introduces itself by sending its rank.
+
+    The timeout bounds how long setting up the group may take, and how long any receive
+    waits for its peer, so a rank that dies or hangs makes the others fail instead of
+    waiting for it forever.
+
+    Trivially copyable values are sent as their raw bytes, and anything else is encoded
+    with its Serializer and sent with its length in front. Either way, every rank has to
+    agree on the layout of the values (same build, same architecture). A length over the
+    maximum message size is taken for a corrupt or out of sync stream and fails the
+    receive, rather than being allocated.
+*/
+class Communicator
+{
+public:
+
+    static constexpr std::uint64_t DefaultMaxMessageSize = std::uint64_t{ 1 } << 30;
+
+    Communicator(std::size_t rank, std::vector<Address> addresses,
+        std::chrono::milliseconds timeout = std::chrono::seconds{ 30 })
+        : Communicator(rank, addresses, Socket::Listen(addresses.at(rank), static_cast<int>(addresses.size())), timeout)
+    {
+    }
+
+    /*
+        Uses an already listening socket for this rank, which lets the loopback harness
+        bind every rank to a free port before any of them start.
+    */
+    Communicator(std::size_t rank, std::vector<Address> addresses, Socket listener,
+        std::chrono::milliseconds timeout = std::chrono::seconds{ 30 })
+        : rank(rank), addresses(std::move(addresses)), peers(this->addresses.size())
+    {
+        assert(rank < this->addresses.size());
+
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        const auto remaining = [deadline]
+        {
+            return std::max(std::chrono::milliseconds{ 0 },
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()));
+        };
+
+        for (auto peer = rank + 1; peer < Size(); ++peer)
+        {
+            (void)peer;
+
+            auto connection = listener.Accept(remaining());
+            connection.SetReceiveTimeout(timeout);
+
+            std::uint32_t peerRank = 0;
+            connection.ReceiveAll(&peerRank, sizeof(peerRank));
+
+            if (peerRank <= rank || peerRank >= Size() || peers[peerRank].IsOpen())
+                throw std::system_error{ std::make_error_code(std::errc::protocol_error), "Unexpected peer rank" };
+
+            peers[peerRank] = std::move(connection);
+        }
+
+        for (std::size_t peer = 0; peer < rank; ++peer)
+        {
+            peers[peer] = Socket::Connect(this->addresses[peer], remaining());
+            peers[peer].SetReceiveTimeout(timeout);
+
+            const auto self = static_cast<std::uint32_t>(rank);
+            peers[peer].SendAll(&self, sizeof(self));
+        }
+    }
+
+    std::size_t Rank() const
+    {
+        return rank;
+    }
+
+    std::size_t Size() const
+    {
+        return addresses.size();
+    }
+
+    template<typename T>
+    void Send(std::size_t peer, const T& value) const
+    {
+        if constexpr (std::is_trivially_copyable_v<T>)
+        {
+            Peer(peer).SendAll(&value, sizeof(T));
+        }
+        else
+        {
+            const auto encoded = Encode(value);
+            const auto size = static_cast<std::uint64_t>(encoded.size());
+
+            Peer(peer).SendAll(&size, sizeof(size));
+            Peer(peer).SendAll(encoded.data(), encoded.size());
+        }
+    }
+
+    template<typename T>
+    T Receive(std::size_t peer) const
+    {
+        if constexpr (std::is_trivially_copyable_v<T>)
+        {
+            T value;
+            Peer(peer).ReceiveAll(&value, sizeof(T));
+            return value;
+        }
+        else
+        {
+            std::uint64_t size = 0;
+            Peer(peer).ReceiveAll(&size, sizeof(size));
+
+            std::vector<unsigned char> encoded(CheckMessageSize(size));
+            Peer(peer).ReceiveAll(encoded.data(), encoded.size());
+            return Decode<T>(encoded);
+        }
+    }
+
+    /*
+        Sends to one peer while receiving from another (possibly the same) peer. Small
+        messages fit in the kernel's socket buffers, so sending first can't deadlock,
+        but large ones have to be sent and received at the same time.
+    */
+    void ExchangeBytes(std::size_t destination, const void* send, std::size_t sendSize,
+        std::size_t source, void* receive, std::size_t receiveSize) const
+    {
+        constexpr std::size_t bufferedSize = 32 * 1024;
+
+        if (sendSize <= bufferedSize && receiveSize <= bufferedSize)
+        {
+            Peer(destination).SendAll(send, sendSize);
+            Peer(source).ReceiveAll(receive, receiveSize);
+            return;
+        }
+
+        auto sending = std::async(std::launch::async, [&] { Peer(destination).SendAll(send, sendSize); });
+        Peer(source).ReceiveAll(receive, receiveSize);
+        sending.get();
+    }
+
+    template<typename T>
+    T Exchange(std::size_t peer, const T& value) const
+    {
+        if constexpr (std::is_trivially_copyable_v<T>)
+        {
+            T received;
+            ExchangeBytes(peer, &value, sizeof(T), peer, &received, sizeof(T));
+            return received;
+        }
+        else
+        {
+            // Swap sizes first so that both sides know how much is coming
+            const auto encoded = Encode(value);
+            const auto size = static_cast<std::uint64_t>(encoded.size());
+
+            std::uint64_t receivedSize = 0;
+            ExchangeBytes(peer, &size, sizeof(size), peer, &receivedSize, sizeof(receivedSize));
+
+            std::vector<unsigned char> received(CheckMessageSize(receivedSize));
+            ExchangeBytes(peer, encoded.data(), encoded.size(), peer, received.data(), received.size());
+            return Decode<T>(received);
+        }
+    }
+
+    /*
+        The largest encoded value a receive accepts from a peer
+    */
+    void SetMaxMessageSize(std::uint64_t size)
+    {
+        maxMessageSize = size;
+    }
+
+    std::uint64_t MaxMessageSize() const
+    {
+        return maxMessageSize;
+    }
+
+private:
+
+    const Socket& Peer(std::size_t peer) const
+    {
+        assert(peer != rank && peer < peers.size());
+        return peers[peer];
+    }
+
+    std::size_t CheckMessageSize(std::uint64_t size) const
+    {
+        if (size > maxMessageSize || size > std::numeric_limits<std::size_t>::max())
+            throw std::system_error{ std::make_error_code(std::errc::protocol_error), "Message larger than the maximum message size" };
+
+        return static_cast<std::size_t>(size);
+    }
+
+private:
+
+    std::size_t rank{};
+    std::vector<Address> addresses{};
+    std::vector<Socket> peers{};
+    std::uint64_t maxMessageSize = DefaultMaxMessageSize;
+};
+
+/*
+    Binomial tree reduction to rank 0 in log2(size) rounds. In each round, the ranks that
+    still hold a partial pair up, and the higher one sends to the lower one. A rank only
+    ever combines its own partial with the one covering the ranks right after it, so
+    the result is in rank order. Only rank 0's return value is the full reduction.
+*/
+template<typename Value, typename BinaryOp>
+Value TreeReduce(const Communicator& communicator, Value value, BinaryOp&& combine)
+{
+    const auto rank = communicator.Rank();
+    const auto size = communicator.Size();
+
+    for (std::size_t mask = 1; mask < size; mask *= 2)
+    {
+        if (rank & mask)
+        {
+            communicator.Send(rank - mask, value);
+            break;
+        }
+
+        if (rank + mask < size)
+            value = combine(value, communicator.Receive<Value>(rank + mask));
+    }
+
+    return value;
+}
+
+/*
+    Sends rank 0's value to every rank, down the same binomial tree TreeReduce uses.
+*/
+template<typename Value>
+Value Broadcast(const Communicator& communicator, Value value)
+{
+    const auto rank = communicator.Rank();
+    const auto size = communicator.Size();
+
+    std::size_t mask = 1;
+    while (mask < size)
+        mask *= 2;
+
+    for (mask /= 2; mask > 0; mask /= 2)
+    {
+        if (rank % (2 * mask) == 0 && rank + mask < size)
+            communicator.Send(rank + mask, value);
+        else if (rank % (2 * mask) == mask)
+            value = communicator.Receive<Value>(rank - mask);
+    }
+
+    return value;
+}
+
+/*
+    Allreduce by recursive doubling: in round k every rank swaps partials with the rank
+    that differs in bit k, so after log2(size) rounds everyone holds the full reduction.
+    That's the fewest rounds possible, which makes it the right choice for small partials
+    where latency dominates.
+
+    When size isn't a power of two, the first 2 * remainder ranks pair up beforehand
+    (odd into even) so that a power of two ranks take part, and the result is handed back
+    to the odd ranks at the end. Partners are always combined lower rank first, so the
+    result is in rank order and non-commutative monoids work.
+*/
+template<typename Value, typename BinaryOp>
+Value RecursiveDoublingAllReduce(const Communicator& communicator, Value value, BinaryOp&& combine)
+{
+    const auto rank = communicator.Rank();
+    const auto size = communicator.Size();
+
+    std::size_t powerOfTwo = 1;
+    while (powerOfTwo * 2 <= size)
+        powerOfTwo *= 2;
+
+    const auto remainder = size - powerOfTwo;
+    const auto paired = rank < 2 * remainder;
+
+    if (paired && rank % 2 == 1)
+    {
+        communicator.Send(rank - 1, value);
+        return communicator.Receive<Value>(rank - 1);
+    }
+
+    if (paired)
+        value = combine(value, communicator.Receive<Value>(rank + 1));
+
+    // Ranks taking part are renumbered 0..powerOfTwo - 1, keeping their order
+    const auto virtualRank = paired ? rank / 2 : rank - remainder;
+    const auto toRank = [remainder](std::size_t virtualPeer)
+    {
+        return virtualPeer < remainder ? 2 * virtualPeer : virtualPeer + remainder;
+    };
+
+    for (std::size_t mask = 1; mask < powerOfTwo; mask *= 2)
+    {
+        const auto virtualPeer = virtualRank ^ mask;
+        const auto other = communicator.Exchange(toRank(virtualPeer), value);
+
+        value = virtualPeer < virtualRank ? combine(other, value) : combine(value, other);
+    }
+
+    if (paired)
+        communicator.Send(rank + 1, value);
+
+    return value;
+}
+
+/*
+    Ring allreduce of a vector of partials, element by element (histograms, per-key
+    counters, gradients...). The vector is cut into `size` chunks. In the reduce-scatter
+    phase, each rank sends one chunk to its right neighbour and folds the chunk coming from
+    its left, so after size - 1 steps every rank owns one fully reduced chunk. The
+    allgather phase then passes the reduced chunks around the ring.
+
+    Every rank sends and receives about 2 * n values in total no matter how many ranks
+    there are, which is bandwidth optimal for large vectors. Each chunk is folded starting
+    from a different rank, so the monoid has to be commutative.
+*/
+template<typename T, typename BinaryOp>
+void RingAllReduce(const Communicator& communicator, std::vector<T>& values, BinaryOp&& combine)
+{
+    static_assert(std::is_trivially_copyable_v<T>, "Values are sent as raw bytes");
+
+    const auto rank = communicator.Rank();
+    const auto size = communicator.Size();
+    if (size == 1)
+        return;
+
+    const auto right = (rank + 1) % size;
+    const auto left = (rank + size - 1) % size;
+    const auto chunkBegin = [&](std::size_t chunk) { return values.size() * chunk / size; };
+    const auto chunkSize = [&](std::size_t chunk) { return chunkBegin(chunk + 1) - chunkBegin(chunk); };
+
+    std::vector<T> incoming(chunkSize(0) + 1);
+
+    for (std::size_t step = 0; step + 1 < size; ++step)
+    {
+        const auto sendChunk = (rank + size - step) % size;
+        const auto receiveChunk = (rank + size - step - 1) % size;
+
+        // The chunks can differ in size by one, and both sides agree on both sizes
+        std::vector<T> outgoing(values.begin() + chunkBegin(sendChunk), values.begin() + chunkBegin(sendChunk + 1));
+        outgoing.resize(incoming.size());
+        communicator.ExchangeBytes(right, outgoing.data(), outgoing.size() * sizeof(T),
+            left, incoming.data(), incoming.size() * sizeof(T));
+
+        for (std::size_t i = 0; i < chunkSize(receiveChunk); ++i)
+        {
+            auto& value = values[chunkBegin(receiveChunk) + i];
+            value = combine(incoming[i], value);
+        }
+    }
+
+    for (std::size_t step = 0; step + 1 < size; ++step)
+    {
+        const auto sendChunk = (rank + 1 + size - step) % size;
+        const auto receiveChunk = (rank + size - step) % size;
+
+        std::vector<T> outgoing(values.begin() + chunkBegin(sendChunk), values.begin() + chunkBegin(sendChunk + 1));
+        outgoing.resize(incoming.size());
+        communicator.ExchangeBytes(right, outgoing.data(), outgoing.size() * sizeof(T),
+            left, incoming.data(), incoming.size() * sizeof(T));
+
+        std::copy(incoming.begin(), incoming.begin() + chunkSize(receiveChunk), values.begin() + chunkBegin(receiveChunk));
+    }
+}
+
+/*
+    Everything a rank needs to join the group: its rank, every rank's address, and
+    optionally a socket that's already listening on its own address. Connecting is
+    left for later, so that it can overlap with other work.
+*/
+struct Endpoint
+{
+    std::size_t rank;
+    std::vector<Address> addresses;
+    Socket listener;
+    std::chrono::milliseconds timeout = std::chrono::seconds{ 30 };
+
+    Communicator Connect()
+    {
+        if (listener.IsOpen())
+            return Communicator{ rank, addresses, std::move(listener), timeout };
+
+        return Communicator{ rank, addresses, timeout };
+    }
+};
+
+/*
+    Reduces this rank's shard [begin, end) locally and combines the partial with every
+    other rank's. The local reduction runs in parallel, with the tuned configuration,
+    while the connections to the other ranks are being set up, so communication overlaps
+    with the local work instead of adding to it. Every rank gets the full result. As
+    with Reduce, init starts every leaf, so it has to be the identity.
+
+    The local reduction gets a pool of its own rather than the shared ones, since a
+    rank forked from a process whose pools were already running has none of their
+    threads.
+*/
+template<typename Iterator, typename Value, typename BinaryOp>
+Value DistributedReduce(Endpoint endpoint, Iterator begin, Iterator end, Value init, BinaryOp combine)
+{
+    auto localTask = std::async(std::launch::async, [begin, end, &init, &combine]
+    {
+        const auto configuration = Tuning::ConfigurationFor<BinaryOp, Value>(static_cast<std::size_t>(std::distance(begin, end)));
+        ForkJoinPool pool{ configuration.threads, configuration.placement };
+
+        return Tuning::Reduce(pool, begin, end, init, combine, configuration);
+    });
+
+    auto communicator = endpoint.Connect();
+    return RecursiveDoublingAllReduce(communicator, localTask.get(), combine);
+}
+
+/*
+    Runs `fn(endpoint)` in `processes` local processes connected over the loopback
+    interface, and collects what each one returns. It's the same code path as a real
+    multi-host run, just with every address being 127.0.0.1, so the protocols can be
+    tested offline on one machine. A rank that fails (throws, crashes, times out)
+    has no result, and one that's still running after the timeout is killed.
+
+    Every rank's listener is bound to a free port before any process starts, so ports
+    never collide and no rank can try to connect before its peer is listening.
+*/
+template<typename Result, typename Fn>
+std::vector<std::optional<Result>> RunLoopback(std::size_t processes, Fn&& fn,
+    std::chrono::milliseconds timeout = std::chrono::minutes{ 1 })
+{
+    static_assert(std::is_trivially_copyable_v<Result>, "Results are collected through shared memory");
+
+    std::vector<Socket> listeners{};
+    std::vector<Address> addresses{};
+
+    for (std::size_t rank = 0; rank < processes; ++rank)
+    {
+        listeners.push_back(Socket::Listen({ "127.0.0.1", 0 }, static_cast<int>(processes)));
+        addresses.push_back({ "127.0.0.1", listeners.back().Port() });
+    }
+
+    SharedSegment<PublishedSlot<Result>> results{ processes };
+    std::vector<pid_t> workers(processes, -1);
+
+    for (std::size_t rank = 0; rank < processes; ++rank)
+    {
+        const auto pid = ::fork();
+        if (pid == 0)
+        {
+            auto status = 0;
+            try
+            {
+                for (std::size_t other = 0; other < processes; ++other)
+                {
+                    if (other != rank)
+                        listeners[other].Close();
+                }
+
+                Endpoint endpoint{ rank, addresses, std::move(listeners[rank]) };
+                results[rank].Publish(fn(endpoint));
+            }
+            catch (...)
+            {
+                status = 1;
+            }
+
+            ::_exit(status);
+        }
+
+        workers[rank] = pid;
+    }
+
+    listeners.clear();
+
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    auto running = static_cast<std::size_t>(std::count_if(std::begin(workers), std::end(workers), [](pid_t pid) { return pid > 0; }));
+
+    while (running > 0 && std::chrono::steady_clock::now() < deadline)
+    {
+        for (auto& worker : workers)
+        {
+            auto status = 0;
+            if (worker > 0 && ::waitpid(worker, &status, WNOHANG) == worker)
+            {
+                worker = -1;
+                --running;
+            }
+        }
+
+        if (running > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+    }
+
+    // Whatever is left is stuck
+    for (const auto worker : workers)
+    {
+        if (worker <= 0)
+            continue;
+
+        ::kill(worker, SIGKILL);
+
+        auto status = 0;
+        while (::waitpid(worker, &status, 0) == -1 && errno == EINTR) {}
+    }
+
+    std::vector<std::optional<Result>> collected(processes);
+    for (std::size_t rank = 0; rank < processes; ++rank)
+    {
+        if (results[rank].IsPublished())
+            collected[rank] = results[rank].value;
+    }
+
+    return collected;
+}
+
+}
+
+#endif
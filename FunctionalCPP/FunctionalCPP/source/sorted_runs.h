@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fork_join.h"
+
+namespace Monoids
+{
+/*
+    Sorted runs form a monoid under merging: the identity is the empty run, and merging
+    is associative (merging a with b and then c gives the same run as merging b with c
+    first). So every aggregation that has to produce sorted output can be a reduction:
+    merging sorted logs from many machines, combining the sorted partial results of many
+    workers, and even sorting itself, which is just reducing every element as a run of
+    one.
+
+    The merges here are parallel too, so the last few combines at the top of a reduction
+    tree, which are the biggest, don't end up on a single thread. All of them are stable:
+    of two equal elements, the one from the earlier run comes first.
+
+    The elements have to be default constructible, since the output is sized up front and
+    then filled in by several threads at once.
+*/
+namespace Detail
+{
+    // Below this many elements, a merge isn't worth splitting
+    constexpr std::size_t MergeGrain = 16 * 1024;
+
+    /*
+        Merges [lhs, lhsEnd) and [rhs, rhsEnd) into out. The middle of the longer run
+        splits it in two, a binary search finds where that element goes in the shorter run,
+        and the two halves are merged in parallel into their own parts of the output. Ties
+        go to lhs, so the split searches for the first element of rhs not less than the
+        middle of lhs, or the first element of lhs greater than the middle of rhs.
+    */
+    template<typename Lhs, typename Rhs, typename Out, typename Compare>
+    void ParallelMerge(Lhs lhs, Lhs lhsEnd, Rhs rhs, Rhs rhsEnd, Out out, const Compare& compare)
+    {
+        const auto lhsSize = static_cast<std::size_t>(std::distance(lhs, lhsEnd));
+        const auto rhsSize = static_cast<std::size_t>(std::distance(rhs, rhsEnd));
+
+        if (lhsSize + rhsSize <= MergeGrain || lhsSize == 0 || rhsSize == 0)
+        {
+            std::merge(lhs, lhsEnd, rhs, rhsEnd, out, compare);
+            return;
+        }
+
+        Lhs lhsMiddle{};
+        Rhs rhsMiddle{};
+
+        if (lhsSize >= rhsSize)
+        {
+            lhsMiddle = std::next(lhs, lhsSize / 2);
+            rhsMiddle = std::lower_bound(rhs, rhsEnd, *lhsMiddle, compare);
+        }
+        else
+        {
+            rhsMiddle = std::next(rhs, rhsSize / 2);
+            lhsMiddle = std::upper_bound(lhs, lhsEnd, *rhsMiddle, compare);
+        }
+
+        const auto outMiddle = std::next(out, std::distance(lhs, lhsMiddle) + std::distance(rhs, rhsMiddle));
+
+        ForkJoinPool::Default().Fork(
+            [&] { ParallelMerge(lhs, lhsMiddle, rhs, rhsMiddle, out, compare); },
+            [&] { ParallelMerge(lhsMiddle, lhsEnd, rhsMiddle, rhsEnd, outMiddle, compare); });
+    }
+
+    /*
+        Calls fn for every index in [first, last), splitting the range in halves on the
+        fork-join pool
+    */
+    template<typename Fn>
+    void ForEachParallel(std::size_t first, std::size_t last, const Fn& fn)
+    {
+        if (last - first == 1)
+            return fn(first);
+
+        const auto middle = first + (last - first) / 2;
+        ForkJoinPool::Default().Fork([&] { ForEachParallel(first, middle, fn); }, [&] { ForEachParallel(middle, last, fn); });
+    }
+
+    /*
+        Merges every run into out with a heap of the runs' current fronts. The run index
+        breaks ties, which keeps the merge stable.
+    */
+    template<typename Iterator, typename Out, typename Compare>
+    void KWayMerge(std::vector<std::pair<Iterator, Iterator>> runs, Out out, const Compare& compare)
+    {
+        using Front = std::pair<Iterator, std::size_t>;
+
+        auto later = [&compare](const Front& lhs, const Front& rhs)
+        {
+            if (compare(*rhs.first, *lhs.first))
+                return true;
+
+            return !compare(*lhs.first, *rhs.first) && rhs.second < lhs.second;
+        };
+
+        std::priority_queue<Front, std::vector<Front>, decltype(later)> fronts{ later };
+        for (std::size_t i = 0; i < runs.size(); ++i)
+        {
+            if (runs[i].first != runs[i].second)
+                fronts.push({ runs[i].first, i });
+        }
+
+        while (!fronts.empty())
+        {
+            auto [front, run] = fronts.top();
+            fronts.pop();
+
+            *out = *front;
+            ++out;
+
+            if (++front != runs[run].second)
+                fronts.push({ front, run });
+        }
+    }
+}
+
+/*
+    Merges two sorted runs, in parallel when they're big enough
+*/
+template<typename T, typename Compare = std::less<>>
+std::vector<T> Merge(const std::vector<T>& lhs, const std::vector<T>& rhs, const Compare& compare = {})
+{
+    std::vector<T> merged(lhs.size() + rhs.size());
+    Detail::ParallelMerge(std::begin(lhs), std::end(lhs), std::begin(rhs), std::end(rhs), std::begin(merged), compare);
+    return merged;
+}
+
+/*
+    Merges any number of sorted runs at once. Merging them two at a time would copy every
+    element once per level of the merge tree, whereas this copies them once.
+
+    For a parallel merge, the output is cut into parts at splitter values taken from
+    the longest run. A binary search finds each splitter's position in every run, which
+    gives every part its own slice of every run and its own slice of the output, and the
+    parts are merged on separate threads.
+*/
+template<typename T, typename Compare = std::less<>>
+std::vector<T> MergeRuns(const std::vector<std::vector<T>>& runs, const Compare& compare = {})
+{
+    using Iterator = typename std::vector<T>::const_iterator;
+
+    std::size_t total = 0;
+    for (const auto& run : runs)
+        total += run.size();
+
+    std::vector<T> merged(total);
+    if (runs.empty() || total == 0)
+        return merged;
+
+    const auto& longest = *std::max_element(std::begin(runs), std::end(runs),
+        [](const auto& lhs, const auto& rhs) { return lhs.size() < rhs.size(); });
+
+    const auto parts = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()),
+        std::max<std::size_t>(1, total / Detail::MergeGrain));
+
+    // Every part starts at the first element not less than its splitter, in every run
+    std::vector<std::vector<Iterator>> bounds{};
+    bounds.emplace_back();
+    for (const auto& run : runs)
+        bounds.back().push_back(std::begin(run));
+
+    for (std::size_t part = 1; part < parts; ++part)
+    {
+        const auto& splitter = longest[part * longest.size() / parts];
+
+        bounds.emplace_back();
+        for (const auto& run : runs)
+            bounds.back().push_back(std::lower_bound(std::begin(run), std::end(run), splitter, compare));
+    }
+
+    bounds.emplace_back();
+    for (const auto& run : runs)
+        bounds.back().push_back(std::end(run));
+
+    // Where every part starts in the output
+    std::vector<std::size_t> offsets{ 0 };
+    for (std::size_t part = 0; part < parts; ++part)
+    {
+        auto size = offsets.back();
+        for (std::size_t i = 0; i < runs.size(); ++i)
+            size += static_cast<std::size_t>(std::distance(bounds[part][i], bounds[part + 1][i]));
+
+        offsets.push_back(size);
+    }
+
+    auto mergePart = [&](std::size_t part)
+    {
+        std::vector<std::pair<Iterator, Iterator>> slices{};
+        for (std::size_t i = 0; i < runs.size(); ++i)
+            slices.push_back({ bounds[part][i], bounds[part + 1][i] });
+
+        Detail::KWayMerge(std::move(slices), std::next(std::begin(merged), offsets[part]), compare);
+    };
+
+    Detail::ForEachParallel(0, parts, mergePart);
+    return merged;
+}
+
+/*
+    The monoid of sorted runs under merging
+*/
+template<typename T, typename Compare = std::less<>>
+struct SortedRuns
+{
+    using ValueType = std::vector<T>;
+
+    ValueType identity{};
+    Compare compare{};
+
+    ValueType operator()(const ValueType& lhs, const ValueType& rhs) const
+    {
+        return Merge(lhs, rhs, compare);
+    }
+};
+
+namespace Detail
+{
+    template<typename Iterator, typename Compare>
+    auto MergeSort(Iterator first, Iterator last, const Compare& compare, std::size_t load)
+    {
+        using T = typename std::iterator_traits<Iterator>::value_type;
+
+        if (static_cast<std::size_t>(std::distance(first, last)) <= load)
+        {
+            std::vector<T> run(first, last);
+            std::stable_sort(std::begin(run), std::end(run), compare);
+            return run;
+        }
+
+        const auto middle = std::next(first, std::distance(first, last) / 2);
+        auto runs = ForkJoinPool::Default().Fork(
+            [&] { return MergeSort(first, middle, compare, load); },
+            [&] { return MergeSort(middle, last, compare, load); });
+
+        return SortedRuns<T, Compare>{ {}, compare }(runs.first, runs.second);
+    }
+}
+
+/*
+    A stable parallel merge sort, as a reduction: every element is a sorted run of one,
+    and the runs are merged up the same tree Reduce uses, with the halves of every split
+    sorted on the fork-join pool. Folding a leaf's runs of one, one at a time, would be an
+    insertion sort, so the leaves are sorted directly instead, which gives the same run.
+*/
+template<typename Iterator, typename Compare = std::less<>>
+auto ParallelMergeSort(Iterator begin, Iterator end, const Compare& compare = {})
+{
+    const auto size = static_cast<std::size_t>(std::distance(begin, end));
+    const auto load = std::max(Detail::MergeGrain, size / std::max(1u, std::thread::hardware_concurrency()));
+
+    return Detail::MergeSort(begin, end, compare, load);
+}
+
+}
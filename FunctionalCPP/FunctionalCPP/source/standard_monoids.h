@@ -0,0 +1,153 @@
+#pragma once
+
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace Monoids
+{
+/*
+    The experiments pass a monoid around as two loose pieces: an init value and a
+    combining function. The data structures built on top of them need both pieces
+    together, so this bundles them into one object. Anything that has a ValueType,
+    an identity member and a call operator taking two values can be used as a monoid.
+*/
+template<typename T, typename BinaryOp>
+struct Monoid
+{
+    using ValueType = T;
+
+    T identity;
+    BinaryOp combine;
+
+    constexpr T operator()(const T& lhs, const T& rhs) const
+    {
+        return combine(lhs, rhs);
+    }
+};
+
+template<typename T, typename BinaryOp>
+constexpr auto MakeMonoid(T identity, BinaryOp&& combine)
+{
+    return Monoid<T, std::decay_t<BinaryOp>>{ std::move(identity), std::forward<BinaryOp>(combine) };
+}
+
+/*
+    The common arithmetic monoids. Sum and Product are the ones used all over the
+    experiments, and Min and Max are the ones range queries are usually asked about.
+*/
+template<typename T>
+struct Sum
+{
+    using ValueType = T;
+
+    T identity{};
+
+    constexpr T operator()(const T& lhs, const T& rhs) const { return lhs + rhs; }
+};
+
+template<typename T>
+struct Product
+{
+    using ValueType = T;
+
+    T identity{ 1 };
+
+    constexpr T operator()(const T& lhs, const T& rhs) const { return lhs * rhs; }
+};
+
+template<typename T>
+struct Min
+{
+    using ValueType = T;
+
+    T identity{ std::numeric_limits<T>::max() };
+
+    constexpr T operator()(const T& lhs, const T& rhs) const { return rhs < lhs ? rhs : lhs; }
+};
+
+template<typename T>
+struct Max
+{
+    using ValueType = T;
+
+    T identity{ std::numeric_limits<T>::lowest() };
+
+    constexpr T operator()(const T& lhs, const T& rhs) const { return lhs < rhs ? rhs : lhs; }
+};
+
+/*
+    Union and intersection of sets. They work with any set that can Insert an element,
+    Merge another set into itself and IntersectWith another set, like the flat, hash and
+    bit sets. Union folds in single elements too, so LeftFold and Reduce can collect a
+    range of elements straight into a set. The maps can be unioned as well, and combine
+    the values of keys they share.
+
+    The combines take the left set by value, and the folds move their running value in,
+    so it grows in place instead of being copied on every step.
+
+    Intersection has no identity among the sets, since that would be the set of
+    everything, so its values are optional sets, and an empty one stands for everything.
+*/
+template<typename Set>
+struct Union
+{
+    using ValueType = Set;
+
+    Set identity{};
+
+    Set operator()(Set lhs, const Set& rhs) const
+    {
+        lhs.Merge(rhs);
+        return lhs;
+    }
+
+    template<typename Element, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Element>, Set>>>
+    Set operator()(Set lhs, const Element& element) const
+    {
+        lhs.Insert(element);
+        return lhs;
+    }
+};
+
+template<typename Set>
+struct Intersection
+{
+    using ValueType = std::optional<Set>;
+
+    ValueType identity{};
+
+    ValueType operator()(ValueType lhs, const ValueType& rhs) const
+    {
+        if (!lhs)
+            return rhs;
+
+        if (rhs)
+            lhs->IntersectWith(*rhs);
+
+        return lhs;
+    }
+};
+
+/*
+    A monoid is idempotent when A + A = A. Overlapping ranges can then be combined
+    without counting anything twice, which is what the sparse table relies on.
+    Specialize this for user-defined monoids that have the property.
+*/
+template<typename MonoidType>
+struct IsIdempotent : std::false_type {};
+
+template<typename T>
+struct IsIdempotent<Min<T>> : std::true_type {};
+
+template<typename T>
+struct IsIdempotent<Max<T>> : std::true_type {};
+
+template<typename Set>
+struct IsIdempotent<Intersection<Set>> : std::true_type {};
+
+template<typename MonoidType>
+constexpr bool IsIdempotentV = IsIdempotent<MonoidType>::value;
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_dispatch.h"
+
+namespace Monoids
+{
+/*
+    A reduction over an array much larger than the last level cache is limited by memory
+    bandwidth, not arithmetic. Two things help there:
+
+    1. Prefetching far enough ahead of the read pointer that every line has arrived by the
+        time it's needed. The right distance depends on the machine's memory latency and
+        how fast the kernel consumes data, so it's a knob rather than a constant.
+
+    2. Keeping the data from evicting everything else. Every element is read exactly once,
+        so caching it is pointless, and pushing the caller's working set out of the cache
+        to make room for it is worse. Non-temporal prefetches (prefetchnta on x86) bring
+        the lines in close to the core while keeping them out of the rest of the hierarchy.
+        (Non-temporal loads, movntdqa, only skip the cache on write-combining memory, so on
+        ordinary memory the prefetch hint is what actually has the effect.)
+
+    The settings are passed to every kernel call in its KernelOptions. Tuning::TuneReduce
+    measures them along with everything else about a reduction and keeps the fastest in
+    the machine's profile, which is where Reduce gets them from.
+*/
+namespace Kernels
+{
+    struct StreamingOptions
+    {
+        // How far ahead of the read pointer to prefetch. 0 turns prefetching off.
+        std::size_t prefetchBytes = 512;
+
+        // Prefetch with the non-temporal hint, so the data doesn't displace other lines
+        bool nonTemporal = false;
+    };
+
+    namespace Detail
+    {
+        /*
+            An address bytes past pointer, which may be past the end of the range. That's
+            fine for a prefetch, but not for pointer arithmetic, so it's done on integers.
+        */
+        inline const void* Ahead(const void* pointer, std::size_t bytes)
+        {
+            return reinterpret_cast<const void*>(reinterpret_cast<std::uintptr_t>(pointer) + bytes);
+        }
+    }
+
+    /*
+        Issues the prefetches for a block of blockBytes starting at block, one per cache line
+    */
+    inline void PrefetchBlock(const void* block, std::size_t blockBytes, const StreamingOptions& options)
+    {
+        if (options.prefetchBytes == 0)
+            return;
+
+        for (std::size_t offset = 0; offset < blockBytes; offset += CacheLineSize)
+        {
+            const auto address = Detail::Ahead(block, options.prefetchBytes + offset);
+
+            if (options.nonTemporal)
+                PrefetchNonTemporal(address);
+            else
+                Prefetch(address);
+        }
+    }
+}
+
+}
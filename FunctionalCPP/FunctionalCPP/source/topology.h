@@ -0,0 +1,400 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Monoids
+{
+/*
+    Where the threads of a reduction run matters as much as how many there are. Two
+    threads on the SMT siblings of one core share its execution units and are barely
+    faster than one, and two halves of a split that live under different L3 caches (or
+    NUMA nodes) pay for every cache line they pass between them.
+
+    The topology is read from sysfs: which logical CPUs are SMT siblings of one core,
+    which cores share an L3, and which NUMA node each one belongs to. Everywhere else,
+    or when sysfs isn't there, it's a flat list of independent CPUs.
+*/
+
+/*
+    How to choose CPUs for a number of threads:
+
+        Compact             fill each L3 domain, SMT siblings included, before the next
+        Scatter             one thread per L3 domain in turn, physical cores before siblings
+        PhysicalCoresOnly   never two threads on one core
+*/
+enum class PlacementPolicy
+{
+    None,
+    Compact,
+    Scatter,
+    PhysicalCoresOnly,
+};
+
+inline const char* ToString(PlacementPolicy policy)
+{
+    switch (policy)
+    {
+    case PlacementPolicy::Compact: return "compact";
+    case PlacementPolicy::Scatter: return "scatter";
+    case PlacementPolicy::PhysicalCoresOnly: return "physical";
+    default: return "none";
+    }
+}
+
+inline bool ParsePlacementPolicy(const std::string& name, PlacementPolicy& policy)
+{
+    for (const auto candidate : { PlacementPolicy::None, PlacementPolicy::Compact, PlacementPolicy::Scatter, PlacementPolicy::PhysicalCoresOnly })
+    {
+        if (name == ToString(candidate))
+        {
+            policy = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct LogicalCpu
+{
+    // The number the OS knows it by, which is what gets pinned to
+    unsigned id{};
+
+    // Numbered from 0 across the machine, not the per-package ids sysfs uses
+    unsigned core{};
+
+    // Which of the core's SMT siblings this is, 0 for the first
+    unsigned thread{};
+
+    // The lowest CPU id sharing this CPU's L3
+    unsigned cache{};
+
+    unsigned node{};
+};
+
+namespace Detail
+{
+    inline std::string ReadLine(const std::filesystem::path& path)
+    {
+        std::ifstream file{ path };
+        std::string line{};
+        std::getline(file, line);
+        return line;
+    }
+
+    /*
+        Parses sysfs CPU lists like "0-3,8,10-11"
+    */
+    inline std::vector<unsigned> ParseCpuList(const std::string& list)
+    {
+        std::vector<unsigned> cpus{};
+        std::istringstream ranges{ list };
+        std::string range{};
+
+        while (std::getline(ranges, range, ','))
+        {
+            unsigned first{}, last{};
+            char dash{};
+            std::istringstream parts{ range };
+
+            if (!(parts >> first))
+                continue;
+
+            last = (parts >> dash >> last) ? last : first;
+            for (auto cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+
+        return cpus;
+    }
+
+    inline unsigned ReadUnsigned(const std::filesystem::path& path, unsigned fallback)
+    {
+        std::istringstream line{ ReadLine(path) };
+        unsigned value{};
+        return (line >> value) ? value : fallback;
+    }
+}
+
+class Topology
+{
+public:
+
+    /*
+        Every CPU independent of every other: one core each, one L3, one node
+    */
+    static Topology Flat(unsigned count)
+    {
+        Topology topology{};
+
+        for (auto i = 0u; i < std::max(1u, count); ++i)
+            topology.cpus.push_back({ i, i, 0, 0, 0 });
+
+        return topology;
+    }
+
+    /*
+        Reads the topology from sysfs, restricted to the CPUs this process may run on
+        (containers and taskset narrow that down). Falls back to Flat.
+
+        The sysfs directory can be pointed at a copy, to plan for a machine other than
+        this one. This process's affinity says nothing about that machine, so a copy
+        isn't restricted.
+    */
+    static Topology Discover(const std::filesystem::path& sysfs = SystemSysfs())
+    {
+        namespace fs = std::filesystem;
+        const auto root = sysfs / "cpu";
+
+        auto online = Detail::ParseCpuList(Detail::ReadLine(root / "online"));
+        if (sysfs == SystemSysfs())
+            online.erase(std::remove_if(std::begin(online), std::end(online), [](unsigned cpu) { return !IsAllowed(cpu); }), std::end(online));
+
+        if (online.empty())
+            return Flat(std::thread::hardware_concurrency());
+
+        std::map<unsigned, unsigned> nodes{};
+        std::error_code error{};
+
+        for (const auto& entry : fs::directory_iterator{ sysfs / "node", error })
+        {
+            const auto name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+                continue;
+
+            for (const auto cpu : Detail::ParseCpuList(Detail::ReadLine(entry.path() / "cpulist")))
+                nodes[cpu] = static_cast<unsigned>(std::stoul(name.substr(4)));
+        }
+
+        Topology topology{};
+        std::map<std::pair<unsigned, unsigned>, unsigned> cores{};
+
+        for (const auto id : online)
+        {
+            const auto cpu = root / ("cpu" + std::to_string(id));
+
+            const auto package = Detail::ReadUnsigned(cpu / "topology" / "physical_package_id", 0);
+            const auto coreId = Detail::ReadUnsigned(cpu / "topology" / "core_id", id);
+            const auto core = cores.emplace(std::make_pair(package, coreId), static_cast<unsigned>(cores.size())).first->second;
+
+            auto siblings = Detail::ParseCpuList(Detail::ReadLine(cpu / "topology" / "thread_siblings_list"));
+            const auto thread = static_cast<unsigned>(std::distance(std::begin(siblings), std::find(std::begin(siblings), std::end(siblings), id)));
+
+            const auto node = nodes.count(id) ? nodes[id] : 0u;
+            topology.cpus.push_back({ id, core, siblings.empty() ? 0u : thread, SharedCacheOf(cpu, package), node });
+        }
+
+        return topology;
+    }
+
+    /*
+        Discovered once, the first time it's asked for
+    */
+    static const Topology& Current()
+    {
+        static const Topology topology = Discover();
+        return topology;
+    }
+
+    const std::vector<LogicalCpu>& Cpus() const
+    {
+        return cpus;
+    }
+
+    std::size_t Cores() const
+    {
+        return static_cast<std::size_t>(std::count_if(std::begin(cpus), std::end(cpus),
+            [](const LogicalCpu& cpu) { return cpu.thread == 0; }));
+    }
+
+    /*
+        The CPUs for threads workers, in worker order. Which CPUs are chosen depends on
+        the policy, but the order doesn't: it's grouped by node, then L3, then core. A
+        reduction that splits its workers in halves, and the halves in halves, then has
+        every subtree on as few caches as possible, so the partial results it combines
+        are still close by. With more threads than CPUs, the plan wraps around.
+    */
+    std::vector<unsigned> Plan(PlacementPolicy policy, unsigned threads) const
+    {
+        if (policy == PlacementPolicy::None || threads == 0)
+            return {};
+
+        auto chosen = Choose(policy, threads);
+        std::sort(std::begin(chosen), std::end(chosen), [](const LogicalCpu& lhs, const LogicalCpu& rhs)
+        {
+            return std::tie(lhs.node, lhs.cache, lhs.core, lhs.thread) < std::tie(rhs.node, rhs.cache, rhs.core, rhs.thread);
+        });
+
+        std::vector<unsigned> plan{};
+        for (auto i = 0u; i < threads; ++i)
+            plan.push_back(chosen[i % chosen.size()].id);
+
+        return plan;
+    }
+
+private:
+
+    static std::filesystem::path SystemSysfs()
+    {
+        return "/sys/devices/system";
+    }
+
+    static bool IsAllowed(unsigned cpu)
+    {
+#if defined(__linux__)
+        cpu_set_t allowed{};
+        CPU_ZERO(&allowed);
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || cpu >= CPU_SETSIZE)
+            return true;
+
+        return CPU_ISSET(cpu, &allowed);
+#else
+        (void)cpu;
+        return true;
+#endif
+    }
+
+    /*
+        The lowest CPU sharing the last level cache, which names the cache domain.
+        Machines without an L3 use the package instead.
+    */
+    static unsigned SharedCacheOf(const std::filesystem::path& cpu, unsigned package)
+    {
+        std::error_code error{};
+
+        for (const auto& entry : std::filesystem::directory_iterator{ cpu / "cache", error })
+        {
+            if (entry.path().filename().string().rfind("index", 0) != 0 || Detail::ReadUnsigned(entry.path() / "level", 0) != 3)
+                continue;
+
+            const auto shared = Detail::ParseCpuList(Detail::ReadLine(entry.path() / "shared_cpu_list"));
+            if (!shared.empty())
+                return *std::min_element(std::begin(shared), std::end(shared));
+        }
+
+        return package;
+    }
+
+    std::vector<LogicalCpu> Choose(PlacementPolicy policy, unsigned threads) const
+    {
+        auto candidates = cpus;
+
+        if (policy == PlacementPolicy::PhysicalCoresOnly)
+        {
+            candidates.erase(std::remove_if(std::begin(candidates), std::end(candidates),
+                [](const LogicalCpu& cpu) { return cpu.thread != 0; }), std::end(candidates));
+        }
+
+        if (policy == PlacementPolicy::Scatter)
+        {
+            // Deal the cores out across the caches like cards: the first core under every
+            // L3, then the second under every L3, and so on, with SMT siblings only once
+            // every core has a thread
+            std::sort(std::begin(candidates), std::end(candidates), [](const LogicalCpu& lhs, const LogicalCpu& rhs)
+            {
+                return std::tie(lhs.thread, lhs.node, lhs.cache, lhs.core) < std::tie(rhs.thread, rhs.node, rhs.cache, rhs.core);
+            });
+
+            std::map<std::pair<unsigned, unsigned>, unsigned> dealt{};
+            std::vector<std::pair<unsigned, LogicalCpu>> hands{};
+
+            for (const auto& cpu : candidates)
+                hands.push_back({ dealt[{ cpu.thread, cpu.cache }]++, cpu });
+
+            std::stable_sort(std::begin(hands), std::end(hands), [](const auto& lhs, const auto& rhs)
+            {
+                return std::tie(lhs.second.thread, lhs.first) < std::tie(rhs.second.thread, rhs.first);
+            });
+
+            candidates.clear();
+            for (const auto& hand : hands)
+                candidates.push_back(hand.second);
+        }
+        else
+        {
+            std::sort(std::begin(candidates), std::end(candidates), [](const LogicalCpu& lhs, const LogicalCpu& rhs)
+            {
+                return std::tie(lhs.node, lhs.cache, lhs.core, lhs.thread) < std::tie(rhs.node, rhs.cache, rhs.core, rhs.thread);
+            });
+        }
+
+        if (candidates.size() > threads)
+            candidates.resize(threads);
+
+        return candidates;
+    }
+
+private:
+
+    std::vector<LogicalCpu> cpus{};
+};
+
+/*
+    Pins the calling thread to one CPU for as long as it's alive, then puts back the
+    affinity the thread had before. Does nothing where pinning isn't supported.
+*/
+class ScopedPin
+{
+public:
+
+    explicit ScopedPin(unsigned cpu)
+    {
+#if defined(__linux__)
+        if (cpu >= CPU_SETSIZE)
+            return;
+
+        CPU_ZERO(&previous);
+        if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0)
+            return;
+
+        cpu_set_t target{};
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
+
+        pinned = pthread_setaffinity_np(pthread_self(), sizeof(target), &target) == 0;
+#else
+        (void)cpu;
+#endif
+    }
+
+    ScopedPin(const ScopedPin&) = delete;
+    ScopedPin& operator=(const ScopedPin&) = delete;
+
+    ~ScopedPin()
+    {
+#if defined(__linux__)
+        if (pinned)
+            pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+#endif
+    }
+
+    bool Pinned() const
+    {
+        return pinned;
+    }
+
+private:
+
+#if defined(__linux__)
+    cpu_set_t previous{};
+#endif
+    bool pinned{};
+};
+
+}